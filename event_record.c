@@ -0,0 +1,236 @@
+/**
+ * Copyright (C) 2023, Axis Communications AB, Lund, Sweden
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <assert.h>
+
+#include "event_record.h"
+#include "modbusacap_common.h"
+
+// A recording is a sequence of sessions, one for each time it was opened.
+// A session starts with a header with topic_length 0 and the wall clock
+// time in microseconds. It is followed by records, each one a header and
+// topic_length bytes of topic2 (not NUL terminated); their times are in
+// microseconds of the monotonic clock and only meaningful relative to the
+// other records of the session. Records are appended in native byte order.
+struct record_header
+{
+    gint64 time;
+    guint8 active;
+    guint8 topic_length;
+} __attribute__((packed));
+
+// Events replayed per main loop iteration at maximum speed
+#define REPLAY_BURST 64
+
+static FILE *record_file = NULL;
+
+static struct
+{
+    FILE *file;
+    guint speed;
+    EventReplayCallback callback;
+    guint source;
+    gint64 start;
+    guint count;
+    struct record_header next;
+    // Time of the next event relative to the first one
+    gint64 time;
+    // Added to the record times of the current session
+    gint64 offset;
+    gboolean new_session;
+    gchar topic2[G_MAXUINT8 + 1];
+} replay;
+
+gboolean event_record_open(const gchar *path)
+{
+    assert(NULL != path);
+    event_record_close();
+    record_file = fopen(path, "ab");
+    if (NULL == record_file)
+    {
+        LOG_E("%s/%s: Failed to open %s (%s)", __FILE__, __FUNCTION__, path, strerror(errno));
+        return FALSE;
+    }
+
+    // The monotonic clock restarts with the device, so times are not
+    // comparable with those of earlier sessions
+    struct record_header session = {.time = g_get_real_time(), .active = FALSE, .topic_length = 0};
+    if (1 != fwrite(&session, sizeof(session), 1, record_file) || 0 != fflush(record_file))
+    {
+        LOG_E("%s/%s: Failed to write %s (%s)", __FILE__, __FUNCTION__, path, strerror(errno));
+        event_record_close();
+        return FALSE;
+    }
+    LOG_I("%s/%s: Recording events to %s", __FILE__, __FUNCTION__, path);
+    return TRUE;
+}
+
+void event_record_write(const gchar *topic2, const gboolean active, const gint64 time)
+{
+    if (NULL == record_file)
+    {
+        return;
+    }
+
+    const gsize len = MIN(strlen(topic2), G_MAXUINT8);
+    if (0 == len)
+    {
+        // Would read back as a session header
+        return;
+    }
+    struct record_header header = {.time = time, .active = active, .topic_length = len};
+    if (1 != fwrite(&header, sizeof(header), 1, record_file) || len != fwrite(topic2, 1, len, record_file) ||
+        0 != fflush(record_file))
+    {
+        LOG_E("%s/%s: Failed to write record (%s)", __FILE__, __FUNCTION__, strerror(errno));
+    }
+}
+
+void event_record_close(void)
+{
+    if (NULL != record_file)
+    {
+        fclose(record_file);
+        record_file = NULL;
+    }
+}
+
+// Read the next event; the first event of a session follows the last one
+// of the previous session without delay
+static gboolean read_next(void)
+{
+    for (;;)
+    {
+        if (1 != fread(&replay.next, sizeof(replay.next), 1, replay.file))
+        {
+            return FALSE;
+        }
+        if (0 != replay.next.topic_length)
+        {
+            break;
+        }
+        replay.new_session = TRUE;
+    }
+    if (replay.next.topic_length != fread(replay.topic2, 1, replay.next.topic_length, replay.file))
+    {
+        return FALSE;
+    }
+    replay.topic2[replay.next.topic_length] = '\0';
+
+    if (replay.new_session)
+    {
+        replay.offset = replay.time - replay.next.time;
+        replay.new_session = FALSE;
+    }
+    replay.time = replay.next.time + replay.offset;
+    return TRUE;
+}
+
+static void replay_done(void)
+{
+    const gint64 elapsed = g_get_monotonic_time() - replay.start;
+    LOG_I(
+        "%s/%s: Replayed %u events in %lld ms (%.0f events/s)",
+        __FILE__,
+        __FUNCTION__,
+        replay.count,
+        (long long)(elapsed / 1000),
+        0 < elapsed ? (gdouble)replay.count * G_USEC_PER_SEC / elapsed : 0.0);
+    fclose(replay.file);
+    replay.file = NULL;
+    replay.source = 0;
+}
+
+static gboolean replay_event(gpointer data);
+
+// Schedule the next event relative to the start of the replay
+static void schedule_next(void)
+{
+    if (0 == replay.speed)
+    {
+        replay.source = g_idle_add(replay_event, NULL);
+        return;
+    }
+    const gint64 due = replay.start + replay.time / replay.speed;
+    const gint64 delay = MAX(0, due - g_get_monotonic_time());
+    replay.source = g_timeout_add(delay / 1000, replay_event, NULL);
+}
+
+static gboolean replay_event(gpointer data)
+{
+    (void)data;
+    guint burst = 0 == replay.speed ? REPLAY_BURST : 1;
+
+    do
+    {
+        replay.callback(replay.topic2, replay.next.active);
+        replay.count++;
+        if (!read_next())
+        {
+            replay_done();
+            return G_SOURCE_REMOVE;
+        }
+    } while (0 < --burst);
+
+    schedule_next();
+    return G_SOURCE_REMOVE;
+}
+
+gboolean event_replay_start(const gchar *path, const guint speed, EventReplayCallback callback)
+{
+    assert(NULL != path);
+    assert(NULL != callback);
+    event_replay_stop();
+
+    replay.time = 0;
+    replay.offset = 0;
+    // Also recordings from before sessions were marked
+    replay.new_session = TRUE;
+    replay.file = fopen(path, "rb");
+    if (NULL == replay.file)
+    {
+        LOG_E("%s/%s: Failed to open %s (%s)", __FILE__, __FUNCTION__, path, strerror(errno));
+        return FALSE;
+    }
+    if (!read_next())
+    {
+        LOG_E("%s/%s: No events in %s", __FILE__, __FUNCTION__, path);
+        fclose(replay.file);
+        replay.file = NULL;
+        return FALSE;
+    }
+
+    LOG_I("%s/%s: Replaying %s at speed %u (0 is maximum)", __FILE__, __FUNCTION__, path, speed);
+    replay.speed = speed;
+    replay.callback = callback;
+    replay.start = g_get_monotonic_time();
+    replay.count = 0;
+    schedule_next();
+    return TRUE;
+}
+
+void event_replay_stop(void)
+{
+    if (NULL == replay.file)
+    {
+        return;
+    }
+    if (0 != replay.source)
+    {
+        g_source_remove(replay.source);
+    }
+    replay_done();
+}
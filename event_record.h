@@ -0,0 +1,32 @@
+/**
+ * Copyright (C) 2023, Axis Communications AB, Lund, Sweden
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _EVENT_RECORD_H_
+#define _EVENT_RECORD_H_
+
+#include <glib.h>
+
+typedef void (*EventReplayCallback)(const gchar *topic2, const gboolean active);
+
+gboolean event_record_open(const gchar *path);
+void event_record_write(const gchar *topic2, const gboolean active, const gint64 time);
+void event_record_close(void);
+
+// Replay a recording at speed times real time, or as fast as possible if speed is 0
+gboolean event_replay_start(const gchar *path, const guint speed, EventReplayCallback callback);
+void event_replay_stop(void);
+
+#endif /* _EVENT_RECORD_H_ */
@@ -0,0 +1,503 @@
+/**
+ * Copyright (C) 2023, Axis Communications AB, Lund, Sweden
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdarg.h>
+
+#include "axevent.h"
+#include "host.h"
+
+struct value
+{
+    AXEventValueType type;
+    gboolean any; // Set without a value, matches any value in a subscription
+    gint integer;
+    gdouble number;
+    gchar *string;
+};
+
+struct _AXEventKeyValueSet
+{
+    // Values by "name_space:key"
+    GHashTable *values;
+};
+
+struct _AXEvent
+{
+    AXEventKeyValueSet *key_value_set;
+};
+
+struct subscription
+{
+    guint id;
+    AXEventKeyValueSet *key_value_set;
+    AXSubscriptionCallback callback;
+    gpointer user_data;
+};
+
+struct _AXEventHandler
+{
+    GList *subscriptions;
+    GHashTable *declarations;
+};
+
+struct publication
+{
+    gchar *topic2;
+    gboolean active;
+};
+
+// The handlers that published events are delivered to
+static GMutex lock;
+static GList *handlers = NULL;
+static guint next_id = 1;
+static volatile gint events_sent = 0;
+
+static void free_value(gpointer data)
+{
+    struct value *value = data;
+    g_free(value->string);
+    g_free(value);
+}
+
+static gchar *value_key(const gchar *key, const gchar *name_space)
+{
+    return g_strdup_printf("%s:%s", NULL != name_space ? name_space : "", key);
+}
+
+static const struct value *lookup(const AXEventKeyValueSet *key_value_set, const gchar *key, const gchar *name_space)
+{
+    gchar *k = value_key(key, name_space);
+    const struct value *value = g_hash_table_lookup(key_value_set->values, k);
+    g_free(k);
+    return value;
+}
+
+static gboolean fail(GError **error, const gchar *message, const gchar *key)
+{
+    g_set_error(error, g_quark_from_static_string("axevent"), 0, "%s: %s", message, key);
+    return FALSE;
+}
+
+AXEventKeyValueSet *ax_event_key_value_set_new(void)
+{
+    AXEventKeyValueSet *key_value_set = g_new0(AXEventKeyValueSet, 1);
+    key_value_set->values = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, free_value);
+    return key_value_set;
+}
+
+void ax_event_key_value_set_free(AXEventKeyValueSet *key_value_set)
+{
+    if (NULL == key_value_set)
+    {
+        return;
+    }
+    g_hash_table_destroy(key_value_set->values);
+    g_free(key_value_set);
+}
+
+static AXEventKeyValueSet *copy_key_value_set(const AXEventKeyValueSet *key_value_set)
+{
+    AXEventKeyValueSet *copy = ax_event_key_value_set_new();
+    GHashTableIter iter;
+    gpointer k;
+    gpointer v;
+
+    g_hash_table_iter_init(&iter, key_value_set->values);
+    while (g_hash_table_iter_next(&iter, &k, &v))
+    {
+        struct value *value = g_memdup2(v, sizeof(struct value));
+        value->string = g_strdup(value->string);
+        g_hash_table_insert(copy->values, g_strdup(k), value);
+    }
+    return copy;
+}
+
+gboolean ax_event_key_value_set_add_key_value(
+    AXEventKeyValueSet *key_value_set,
+    const gchar *key,
+    const gchar *name_space,
+    gconstpointer value,
+    AXEventValueType value_type,
+    GError **error)
+{
+    if (NULL == key_value_set || NULL == key)
+    {
+        return fail(error, "Invalid key", NULL != key ? key : "(null)");
+    }
+
+    struct value *v = g_new0(struct value, 1);
+    v->type = value_type;
+    v->any = NULL == value;
+    if (!v->any)
+    {
+        switch (value_type)
+        {
+        case AX_VALUE_TYPE_INT:
+            v->integer = *(const gint *)value;
+            break;
+        case AX_VALUE_TYPE_BOOL:
+            v->integer = *(const gboolean *)value;
+            break;
+        case AX_VALUE_TYPE_DOUBLE:
+            v->number = *(const gdouble *)value;
+            break;
+        case AX_VALUE_TYPE_STRING:
+        case AX_VALUE_TYPE_ELEMENT:
+            v->string = g_strdup(value);
+            break;
+        }
+    }
+    g_hash_table_insert(key_value_set->values, value_key(key, name_space), v);
+    return TRUE;
+}
+
+gboolean ax_event_key_value_set_add_key_values(AXEventKeyValueSet *key_value_set, GError **error, ...)
+{
+    va_list ap;
+    gboolean result = TRUE;
+
+    va_start(ap, error);
+    for (const gchar *key = va_arg(ap, const gchar *); NULL != key && result; key = va_arg(ap, const gchar *))
+    {
+        const gchar *name_space = va_arg(ap, const gchar *);
+        gconstpointer value = va_arg(ap, gconstpointer);
+        const AXEventValueType value_type = va_arg(ap, AXEventValueType);
+        result = ax_event_key_value_set_add_key_value(key_value_set, key, name_space, value, value_type, error);
+    }
+    va_end(ap);
+    return result;
+}
+
+gboolean ax_event_key_value_set_mark_as_source(
+    AXEventKeyValueSet *key_value_set,
+    const gchar *key,
+    const gchar *name_space,
+    GError **error)
+{
+    return NULL != lookup(key_value_set, key, name_space) || fail(error, "No such key", key);
+}
+
+gboolean ax_event_key_value_set_mark_as_data(
+    AXEventKeyValueSet *key_value_set,
+    const gchar *key,
+    const gchar *name_space,
+    GError **error)
+{
+    return NULL != lookup(key_value_set, key, name_space) || fail(error, "No such key", key);
+}
+
+static const struct value *get_value(
+    const AXEventKeyValueSet *key_value_set,
+    const gchar *key,
+    const gchar *name_space,
+    const AXEventValueType value_type,
+    GError **error)
+{
+    const struct value *value = lookup(key_value_set, key, name_space);
+    if (NULL == value || value->any)
+    {
+        fail(error, "No value for key", key);
+        return NULL;
+    }
+    if (value_type != value->type)
+    {
+        fail(error, "Wrong type for key", key);
+        return NULL;
+    }
+    return value;
+}
+
+gboolean ax_event_key_value_set_get_integer(
+    const AXEventKeyValueSet *key_value_set,
+    const gchar *key,
+    const gchar *name_space,
+    gint *value,
+    GError **error)
+{
+    const struct value *v = get_value(key_value_set, key, name_space, AX_VALUE_TYPE_INT, error);
+    if (NULL == v)
+    {
+        return FALSE;
+    }
+    *value = v->integer;
+    return TRUE;
+}
+
+gboolean ax_event_key_value_set_get_boolean(
+    const AXEventKeyValueSet *key_value_set,
+    const gchar *key,
+    const gchar *name_space,
+    gboolean *value,
+    GError **error)
+{
+    const struct value *v = get_value(key_value_set, key, name_space, AX_VALUE_TYPE_BOOL, error);
+    if (NULL == v)
+    {
+        return FALSE;
+    }
+    *value = v->integer;
+    return TRUE;
+}
+
+gboolean ax_event_key_value_set_get_string(
+    const AXEventKeyValueSet *key_value_set,
+    const gchar *key,
+    const gchar *name_space,
+    gchar **value,
+    GError **error)
+{
+    const struct value *v = get_value(key_value_set, key, name_space, AX_VALUE_TYPE_STRING, error);
+    if (NULL == v)
+    {
+        return FALSE;
+    }
+    *value = g_strdup(v->string);
+    return TRUE;
+}
+
+AXEvent *ax_event_new2(AXEventKeyValueSet *key_value_set, GDateTime *time_stamp)
+{
+    (void)time_stamp;
+    AXEvent *event = g_new0(AXEvent, 1);
+    event->key_value_set = copy_key_value_set(key_value_set);
+    return event;
+}
+
+void ax_event_free(AXEvent *event)
+{
+    if (NULL == event)
+    {
+        return;
+    }
+    ax_event_key_value_set_free(event->key_value_set);
+    g_free(event);
+}
+
+const AXEventKeyValueSet *ax_event_get_key_value_set(const AXEvent *event)
+{
+    return event->key_value_set;
+}
+
+AXEventHandler *ax_event_handler_new(void)
+{
+    AXEventHandler *event_handler = g_new0(AXEventHandler, 1);
+    event_handler->declarations = g_hash_table_new(g_direct_hash, g_direct_equal);
+    g_mutex_lock(&lock);
+    handlers = g_list_prepend(handlers, event_handler);
+    g_mutex_unlock(&lock);
+    return event_handler;
+}
+
+static void free_subscription(gpointer data)
+{
+    struct subscription *subscription = data;
+    ax_event_key_value_set_free(subscription->key_value_set);
+    g_free(subscription);
+}
+
+void ax_event_handler_free(AXEventHandler *event_handler)
+{
+    if (NULL == event_handler)
+    {
+        return;
+    }
+    g_mutex_lock(&lock);
+    handlers = g_list_remove(handlers, event_handler);
+    g_mutex_unlock(&lock);
+    g_list_free_full(event_handler->subscriptions, free_subscription);
+    g_hash_table_destroy(event_handler->declarations);
+    g_free(event_handler);
+}
+
+gboolean ax_event_handler_declare(
+    AXEventHandler *event_handler,
+    AXEventKeyValueSet *key_value_set,
+    gboolean stateless,
+    guint *declaration,
+    AXDeclarationCompleteCallback callback,
+    gpointer user_data,
+    GError **error)
+{
+    (void)key_value_set;
+    (void)stateless;
+    (void)error;
+    g_mutex_lock(&lock);
+    *declaration = next_id++;
+    g_hash_table_add(event_handler->declarations, GUINT_TO_POINTER(*declaration));
+    g_mutex_unlock(&lock);
+    if (NULL != callback)
+    {
+        callback(*declaration, user_data);
+    }
+    return TRUE;
+}
+
+gboolean ax_event_handler_undeclare(AXEventHandler *event_handler, guint declaration, GError **error)
+{
+    g_mutex_lock(&lock);
+    const gboolean removed = g_hash_table_remove(event_handler->declarations, GUINT_TO_POINTER(declaration));
+    g_mutex_unlock(&lock);
+    return removed || fail(error, "No such declaration", "undeclare");
+}
+
+gboolean ax_event_handler_send_event(AXEventHandler *event_handler, guint declaration, AXEvent *event, GError **error)
+{
+    (void)event;
+    g_mutex_lock(&lock);
+    const gboolean declared = g_hash_table_contains(event_handler->declarations, GUINT_TO_POINTER(declaration));
+    g_mutex_unlock(&lock);
+    if (!declared)
+    {
+        return fail(error, "No such declaration", "send");
+    }
+    g_atomic_int_inc(&events_sent);
+    return TRUE;
+}
+
+gboolean ax_event_handler_subscribe(
+    AXEventHandler *event_handler,
+    AXEventKeyValueSet *key_value_set,
+    guint *subscription,
+    AXSubscriptionCallback callback,
+    gpointer user_data,
+    GError **error)
+{
+    (void)error;
+    struct subscription *s = g_new0(struct subscription, 1);
+    s->key_value_set = copy_key_value_set(key_value_set);
+    s->callback = callback;
+    s->user_data = user_data;
+    g_mutex_lock(&lock);
+    s->id = next_id++;
+    event_handler->subscriptions = g_list_append(event_handler->subscriptions, s);
+    g_mutex_unlock(&lock);
+    *subscription = s->id;
+    return TRUE;
+}
+
+gboolean ax_event_handler_unsubscribe(AXEventHandler *event_handler, guint subscription, GError **error)
+{
+    g_mutex_lock(&lock);
+    for (GList *l = event_handler->subscriptions; NULL != l; l = l->next)
+    {
+        struct subscription *s = l->data;
+        if (subscription == s->id)
+        {
+            event_handler->subscriptions = g_list_delete_link(event_handler->subscriptions, l);
+            g_mutex_unlock(&lock);
+            free_subscription(s);
+            return TRUE;
+        }
+    }
+    g_mutex_unlock(&lock);
+    return fail(error, "No such subscription", "unsubscribe");
+}
+
+// Every value in the subscription must be in the event, or set without a value
+static gboolean matches(const AXEventKeyValueSet *subscription, const AXEventKeyValueSet *event)
+{
+    GHashTableIter iter;
+    gpointer k;
+    gpointer v;
+
+    g_hash_table_iter_init(&iter, subscription->values);
+    while (g_hash_table_iter_next(&iter, &k, &v))
+    {
+        const struct value *wanted = v;
+        const struct value *value = g_hash_table_lookup(event->values, k);
+        if (wanted->any)
+        {
+            continue;
+        }
+        if (NULL == value || wanted->type != value->type || wanted->integer != value->integer ||
+            wanted->number != value->number || 0 != g_strcmp0(wanted->string, value->string))
+        {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+static gboolean deliver(gpointer data)
+{
+    struct publication *publication = data;
+    AXEventKeyValueSet *key_value_set = ax_event_key_value_set_new();
+    ax_event_key_value_set_add_key_values(
+        key_value_set,
+        NULL,
+        "topic0",
+        "tnsaxis",
+        "CameraApplicationPlatform",
+        AX_VALUE_TYPE_STRING,
+        "topic1",
+        "tnsaxis",
+        "ObjectAnalytics",
+        AX_VALUE_TYPE_STRING,
+        "topic2",
+        "tnsaxis",
+        publication->topic2,
+        AX_VALUE_TYPE_STRING,
+        "active",
+        NULL,
+        &publication->active,
+        AX_VALUE_TYPE_BOOL,
+        NULL);
+
+    // Callbacks may unsubscribe, so collect the matches first
+    GPtrArray *matched = g_ptr_array_new_with_free_func(free_subscription);
+    g_mutex_lock(&lock);
+    for (GList *h = handlers; NULL != h; h = h->next)
+    {
+        const AXEventHandler *event_handler = h->data;
+        for (GList *l = event_handler->subscriptions; NULL != l; l = l->next)
+        {
+            const struct subscription *s = l->data;
+            if (matches(s->key_value_set, key_value_set))
+            {
+                struct subscription *copy = g_memdup2(s, sizeof(*s));
+                copy->key_value_set = NULL;
+                g_ptr_array_add(matched, copy);
+            }
+        }
+    }
+    g_mutex_unlock(&lock);
+
+    for (guint i = 0; i < matched->len; i++)
+    {
+        const struct subscription *s = g_ptr_array_index(matched, i);
+        // The callback frees the event
+        s->callback(s->id, ax_event_new2(key_value_set, NULL), s->user_data);
+    }
+    g_ptr_array_free(matched, TRUE);
+    ax_event_key_value_set_free(key_value_set);
+    g_free(publication->topic2);
+    g_free(publication);
+    return G_SOURCE_REMOVE;
+}
+
+void host_event_publish(const gchar *topic2, const gboolean active)
+{
+    struct publication *publication = g_new(struct publication, 1);
+    publication->topic2 = g_strdup(topic2);
+    publication->active = active;
+    // Queued also from the main loop thread, and before the main loop runs
+    g_idle_add_full(G_PRIORITY_DEFAULT, deliver, publication, NULL);
+}
+
+guint host_events_sent(void)
+{
+    return g_atomic_int_get(&events_sent);
+}
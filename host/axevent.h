@@ -0,0 +1,106 @@
+/**
+ * Copyright (C) 2023, Axis Communications AB, Lund, Sweden
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Host stand-in for the ACAP SDK event library: the subset of its API used
+// by the application, with events delivered within the process, see host.h
+
+#ifndef _AXEVENT_H_
+#define _AXEVENT_H_
+
+#include <glib.h>
+
+typedef struct _AXEvent AXEvent;
+typedef struct _AXEventHandler AXEventHandler;
+typedef struct _AXEventKeyValueSet AXEventKeyValueSet;
+
+typedef enum
+{
+    AX_VALUE_TYPE_INT,
+    AX_VALUE_TYPE_BOOL,
+    AX_VALUE_TYPE_DOUBLE,
+    AX_VALUE_TYPE_STRING,
+    AX_VALUE_TYPE_ELEMENT,
+} AXEventValueType;
+
+typedef void (*AXSubscriptionCallback)(guint subscription, AXEvent *event, gpointer user_data);
+typedef void (*AXDeclarationCompleteCallback)(guint declaration, gpointer user_data);
+
+AXEventKeyValueSet *ax_event_key_value_set_new(void);
+void ax_event_key_value_set_free(AXEventKeyValueSet *key_value_set);
+gboolean ax_event_key_value_set_add_key_value(
+    AXEventKeyValueSet *key_value_set,
+    const gchar *key,
+    const gchar *name_space,
+    gconstpointer value,
+    AXEventValueType value_type,
+    GError **error);
+// Followed by key, name_space, value and value_type for each key, terminated by NULL
+gboolean ax_event_key_value_set_add_key_values(AXEventKeyValueSet *key_value_set, GError **error, ...);
+gboolean ax_event_key_value_set_mark_as_source(
+    AXEventKeyValueSet *key_value_set,
+    const gchar *key,
+    const gchar *name_space,
+    GError **error);
+gboolean ax_event_key_value_set_mark_as_data(
+    AXEventKeyValueSet *key_value_set,
+    const gchar *key,
+    const gchar *name_space,
+    GError **error);
+gboolean ax_event_key_value_set_get_integer(
+    const AXEventKeyValueSet *key_value_set,
+    const gchar *key,
+    const gchar *name_space,
+    gint *value,
+    GError **error);
+gboolean ax_event_key_value_set_get_boolean(
+    const AXEventKeyValueSet *key_value_set,
+    const gchar *key,
+    const gchar *name_space,
+    gboolean *value,
+    GError **error);
+gboolean ax_event_key_value_set_get_string(
+    const AXEventKeyValueSet *key_value_set,
+    const gchar *key,
+    const gchar *name_space,
+    gchar **value,
+    GError **error);
+
+AXEvent *ax_event_new2(AXEventKeyValueSet *key_value_set, GDateTime *time_stamp);
+void ax_event_free(AXEvent *event);
+const AXEventKeyValueSet *ax_event_get_key_value_set(const AXEvent *event);
+
+AXEventHandler *ax_event_handler_new(void);
+void ax_event_handler_free(AXEventHandler *event_handler);
+gboolean ax_event_handler_declare(
+    AXEventHandler *event_handler,
+    AXEventKeyValueSet *key_value_set,
+    gboolean stateless,
+    guint *declaration,
+    AXDeclarationCompleteCallback callback,
+    gpointer user_data,
+    GError **error);
+gboolean ax_event_handler_undeclare(AXEventHandler *event_handler, guint declaration, GError **error);
+gboolean ax_event_handler_send_event(AXEventHandler *event_handler, guint declaration, AXEvent *event, GError **error);
+gboolean ax_event_handler_subscribe(
+    AXEventHandler *event_handler,
+    AXEventKeyValueSet *key_value_set,
+    guint *subscription,
+    AXSubscriptionCallback callback,
+    gpointer user_data,
+    GError **error);
+gboolean ax_event_handler_unsubscribe(AXEventHandler *event_handler, guint subscription, GError **error);
+
+#endif /* _AXEVENT_H_ */
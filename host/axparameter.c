@@ -0,0 +1,211 @@
+/**
+ * Copyright (C) 2023, Axis Communications AB, Lund, Sweden
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "axparameter.h"
+#include "host.h"
+
+#ifndef HOST_MANIFEST
+#define HOST_MANIFEST "manifest.json"
+#endif
+
+#define ENV_PREFIX "AXPARAM_"
+
+struct _AXParameter
+{
+    GHashTable *values;    // Values by name
+    GHashTable *callbacks; // struct callback by name
+};
+
+struct callback
+{
+    AXParameterCallback callback;
+    gpointer user_data;
+};
+
+struct change
+{
+    AXParameter *parameter;
+    gchar *name;
+};
+
+struct host_change
+{
+    gchar *name;
+    gchar *value;
+};
+
+// The parameters of the application, for host_parameter_set()
+static AXParameter *instance = NULL;
+
+static gboolean fail(GError **error, const gchar *message, const gchar *name)
+{
+    g_set_error(error, g_quark_from_static_string("axparameter"), 0, "%s: %s", message, name);
+    return FALSE;
+}
+
+// The manifest has one parameter per line, so a pattern is enough to read its defaults
+static gboolean load_defaults(GHashTable *values, GError **error)
+{
+    gchar *manifest = NULL;
+    if (!g_file_get_contents(HOST_MANIFEST, &manifest, NULL, error))
+    {
+        return FALSE;
+    }
+
+    GRegex *regex = g_regex_new(
+        "\\{\"name\": \"(\\w+)\", \"type\": \"[^\"]*\", \"default\": \"([^\"]*)\"\\}",
+        0,
+        0,
+        NULL);
+    GMatchInfo *match;
+    g_regex_match(regex, manifest, 0, &match);
+    while (g_match_info_matches(match))
+    {
+        gchar *name = g_match_info_fetch(match, 1);
+        gchar *env = g_strconcat(ENV_PREFIX, name, NULL);
+        const gchar *value = g_getenv(env);
+        g_hash_table_insert(values, name, NULL != value ? g_strdup(value) : g_match_info_fetch(match, 2));
+        g_free(env);
+        g_match_info_next(match, NULL);
+    }
+    g_match_info_free(match);
+    g_regex_unref(regex);
+    g_free(manifest);
+
+    if (0 == g_hash_table_size(values))
+    {
+        return fail(error, "No parameters in", HOST_MANIFEST);
+    }
+    return TRUE;
+}
+
+AXParameter *ax_parameter_new(const gchar *app_name, GError **error)
+{
+    (void)app_name;
+    AXParameter *parameter = g_new0(AXParameter, 1);
+    parameter->values = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    parameter->callbacks = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    if (!load_defaults(parameter->values, error))
+    {
+        ax_parameter_free(parameter);
+        return NULL;
+    }
+    instance = parameter;
+    return parameter;
+}
+
+void ax_parameter_free(AXParameter *parameter)
+{
+    if (NULL == parameter)
+    {
+        return;
+    }
+    if (instance == parameter)
+    {
+        instance = NULL;
+    }
+    g_hash_table_destroy(parameter->values);
+    g_hash_table_destroy(parameter->callbacks);
+    g_free(parameter);
+}
+
+gboolean ax_parameter_get(AXParameter *parameter, const gchar *name, gchar **value, GError **error)
+{
+    const gchar *v = g_hash_table_lookup(parameter->values, name);
+    if (NULL == v)
+    {
+        return fail(error, "No such parameter", name);
+    }
+    *value = g_strdup(v);
+    return TRUE;
+}
+
+// Like the parameter service, the callbacks are run from the main loop
+static gboolean notify(gpointer data)
+{
+    struct change *change = data;
+    const struct callback *callback = g_hash_table_lookup(change->parameter->callbacks, change->name);
+    const gchar *value = g_hash_table_lookup(change->parameter->values, change->name);
+    if (NULL != callback && NULL != value)
+    {
+        callback->callback(change->name, value, callback->user_data);
+    }
+    g_free(change->name);
+    g_free(change);
+    return G_SOURCE_REMOVE;
+}
+
+gboolean ax_parameter_set(
+    AXParameter *parameter,
+    const gchar *name,
+    const gchar *value,
+    gboolean do_sync,
+    GError **error)
+{
+    (void)do_sync;
+    if (!g_hash_table_contains(parameter->values, name))
+    {
+        return fail(error, "No such parameter", name);
+    }
+    g_hash_table_insert(parameter->values, g_strdup(name), g_strdup(value));
+
+    struct change *change = g_new(struct change, 1);
+    change->parameter = parameter;
+    change->name = g_strdup(name);
+    g_idle_add(notify, change);
+    return TRUE;
+}
+
+gboolean ax_parameter_register_callback(
+    AXParameter *parameter,
+    const gchar *name,
+    AXParameterCallback callback,
+    gpointer user_data,
+    GError **error)
+{
+    if (!g_hash_table_contains(parameter->values, name))
+    {
+        return fail(error, "No such parameter", name);
+    }
+    struct callback *c = g_new(struct callback, 1);
+    c->callback = callback;
+    c->user_data = user_data;
+    g_hash_table_insert(parameter->callbacks, g_strdup(name), c);
+    return TRUE;
+}
+
+static gboolean set_from_main_loop(gpointer data)
+{
+    struct host_change *change = data;
+    GError *error = NULL;
+    if (NULL == instance || !ax_parameter_set(instance, change->name, change->value, TRUE, &error))
+    {
+        g_printerr("axparameter: Failed to set %s (%s)\n", change->name, NULL != error ? error->message : "");
+        g_clear_error(&error);
+    }
+    g_free(change->name);
+    g_free(change->value);
+    g_free(change);
+    return G_SOURCE_REMOVE;
+}
+
+void host_parameter_set(const gchar *name, const gchar *value)
+{
+    struct host_change *change = g_new(struct host_change, 1);
+    change->name = g_strdup(name);
+    change->value = g_strdup(value);
+    g_idle_add_full(G_PRIORITY_DEFAULT, set_from_main_loop, change, NULL);
+}
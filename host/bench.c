@@ -0,0 +1,649 @@
+/**
+ * Copyright (C) 2023, Axis Communications AB, Lund, Sweden
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Benchmark of the application built for the host: it runs the real main()
+// against the stand-ins and drives it like a camera and a PLC would, either
+// as a client sending events to the loopback peer, or as a server polled by
+// libmodbus clients. See README.md, "Benchmarks and tests on a host".
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <modbus.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "host.h"
+#include "latency.h"
+#include "peer.h"
+#include "register_map.h"
+
+#define MAX_SCENARIOS REGMAP_MAX_SLOTS
+#define MAX_POLLERS 256
+#define START_TIMEOUT (10 * G_USEC_PER_SEC)
+// A replay has ended when no writes arrive for this long
+#define REPLAY_IDLE (G_USEC_PER_SEC)
+// New connections timed by --idle
+#define ACCEPTS 200
+
+// main() of modbusacap.c, renamed when built for the benchmark
+int modbusacap_main(int argc, char **argv);
+
+static struct
+{
+    gchar *mode;
+    gint seconds;
+    gint scenarios;
+    gint spacing;
+    gint rate;
+    gint latency;
+    gint loss;
+    gboolean udp;
+    gboolean stop_and_wait;
+    gint pollers;
+    gint units;
+    gboolean idle;
+    gchar **params;
+    gchar *replay;
+} options = {
+    .mode = NULL,
+    .seconds = 5,
+    .scenarios = 8,
+    .spacing = 1,
+    .rate = 0,
+    .latency = 0,
+    .loss = 0,
+    .udp = FALSE,
+    .stop_and_wait = FALSE,
+    .pollers = 1,
+    .units = 0,
+    .idle = FALSE,
+    .params = NULL,
+    .replay = NULL,
+};
+
+static GOptionEntry entries[] = {
+    {"mode", 'm', 0, G_OPTION_ARG_STRING, &options.mode, "client or server", "MODE"},
+    {"seconds", 's', 0, G_OPTION_ARG_INT, &options.seconds, "Length of the measurement (default 5)", "S"},
+    {"scenarios", 'n', 0, G_OPTION_ARG_INT, &options.scenarios, "Scenarios raising events (default 8)", "N"},
+    {"spacing", 0, 0, G_OPTION_ARG_INT, &options.spacing, "Client mode: coils between scenarios (default 1)", "N"},
+    {"rate", 'r', 0, G_OPTION_ARG_INT, &options.rate, "Events per second, 0 for closed loop (default)", "R"},
+    {"latency", 'l', 0, G_OPTION_ARG_INT, &options.latency, "Peer response latency in microseconds", "US"},
+    {"loss", 0, 0, G_OPTION_ARG_INT, &options.loss, "Peer request loss in percent", "P"},
+    {"udp", 'u', 0, G_OPTION_ARG_NONE, &options.udp, "Modbus/UDP instead of Modbus/TCP", NULL},
+    {"stop-and-wait", 0, 0, G_OPTION_ARG_NONE, &options.stop_and_wait, "Peer discards pipelined requests", NULL},
+    {"pollers", 'p', 0, G_OPTION_ARG_INT, &options.pollers, "Server mode: concurrent pollers (default 1)", "N"},
+    {"units", 0, 0, G_OPTION_ARG_INT, &options.units, "Server mode: gateway units polled in turn", "N"},
+    {"idle", 0, 0, G_OPTION_ARG_NONE, &options.idle, "Server mode: count idle wakeups, time new connections", NULL},
+    {"param", 'P', 0, G_OPTION_ARG_STRING_ARRAY, &options.params, "Application parameter", "NAME=VALUE"},
+    {"replay", 0, 0, G_OPTION_ARG_FILENAME, &options.replay, "Client mode: replay a recording instead", "FILE"},
+    {NULL}};
+
+static pthread_t app_thread;
+static volatile gint stopping = FALSE;
+
+static gchar *app_argv[] = {"modbusacap", NULL};
+
+static void *run_app(void *arg)
+{
+    (void)arg;
+    const int ret = modbusacap_main(1, app_argv);
+    if (!g_atomic_int_get(&stopping))
+    {
+        g_printerr("bench: The application exited (%d)\n", ret);
+        exit(EXIT_FAILURE);
+    }
+    return NULL;
+}
+
+static void set_param(const gchar *name, const gchar *value)
+{
+    gchar *env = g_strconcat("AXPARAM_", name, NULL);
+    g_setenv(env, value, TRUE);
+    g_free(env);
+}
+
+// Events toggle the coils of the scenarios mapped to addresses 0 and up,
+// spacing apart, or all to address 0 if spacing is 0
+static void set_scenario_map(const gint n, const guint spacing)
+{
+    GString *map = g_string_new(NULL);
+    for (gint i = 0; i < n; i++)
+    {
+        g_string_append_printf(map, "%s%d:%u", 0 < i ? "," : "", i + 1, i * spacing);
+    }
+    set_param("ScenarioMap", map->str);
+    g_string_free(map, TRUE);
+}
+
+static void start_app(void)
+{
+    // The application writes its files to localdata/, keep them apart
+    gchar *dir = g_dir_make_tmp("modbusacap-bench-XXXXXX", NULL);
+    if (NULL == dir || 0 != chdir(dir) || 0 != mkdir("localdata", 0755))
+    {
+        g_printerr("bench: Failed to create a working directory (%s)\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    g_free(dir);
+
+    set_param("LogLevel", "3");
+    for (gchar **param = options.params; NULL != param && NULL != *param; param++)
+    {
+        gchar **kv = g_strsplit(*param, "=", 2);
+        if (NULL == kv[0] || NULL == kv[1])
+        {
+            g_printerr("bench: Invalid parameter '%s'\n", *param);
+            exit(EXIT_FAILURE);
+        }
+        set_param(kv[0], kv[1]);
+        g_strfreev(kv);
+    }
+    if (0 != pthread_create(&app_thread, NULL, run_app, NULL))
+    {
+        g_printerr("bench: Failed to start the application\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void stop_app(void)
+{
+    g_atomic_int_set(&stopping, TRUE);
+    kill(getpid(), SIGTERM);
+    pthread_join(app_thread, NULL);
+}
+
+// The application's own latency histograms, see latency.h
+static void print_latency(void)
+{
+    gchar *text = NULL;
+    if (latency_write_file("localdata/bench-latency.txt") &&
+        g_file_get_contents("localdata/bench-latency.txt", &text, NULL, NULL))
+    {
+        printf("%s", text);
+    }
+    g_free(text);
+}
+
+static gint compare_samples(gconstpointer a, gconstpointer b)
+{
+    const gint32 x = *(const gint32 *)a;
+    const gint32 y = *(const gint32 *)b;
+    return (x > y) - (x < y);
+}
+
+static void print_percentiles(const gchar *name, GArray *samples)
+{
+    if (0 == samples->len)
+    {
+        printf("%s: no samples\n", name);
+        return;
+    }
+    g_array_sort(samples, compare_samples);
+    const gint32 *s = (const gint32 *)samples->data;
+    const guint n = samples->len;
+    printf(
+        "%s: count %u, p50 %d us, p99 %d us, p999 %d us, max %d us\n",
+        name,
+        n,
+        s[n / 2],
+        s[MIN(n - 1, n * 99 / 100)],
+        s[MIN(n - 1, n * 999 / 1000)],
+        s[n - 1]);
+}
+
+// Client mode: publish events and count the coil writes arriving at the peer.
+// In closed loop, a coil is toggled again once the peer has its last write,
+// so every scenario is one event in flight; otherwise events are raised at
+// the given rate, round robin over the scenarios. A replay is started once
+// the application is connected and measured until its writes stop.
+static int bench_client(void)
+{
+    const struct peer_config config = {
+        .udp = options.udp,
+        .latency_us = options.latency,
+        .loss_percent = options.loss,
+        .stop_and_wait = options.stop_and_wait,
+    };
+    struct peer *peer = peer_start(0, &config);
+    if (NULL == peer)
+    {
+        return EXIT_FAILURE;
+    }
+    gchar *port = g_strdup_printf("%u", peer_port(peer));
+    set_param("Mode", "1");
+    set_param("Server", "127.0.0.1");
+    set_param("Port", port);
+    set_param("Transport", options.udp ? "1" : "0");
+    set_scenario_map(options.scenarios, MAX(options.spacing, 1));
+    g_free(port);
+    start_app();
+
+    gboolean state[MAX_SCENARIOS] = {FALSE};
+    gboolean acked[MAX_SCENARIOS];
+    const guint32 *writes;
+    guint seen = 0;
+    guint published = 0;
+    gchar *topics[MAX_SCENARIOS];
+    for (gint i = 0; i < options.scenarios; i++)
+    {
+        topics[i] = g_strdup_printf("Device1Scenario%d", i + 1);
+        acked[i] = TRUE;
+    }
+
+    // Connected once the first event is written
+    const gint64 deadline = g_get_monotonic_time() + START_TIMEOUT;
+    while (0 == peer_coil_writes(peer, &writes))
+    {
+        if (g_get_monotonic_time() > deadline)
+        {
+            g_printerr("bench: No writes from the application\n");
+            return EXIT_FAILURE;
+        }
+        state[0] = !state[0];
+        host_event_publish(topics[0], state[0]);
+        g_usleep(10 * 1000);
+    }
+    g_usleep(100 * 1000);
+    seen = peer_coil_writes(peer, &writes);
+    const guint requests = peer_requests(peer, 0);
+    const guint fc05 = peer_requests(peer, MODBUS_FC_WRITE_SINGLE_COIL);
+    const guint fc15 = peer_requests(peer, MODBUS_FC_WRITE_MULTIPLE_COILS);
+    const guint first_write = seen;
+    latency_reset();
+
+    const gint64 start = g_get_monotonic_time();
+    const gint64 end = start + (gint64)options.seconds * G_USEC_PER_SEC;
+    gint64 last_write = start;
+    gint64 now;
+    if (NULL != options.replay)
+    {
+        host_parameter_set("ReplayFile", options.replay);
+    }
+    while ((now = g_get_monotonic_time()) < end)
+    {
+        if (NULL != options.replay)
+        {
+            const guint n = peer_coil_writes(peer, &writes);
+            if (n != seen)
+            {
+                seen = n;
+                last_write = now;
+            }
+            else if (REPLAY_IDLE < now - last_write)
+            {
+                break;
+            }
+            g_usleep(1000);
+            continue;
+        }
+        if (0 < options.rate)
+        {
+            const guint due = (now - start) * options.rate / G_USEC_PER_SEC;
+            for (; published < due; published++)
+            {
+                const guint i = published % options.scenarios;
+                state[i] = !state[i];
+                host_event_publish(topics[i], state[i]);
+            }
+            g_usleep(1000);
+            continue;
+        }
+
+        const guint n = peer_coil_writes(peer, &writes);
+        for (; seen < n; seen++)
+        {
+            const guint address = PEER_WRITE_ADDRESS(writes[seen]);
+            const guint i = address / MAX(options.spacing, 1);
+            if (0 == address % MAX(options.spacing, 1) && i < (guint)options.scenarios &&
+                PEER_WRITE_VALUE(writes[seen]) == state[i])
+            {
+                acked[i] = TRUE;
+            }
+        }
+        gboolean idle = TRUE;
+        for (gint i = 0; i < options.scenarios; i++)
+        {
+            if (acked[i])
+            {
+                acked[i] = FALSE;
+                state[i] = !state[i];
+                host_event_publish(topics[i], state[i]);
+                published++;
+                idle = FALSE;
+            }
+        }
+        if (idle)
+        {
+            g_usleep(50);
+        }
+    }
+    const gdouble elapsed = (gdouble)((NULL != options.replay ? last_write : g_get_monotonic_time()) - start) /
+                            G_USEC_PER_SEC;
+    // Let the last writes arrive
+    g_usleep(MAX(200 * 1000, 4 * options.latency));
+    const guint delivered = peer_coil_writes(peer, &writes) - first_write;
+
+    if (NULL != options.replay)
+    {
+        printf("replay: coil writes at the peer %u (%.0f/s)\n", delivered, delivered / elapsed);
+    }
+    else
+    {
+        printf(
+            "events: published %u (%.0f/s), coil writes at the peer %u\n",
+            published,
+            published / elapsed,
+            delivered);
+    }
+    printf(
+        "peer: %u connections, requests %.0f/s, FC05 %u, FC15 %u\n",
+        peer_connections(peer),
+        (peer_requests(peer, 0) - requests) / elapsed,
+        peer_requests(peer, MODBUS_FC_WRITE_SINGLE_COIL) - fc05,
+        peer_requests(peer, MODBUS_FC_WRITE_MULTIPLE_COILS) - fc15);
+    print_latency();
+
+    stop_app();
+    peer_stop(peer);
+    for (gint i = 0; i < options.scenarios; i++)
+    {
+        g_free(topics[i]);
+    }
+    return EXIT_SUCCESS;
+}
+
+struct poller
+{
+    pthread_t thread;
+    guint id;
+    guint16 port;
+    GArray *samples;
+    guint failed;
+};
+
+// Server mode: poll the coils and input registers of the scenarios, each
+// poller on its own connection, in turn over the units in gateway mode
+static void *run_poller(void *arg)
+{
+    struct poller *poller = arg;
+    const guint nslots = options.scenarios;
+    guint8 bits[MAX_SCENARIOS];
+    guint16 registers[MAX_SCENARIOS * REGMAP_IR_PER_SLOT];
+
+    modbus_t *ctx = modbus_new_tcp("127.0.0.1", poller->port);
+    if (NULL == ctx || -1 == modbus_connect(ctx))
+    {
+        g_printerr("bench: Poller %u failed to connect (%s)\n", poller->id, modbus_strerror(errno));
+        poller->failed++;
+        modbus_free(ctx);
+        return NULL;
+    }
+    for (guint i = 0; !g_atomic_int_get(&stopping); i++)
+    {
+        if (0 < options.units)
+        {
+            modbus_set_slave(ctx, 1 + (poller->id + i) % options.units);
+        }
+        const gint64 sent = g_get_monotonic_time();
+        const int rc = 0 == i % 2 ? modbus_read_bits(ctx, 0, 0 < options.units ? 1 : nslots, bits)
+                                  : modbus_read_input_registers(
+                                        ctx,
+                                        0,
+                                        (0 < options.units ? 1 : nslots) * REGMAP_IR_PER_SLOT,
+                                        registers);
+        const gint32 us = g_get_monotonic_time() - sent;
+        if (-1 == rc)
+        {
+            poller->failed++;
+            continue;
+        }
+        g_array_append_val(poller->samples, us);
+    }
+    modbus_close(ctx);
+    modbus_free(ctx);
+    return NULL;
+}
+
+static gboolean wait_for_port(const guint16 port)
+{
+    const gint64 deadline = g_get_monotonic_time() + START_TIMEOUT;
+    while (g_get_monotonic_time() < deadline)
+    {
+        modbus_t *ctx = modbus_new_tcp("127.0.0.1", port);
+        const gboolean connected = NULL != ctx && 0 == modbus_connect(ctx);
+        modbus_close(ctx);
+        modbus_free(ctx);
+        if (connected)
+        {
+            return TRUE;
+        }
+        g_usleep(10 * 1000);
+    }
+    return FALSE;
+}
+
+// A free port, as far as it can be known before it is used
+static guint16 free_port(void)
+{
+    struct sockaddr_in addr = {.sin_family = AF_INET};
+    socklen_t addrlen = sizeof(addr);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    const int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (-1 == fd || -1 == bind(fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+        -1 == getsockname(fd, (struct sockaddr *)&addr, &addrlen))
+    {
+        g_printerr("bench: Failed to find a free port (%s)\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+    return ntohs(addr.sin_port);
+}
+
+static void *run_publisher(void *arg)
+{
+    guint *published = arg;
+    gchar *topics[MAX_SCENARIOS];
+    gboolean state[MAX_SCENARIOS] = {FALSE};
+    for (gint i = 0; i < options.scenarios; i++)
+    {
+        topics[i] = g_strdup_printf("Device1Scenario%d", i + 1);
+    }
+    const gint64 start = g_get_monotonic_time();
+    while (!g_atomic_int_get(&stopping))
+    {
+        const guint due = (g_get_monotonic_time() - start) * options.rate / G_USEC_PER_SEC;
+        for (; *published < due; (*published)++)
+        {
+            const guint i = *published % options.scenarios;
+            state[i] = !state[i];
+            host_event_publish(topics[i], state[i]);
+        }
+        g_usleep(1000);
+    }
+    for (gint i = 0; i < options.scenarios; i++)
+    {
+        g_free(topics[i]);
+    }
+    return NULL;
+}
+
+// Context switches of all threads of the process, each one a wakeup
+static guint64 count_wakeups(void)
+{
+    guint64 wakeups = 0;
+    GDir *dir = g_dir_open("/proc/self/task", 0, NULL);
+    for (const gchar *task = NULL != dir ? g_dir_read_name(dir) : NULL; NULL != task; task = g_dir_read_name(dir))
+    {
+        gchar *path = g_strdup_printf("/proc/self/task/%s/status", task);
+        gchar *status = NULL;
+        if (g_file_get_contents(path, &status, NULL, NULL))
+        {
+            gchar **lines = g_strsplit(status, "\n", -1);
+            for (gchar **line = lines; NULL != *line; line++)
+            {
+                if (g_str_has_prefix(*line, "voluntary_ctxt_switches:") ||
+                    g_str_has_prefix(*line, "nonvoluntary_ctxt_switches:"))
+                {
+                    wakeups += g_ascii_strtoull(strchr(*line, ':') + 1, NULL, 10);
+                }
+            }
+            g_strfreev(lines);
+        }
+        g_free(status);
+        g_free(path);
+    }
+    if (NULL != dir)
+    {
+        g_dir_close(dir);
+    }
+    return wakeups;
+}
+
+// Wakeups of the application while no client is connected, and the time
+// from connecting to the response of the first request on a new connection
+static void measure_idle(const guint16 port)
+{
+    g_usleep(G_USEC_PER_SEC);
+    const guint64 before = count_wakeups();
+    g_usleep((gulong)options.seconds * G_USEC_PER_SEC);
+    const guint64 wakeups = count_wakeups() - before;
+    printf("idle: %.1f wakeups/s\n", (gdouble)wakeups / options.seconds);
+
+    GArray *samples = g_array_new(FALSE, FALSE, sizeof(gint32));
+    for (guint i = 0; i < ACCEPTS; i++)
+    {
+        guint8 bit;
+        const gint64 start = g_get_monotonic_time();
+        modbus_t *ctx = modbus_new_tcp("127.0.0.1", port);
+        if (NULL != ctx && 0 == modbus_connect(ctx) && 1 == modbus_read_bits(ctx, 0, 1, &bit))
+        {
+            const gint32 us = g_get_monotonic_time() - start;
+            g_array_append_val(samples, us);
+        }
+        modbus_close(ctx);
+        modbus_free(ctx);
+    }
+    print_percentiles("connect to first response", samples);
+    g_array_free(samples, TRUE);
+}
+
+static int bench_server(void)
+{
+    const guint16 port = free_port();
+    gchar *port_value = g_strdup_printf("%u", port);
+    set_param("Mode", "0");
+    set_param("Port", port_value);
+    set_param("Transport", "0");
+    set_param("Gateway", 0 < options.units ? "1" : "0");
+    set_scenario_map(MAX(options.scenarios, options.units), 0 < options.units ? 0 : 1);
+    g_free(port_value);
+    start_app();
+    if (!wait_for_port(port))
+    {
+        g_printerr("bench: The server is not listening on port %u\n", port);
+        return EXIT_FAILURE;
+    }
+    if (options.idle)
+    {
+        measure_idle(port);
+        stop_app();
+        return EXIT_SUCCESS;
+    }
+
+    struct poller pollers[MAX_POLLERS];
+    const guint npollers = CLAMP(options.pollers, 1, MAX_POLLERS);
+    pthread_t publisher;
+    guint published = 0;
+    latency_reset();
+    const gint64 start = g_get_monotonic_time();
+    if (0 < options.rate)
+    {
+        pthread_create(&publisher, NULL, run_publisher, &published);
+    }
+    for (guint i = 0; i < npollers; i++)
+    {
+        pollers[i] = (struct poller){.id = i, .port = port, .samples = g_array_new(FALSE, FALSE, sizeof(gint32))};
+        pthread_create(&pollers[i].thread, NULL, run_poller, &pollers[i]);
+    }
+    g_usleep((gulong)options.seconds * G_USEC_PER_SEC);
+    g_atomic_int_set(&stopping, TRUE);
+
+    GArray *samples = g_array_new(FALSE, FALSE, sizeof(gint32));
+    guint failed = 0;
+    for (guint i = 0; i < npollers; i++)
+    {
+        pthread_join(pollers[i].thread, NULL);
+        g_array_append_vals(samples, pollers[i].samples->data, pollers[i].samples->len);
+        failed += pollers[i].failed;
+        g_array_free(pollers[i].samples, TRUE);
+    }
+    if (0 < options.rate)
+    {
+        pthread_join(publisher, NULL);
+    }
+    const gdouble elapsed = (gdouble)(g_get_monotonic_time() - start) / G_USEC_PER_SEC;
+
+    printf(
+        "server: %u pollers, requests %.0f/s, failed %u, events published %.0f/s\n",
+        npollers,
+        samples->len / elapsed,
+        failed,
+        published / elapsed);
+    print_percentiles("poll round trip", samples);
+    print_latency();
+    g_array_free(samples, TRUE);
+
+    stop_app();
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char **argv)
+{
+    GError *error = NULL;
+    GOptionContext *context = g_option_context_new("- benchmark modbusacap on a host");
+    g_option_context_add_main_entries(context, entries, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &error))
+    {
+        g_printerr("bench: %s\n", error->message);
+        return EXIT_FAILURE;
+    }
+    g_option_context_free(context);
+    options.scenarios = CLAMP(options.scenarios, 1, MAX_SCENARIOS);
+    if (NULL != options.replay)
+    {
+        // The benchmark runs in a directory of its own
+        gchar *path = g_canonicalize_filename(options.replay, NULL);
+        g_free(options.replay);
+        options.replay = path;
+    }
+
+    if (0 == g_strcmp0(options.mode, "client"))
+    {
+        return bench_client();
+    }
+    if (0 == g_strcmp0(options.mode, "server"))
+    {
+        return bench_server();
+    }
+    g_printerr("bench: --mode must be client or server\n");
+    return EXIT_FAILURE;
+}
@@ -0,0 +1,143 @@
+#!/bin/sh
+# Benchmark scenarios for the host build, run from the repository root after
+# make bench, e.g. host/bench.sh client; see README.md
+set -eu
+
+BUILD=${BUILD:-host/build}
+BENCH=${BENCH:-$BUILD/bench}
+RUN_SECONDS=${RUN_SECONDS:-5}
+
+run() {
+    echo "== $*"
+    "$BENCH" --seconds "$RUN_SECONDS" "$@"
+}
+
+# Events per second and latency from event to acknowledgement, in closed loop
+client() {
+    run --mode client
+    run --mode client --udp
+}
+
+# Requests per second and poll round trip latency, with events published meanwhile
+server() {
+    run --mode server --rate 100
+    run --mode server --rate 100 --param ServerLoop=1
+}
+
+# Record a closed loop run and replay it as fast as possible, which gives the
+# highest event rate that the client send path sustains
+replay() {
+    recording=$(mktemp)
+    run --mode client --param RecordFile="$recording"
+    run --mode client --replay "$recording" --param ReplaySpeed=0 --seconds 120
+    rm -f "$recording"
+}
+
+# Coil changes gathered into FC15 requests against one FC05 request per
+# event, against a PLC 1 ms away: compare events/s and the PLC's requests/s
+batching() {
+    for window in 0 2 5; do
+        run --mode client --scenarios 32 --latency 1000 --param BatchWindow="$window"
+        run --mode client --scenarios 32 --latency 1000 --rate 2000 --param BatchWindow="$window"
+    done
+}
+
+# Requests/s and poll round trips with 1, 8 and 64 concurrent pollers, all
+# served from the one register image, from the server thread and from the
+# main loop
+pollers() {
+    for loop in 0 1; do
+        for n in 1 8 64; do
+            run --mode server --pollers "$n" --rate 100 --param ServerLoop="$loop"
+        done
+    done
+}
+
+# Wakeups of the idle server, and the time from connect to the first
+# response on a new connection, from the server thread and the main loop
+idle() {
+    run --mode server --idle --param ServerLoop=0
+    run --mode server --idle --param ServerLoop=1
+}
+
+# Reads/s from the register map without updates, and while events are
+# published back to back, with 1 and 4 concurrent readers
+register_map() {
+    for readers in 1 4; do
+        for updates in 0 -1; do
+            echo "== register map, $readers readers, updates $updates"
+            "$BUILD/bench_register_map" --seconds "$RUN_SECONDS" --readers "$readers" --updates "$updates"
+        done
+    done
+}
+
+# CPU spent on logging a message per request at 10000 and 50000 requests/s:
+# with the level disabled, rate limited, through the logger thread, and
+# synchronously as before
+log() {
+    for rate in 10000 50000; do
+        echo "== logging, $rate messages/s"
+        "$BUILD/bench_log" --seconds "$RUN_SECONDS" --rate "$rate"
+    done
+}
+
+# Requests/s of the request dispatcher for every function code
+dispatch() {
+    echo "== dispatch"
+    "$BUILD/bench_dispatch" --seconds 1
+}
+
+# Events/s against the round trip time to the PLC, with one write request
+# in flight and with 8, and with 8 against a PLC that discards pipelined
+# requests, from which the client falls back to stop-and-wait
+pipelining() {
+    for latency in 1000 5000 10000 20000; do
+        for depth in 1 8; do
+            run --mode client --scenarios 32 --latency "$latency" --param PipelineDepth="$depth"
+        done
+    done
+    run --mode client --scenarios 32 --latency 5000 --stop-and-wait --param PipelineDepth=8
+}
+
+# Latency percentiles from event to acknowledgement over TCP and over UDP,
+# at 200 events/s with 0, 1 and 5% of the requests lost: a lost TCP segment
+# holds back the responses after it, a lost datagram only its own
+loss() {
+    for loss in 0 1 5; do
+        run --mode client --rate 200 --loss "$loss"
+        run --mode client --rate 200 --loss "$loss" --udp
+    done
+}
+
+# Requests/s of 8 pollers from the single register image, and in gateway
+# mode with each poller going round 1, 8 and 32 units
+gateway() {
+    run --mode server --pollers 8 --rate 100
+    for units in 1 8 32; do
+        run --mode server --pollers 8 --rate 100 --units "$units"
+    done
+}
+
+# Events/s over 1, 2, 4 and 8 connections to a PLC 5 ms away, with the
+# coils of the 32 scenarios 64 apart so that they spread over the connections
+connections() {
+    for n in 1 2 4 8; do
+        run --mode client --scenarios 32 --spacing 64 --latency 5000 --param Connections="$n"
+    done
+}
+
+SCENARIOS="client server replay batching pollers idle register_map log dispatch pipelining loss gateway connections"
+
+if [ $# -eq 0 ]; then
+    # shellcheck disable=SC2086
+    set -- $SCENARIOS
+fi
+for scenario in "$@"; do
+    case " $SCENARIOS " in
+    *" $scenario "*) "$scenario" ;;
+    *)
+        echo "Unknown scenario '$scenario', one of: $SCENARIOS" >&2
+        exit 1
+        ;;
+    esac
+done
@@ -0,0 +1,110 @@
+/**
+ * Copyright (C) 2023, Axis Communications AB, Lund, Sweden
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Microbenchmark of modbus_dispatch_request(): requests/s for every
+// function code the server answers, and for requests answered with an
+// exception. Every request is copied into the receive buffer first, as
+// recv() would.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "modbus_dispatch.h"
+
+static struct
+{
+    gint seconds;
+} options = {
+    .seconds = 1,
+};
+
+static GOptionEntry entries[] = {
+    {"seconds", 's', 0, G_OPTION_ARG_INT, &options.seconds, "Length of each measurement (default 1)", "S"},
+    {NULL}};
+
+struct frame
+{
+    const char *name;
+    guint length;
+    guint8 adu[32];
+};
+
+// MBAP header with the length of a PDU of n bytes, for unit 1
+#define MBAP(n) 0, 1, 0, 0, 0, (n) + 1, 1
+
+static const struct frame frames[] = {
+    {"FC01 read 32 coils", 12, {MBAP(5), 0x01, 0, 0, 0, 32}},
+    {"FC02 read 32 inputs", 12, {MBAP(5), 0x02, 0, 0, 0, 32}},
+    {"FC03 read 8 registers", 12, {MBAP(5), 0x03, 0, 0, 0, 8}},
+    {"FC04 read 96 registers", 12, {MBAP(5), 0x04, 0, 0, 0, 96}},
+    {"FC05 write coil", 12, {MBAP(5), 0x05, 0, 3, 0xff, 0}},
+    {"FC06 write register", 12, {MBAP(5), 0x06, 0, 3, 0x12, 0x34}},
+    {"FC08 return query data", 12, {MBAP(5), 0x08, 0, 0, 0xa5, 0x37}},
+    {"FC0B event counter", 8, {MBAP(1), 0x0b}},
+    {"FC0C event log", 8, {MBAP(1), 0x0c}},
+    {"FC0F write 16 coils", 15, {MBAP(8), 0x0f, 0, 0, 0, 16, 2, 0x55, 0xaa}},
+    {"FC10 write 4 registers", 21, {MBAP(14), 0x10, 0, 0, 0, 4, 8, 0, 1, 0, 2, 0, 3, 0, 4}},
+    {"FC17 write 2, read 8", 21, {MBAP(14), 0x17, 0, 0, 0, 8, 0, 4, 0, 2, 4, 0, 1, 0, 2}},
+    {"illegal function", 8, {MBAP(1), 0x2b}},
+    {"illegal address", 12, {MBAP(5), 0x03, 0xff, 0, 0, 8}},
+    {"short frame", 9, {MBAP(2), 0x03, 0}},
+};
+
+int main(int argc, char **argv)
+{
+    GError *error = NULL;
+    GOptionContext *context = g_option_context_new("- request dispatch throughput per function code");
+    g_option_context_add_main_entries(context, entries, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &error))
+    {
+        g_printerr("bench_dispatch: %s\n", error->message);
+        return EXIT_FAILURE;
+    }
+    g_option_context_free(context);
+
+    modbus_mapping_t *mapping = modbus_mapping_new(256, 256, 256, 256);
+    guint8 adu[MODBUS_TCP_MAX_ADU_LENGTH];
+    volatile int sink = 0;
+
+    for (guint f = 0; f < G_N_ELEMENTS(frames); f++)
+    {
+        const struct frame *frame = &frames[f];
+        guint64 requests = 0;
+        const gint64 start = g_get_monotonic_time();
+        const gint64 end = start + (gint64)options.seconds * G_USEC_PER_SEC;
+        gint64 now;
+
+        // Check the clock every 1024 requests only
+        while ((now = g_get_monotonic_time()) < end)
+        {
+            for (guint i = 0; i < 1024; i++)
+            {
+                memcpy(adu, frame->adu, frame->length);
+                sink += modbus_dispatch_request(adu, frame->length, mapping);
+            }
+            requests += 1024;
+        }
+        const gdouble elapsed = (gdouble)(now - start) / G_USEC_PER_SEC;
+        printf(
+            "dispatch %-24s %6.1f M requests/s, %5.1f ns per request\n",
+            frame->name,
+            requests / elapsed / 1e6,
+            elapsed * 1e9 / requests);
+    }
+    modbus_mapping_free(mapping);
+    return EXIT_SUCCESS;
+}
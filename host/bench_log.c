@@ -0,0 +1,157 @@
+/**
+ * Copyright (C) 2023, Axis Communications AB, Lund, Sweden
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Microbenchmark of the CPU spent on logging from a hot path at a sustained
+// message rate: a disabled level, one rate limited call site, messages
+// handed to the logger thread, and messages written synchronously with
+// syslog() and printf() as before log_init(). The log output itself goes to
+// /dev/null and to syslog.
+
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "modbusacap_common.h"
+
+static struct
+{
+    gint seconds;
+    gint rate;
+} options = {
+    .seconds = 5,
+    .rate = 10000,
+};
+
+static GOptionEntry entries[] = {
+    {"seconds", 's', 0, G_OPTION_ARG_INT, &options.seconds, "Length of each measurement (default 5)", "S"},
+    {"rate", 'r', 0, G_OPTION_ARG_INT, &options.rate, "Messages per second (default 10000)", "R"},
+    {NULL}};
+
+enum mode
+{
+    MODE_DISABLED,
+    MODE_RATE_LIMITED,
+    MODE_ASYNC,
+    MODE_SYNC,
+};
+
+static const char *mode_names[] = {"disabled level", "rate limited site", "logger thread", "synchronous"};
+
+static gint64 cpu_time(const clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (gint64)ts.tv_sec * G_USEC_PER_SEC + ts.tv_nsec / 1000;
+}
+
+// Like the request logging of the server, one message per request
+static void log_message(const enum mode mode, const guint i)
+{
+    static struct log_site site;
+
+    switch (mode)
+    {
+    case MODE_DISABLED:
+        LOG_D("%s/%s: Received request on address %u", __FILE__, __FUNCTION__, i & 0xffff);
+        break;
+    case MODE_RATE_LIMITED:
+        LOG_I("%s/%s: Received request on address %u", __FILE__, __FUNCTION__, i & 0xffff);
+        break;
+    default:
+        // Past the level check and the rate limit, to measure the message itself
+        log_write(&site, LOG_INFO, "%s/%s: Received request on address %u", __FILE__, __FUNCTION__, i & 0xffff);
+        break;
+    }
+}
+
+static void measure(FILE *out, const enum mode mode)
+{
+    if (MODE_ASYNC == mode)
+    {
+        log_init();
+    }
+
+    guint64 messages = 0;
+    const gint64 start = g_get_monotonic_time();
+    const gint64 end = start + (gint64)options.seconds * G_USEC_PER_SEC;
+    const gint64 thread_start = cpu_time(CLOCK_THREAD_CPUTIME_ID);
+    const gint64 process_start = cpu_time(CLOCK_PROCESS_CPUTIME_ID);
+    gint64 thread_cpu = 0;
+    gint64 now;
+    while ((now = g_get_monotonic_time()) < end)
+    {
+        const guint64 due = (now - start) * options.rate / G_USEC_PER_SEC;
+        const gint64 before = cpu_time(CLOCK_THREAD_CPUTIME_ID);
+        for (; messages < due; messages++)
+        {
+            log_message(mode, messages);
+        }
+        thread_cpu += cpu_time(CLOCK_THREAD_CPUTIME_ID) - before;
+        g_usleep(1000);
+    }
+
+    // Pacing, not logging
+    const gint64 idle_cpu = cpu_time(CLOCK_THREAD_CPUTIME_ID) - thread_start - thread_cpu;
+    if (MODE_ASYNC == mode)
+    {
+        // The logger thread finishes what is queued, which is part of the cost
+        log_cleanup();
+    }
+    const gint64 elapsed = g_get_monotonic_time() - start;
+    const gint64 process_cpu = cpu_time(CLOCK_PROCESS_CPUTIME_ID) - process_start;
+
+    fprintf(
+        out,
+        "log %-17s %.0f messages/s, %.2f us per message in the caller, %.1f%% CPU in total\n",
+        mode_names[mode],
+        (gdouble)messages * G_USEC_PER_SEC / elapsed,
+        0 < messages ? (gdouble)thread_cpu / messages : 0.0,
+        100.0 * (process_cpu - idle_cpu) / elapsed);
+    fflush(out);
+}
+
+int main(int argc, char **argv)
+{
+    GError *error = NULL;
+    GOptionContext *context = g_option_context_new("- CPU spent on logging at a sustained message rate");
+    g_option_context_add_main_entries(context, entries, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &error))
+    {
+        g_printerr("bench_log: %s\n", error->message);
+        return EXIT_FAILURE;
+    }
+    g_option_context_free(context);
+
+    // Results on the original stdout, log messages to /dev/null
+    FILE *out = fdopen(dup(STDOUT_FILENO), "w");
+    if (NULL == out || NULL == freopen("/dev/null", "w", stdout))
+    {
+        perror("bench_log");
+        return EXIT_FAILURE;
+    }
+    openlog("bench_log", LOG_PID, LOG_USER);
+
+    log_level = LOG_INFO;
+    for (enum mode mode = MODE_DISABLED; mode <= MODE_SYNC; mode++)
+    {
+        measure(out, mode);
+    }
+    closelog();
+    fclose(out);
+    return EXIT_SUCCESS;
+}
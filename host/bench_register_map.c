@@ -0,0 +1,143 @@
+/**
+ * Copyright (C) 2023, Axis Communications AB, Lund, Sweden
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Microbenchmark of server reads from the register map while events are
+// published into it: each reader syncs its own view like a server thread
+// and answers FC01 and FC04 requests with modbus_dispatch_request()
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "modbus_dispatch.h"
+#include "register_map.h"
+
+#define MAX_READERS 64
+
+static struct
+{
+    gint seconds;
+    gint readers;
+    gint updates;
+} options = {
+    .seconds = 5,
+    .readers = 1,
+    .updates = -1,
+};
+
+static GOptionEntry entries[] = {
+    {"seconds", 's', 0, G_OPTION_ARG_INT, &options.seconds, "Length of the measurement (default 5)", "S"},
+    {"readers", 'r', 0, G_OPTION_ARG_INT, &options.readers, "Concurrent readers (default 1)", "N"},
+    {"updates", 'u', 0, G_OPTION_ARG_INT, &options.updates, "Updates per second, -1 for back to back (default)", "R"},
+    {NULL}};
+
+static volatile gint stopping = FALSE;
+
+struct reader
+{
+    pthread_t thread;
+    guint64 reads;
+};
+
+static void put_request(guint8 *adu, const guint8 function, const guint16 address, const guint16 n)
+{
+    const guint8 request[] = {0, 1, 0, 0, 0, 6, 0, function, address >> 8, address & 0xff, n >> 8, n & 0xff};
+    memcpy(adu, request, sizeof(request));
+}
+
+static void *run_reader(void *arg)
+{
+    struct reader *reader = arg;
+    struct register_units *units = register_map_new_units();
+    guint8 adu[MODBUS_TCP_MAX_ADU_LENGTH];
+
+    while (!g_atomic_int_get(&stopping))
+    {
+        const gboolean coils = 0 == reader->reads % 2;
+        put_request(
+            adu,
+            coils ? MODBUS_FC_READ_COILS : MODBUS_FC_READ_INPUT_REGISTERS,
+            0,
+            coils ? REGMAP_MAX_SLOTS : REGMAP_MAX_SLOTS * REGMAP_IR_PER_SLOT);
+        modbus_dispatch_request(adu, 12, register_map_sync(units, adu[MBAP_UNIT_ID]));
+        reader->reads++;
+    }
+    register_map_free_units(units);
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    GError *error = NULL;
+    GOptionContext *context = g_option_context_new("- register map read throughput during updates");
+    g_option_context_add_main_entries(context, entries, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &error))
+    {
+        g_printerr("bench_register_map: %s\n", error->message);
+        return EXIT_FAILURE;
+    }
+    g_option_context_free(context);
+
+    guint16 addresses[REGMAP_MAX_SLOTS];
+    guint8 units[REGMAP_MAX_SLOTS] = {0};
+    for (guint i = 0; i < REGMAP_MAX_SLOTS; i++)
+    {
+        addresses[i] = i;
+    }
+    register_map_set_slots(addresses, units, REGMAP_MAX_SLOTS, FALSE);
+
+    struct reader readers[MAX_READERS] = {0};
+    const guint nreaders = CLAMP(options.readers, 1, MAX_READERS);
+    for (guint i = 0; i < nreaders; i++)
+    {
+        pthread_create(&readers[i].thread, NULL, run_reader, &readers[i]);
+    }
+
+    // This thread is the main loop, the only writer of the image
+    guint64 updates = 0;
+    const gint64 start = g_get_monotonic_time();
+    const gint64 end = start + (gint64)options.seconds * G_USEC_PER_SEC;
+    gint64 now;
+    while ((now = g_get_monotonic_time()) < end)
+    {
+        const guint64 due = 0 > options.updates ? updates + 1 : (now - start) * options.updates / G_USEC_PER_SEC;
+        for (; updates < due; updates++)
+        {
+            register_map_publish(updates % REGMAP_MAX_SLOTS, 0 == updates / REGMAP_MAX_SLOTS % 2);
+        }
+        if (0 <= options.updates)
+        {
+            g_usleep(1000);
+        }
+    }
+    g_atomic_int_set(&stopping, TRUE);
+    const gdouble elapsed = (gdouble)(g_get_monotonic_time() - start) / G_USEC_PER_SEC;
+
+    guint64 reads = 0;
+    for (guint i = 0; i < nreaders; i++)
+    {
+        pthread_join(readers[i].thread, NULL);
+        reads += readers[i].reads;
+    }
+    printf(
+        "register map: %u readers, %.0f reads/s (%.0f per reader), %.0f updates/s\n",
+        nreaders,
+        reads / elapsed,
+        reads / elapsed / nreaders,
+        updates / elapsed);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,250 @@
+/**
+ * Copyright (C) 2023, Axis Communications AB, Lund, Sweden
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Fuzz harness for modbus_dispatch_request(): every input is one received
+// ADU, and the response must be a well-formed reply to it. Built with
+// -DHOST_LIBFUZZER it is a libFuzzer target (make fuzz); otherwise main()
+// runs the inputs in the given files and directories, e.g. the seed corpus
+// in host/corpus/dispatch, and then random mutations of them (make test).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "modbus_dispatch.h"
+
+// Requests to this unit are dispatched without a mapping, as for a unit
+// that is not served
+#define UNSERVED_UNIT 0xff
+
+static modbus_mapping_t *mapping;
+
+static void fail(const guint8 *data, const size_t size, const char *what)
+{
+    fprintf(stderr, "fuzz_dispatch: %s, input:", what);
+    for (size_t i = 0; i < size; i++)
+    {
+        fprintf(stderr, " %02x", data[i]);
+    }
+    fprintf(stderr, "\n");
+    abort();
+}
+
+int LLVMFuzzerTestOneInput(const guint8 *data, size_t size);
+
+int LLVMFuzzerTestOneInput(const guint8 *data, size_t size)
+{
+    if (NULL == mapping)
+    {
+        // Tables that do not start at 0, to exercise the range checks
+        mapping = modbus_mapping_new_start_address(16, 64, 16, 64, 100, 32, 100, 96);
+    }
+
+    // Exactly the buffer the server receives into, so that reads and
+    // writes past it are caught by the address sanitizer
+    guint8 *adu = g_malloc(MODBUS_TCP_MAX_ADU_LENGTH);
+    const size_t copied = MIN(size, MODBUS_TCP_MAX_ADU_LENGTH);
+    memcpy(adu, data, copied);
+    memset(adu + copied, 0xa5, MODBUS_TCP_MAX_ADU_LENGTH - copied);
+
+    const gboolean served = MBAP_UNIT_ID >= size || UNSERVED_UNIT != data[MBAP_UNIT_ID];
+    const int length = modbus_dispatch_request(adu, (int)MIN(size, G_MAXINT), served ? mapping : NULL);
+
+    if (MBAP_HEADER_LENGTH + 1 > size || MODBUS_TCP_MAX_ADU_LENGTH < size)
+    {
+        if (0 != length)
+        {
+            fail(data, size, "response to a frame that is not a request");
+        }
+        g_free(adu);
+        return 0;
+    }
+    if (MBAP_HEADER_LENGTH + 2 > length || MODBUS_TCP_MAX_ADU_LENGTH < length)
+    {
+        fail(data, size, "response length out of range");
+    }
+    if (0 != memcmp(adu, data, MBAP_LENGTH) || adu[MBAP_UNIT_ID] != data[MBAP_UNIT_ID])
+    {
+        fail(data, size, "transaction, protocol or unit identifier changed");
+    }
+    if (((adu[MBAP_LENGTH] << 8) | adu[MBAP_LENGTH + 1]) != length - MBAP_UNIT_ID)
+    {
+        fail(data, size, "MBAP length does not match the response");
+    }
+    const guint8 function = adu[MBAP_HEADER_LENGTH];
+    if (function != data[MBAP_HEADER_LENGTH] && function != (data[MBAP_HEADER_LENGTH] | 0x80))
+    {
+        fail(data, size, "function code changed");
+    }
+    if (0x80 & function && (0x80 & data[MBAP_HEADER_LENGTH] || MBAP_HEADER_LENGTH + 2 != length))
+    {
+        fail(data, size, "malformed exception response");
+    }
+    if (!served && (0x80 & ~function || MODBUS_EXCEPTION_GATEWAY_TARGET != adu[MBAP_HEADER_LENGTH + 1]))
+    {
+        fail(data, size, "unserved unit not answered with a gateway exception");
+    }
+    g_free(adu);
+    return 0;
+}
+
+#ifndef HOST_LIBFUZZER
+
+static struct
+{
+    gint runs;
+    gint seed;
+} options = {
+    .runs = 100000,
+    .seed = 1,
+};
+
+static GOptionEntry entries[] = {
+    {"runs", 'n', 0, G_OPTION_ARG_INT, &options.runs, "Mutated inputs to run (default 100000)", "N"},
+    {"seed", 's', 0, G_OPTION_ARG_INT, &options.seed, "Seed of the mutations (default 1)", "S"},
+    {NULL}};
+
+static void add_input(GPtrArray *inputs, const char *path)
+{
+    GError *error = NULL;
+    if (g_file_test(path, G_FILE_TEST_IS_DIR))
+    {
+        GDir *dir = g_dir_open(path, 0, &error);
+        const char *name;
+        while (NULL != dir && NULL != (name = g_dir_read_name(dir)))
+        {
+            char *file = g_build_filename(path, name, NULL);
+            add_input(inputs, file);
+            g_free(file);
+        }
+        if (NULL != dir)
+        {
+            g_dir_close(dir);
+        }
+    }
+    else
+    {
+        char *contents;
+        gsize length;
+        if (g_file_get_contents(path, &contents, &length, &error))
+        {
+            g_ptr_array_add(inputs, g_bytes_new_take(contents, length));
+        }
+    }
+    if (NULL != error)
+    {
+        g_printerr("fuzz_dispatch: %s\n", error->message);
+        exit(EXIT_FAILURE);
+    }
+}
+
+// A few byte-level changes, with the MBAP length and the function code
+// being changed more often than the rest since the parser depends on them
+static gsize mutate(GRand *rand, guint8 *buf, gsize length)
+{
+    const guint changes = g_rand_int_range(rand, 1, 5);
+    for (guint i = 0; i < changes; i++)
+    {
+        const guint at = 0 < length ? g_rand_int_range(rand, 0, length) : 0;
+        switch (g_rand_int_range(rand, 0, 6))
+        {
+        case 0:
+            if (0 < length)
+            {
+                buf[at] ^= 1 << g_rand_int_range(rand, 0, 8);
+            }
+            break;
+        case 1:
+            if (0 < length)
+            {
+                buf[at] = g_rand_int_range(rand, 0, 256);
+            }
+            break;
+        case 2:
+            length = g_rand_int_range(rand, 0, length + 1);
+            break;
+        case 3:
+            while (MODBUS_TCP_MAX_ADU_LENGTH + 1 > length && g_rand_boolean(rand))
+            {
+                buf[length++] = g_rand_int_range(rand, 0, 256);
+            }
+            break;
+        case 4:
+            if (MBAP_HEADER_LENGTH < length)
+            {
+                buf[MBAP_HEADER_LENGTH] = g_rand_int_range(rand, 0, 0x18);
+            }
+            break;
+        default:
+            if (MBAP_HEADER_LENGTH + 5 < length)
+            {
+                // A quantity or byte count at its limits
+                static const guint8 values[] = {0, 1, 0x7b, 0x7c, 0x7d, 0x7e, 0xf6, 0xff};
+                buf[MBAP_HEADER_LENGTH + g_rand_int_range(rand, 1, 6)] = values[g_rand_int_range(rand, 0, 8)];
+            }
+            break;
+        }
+    }
+    return length;
+}
+
+int main(int argc, char **argv)
+{
+    GError *error = NULL;
+    GOptionContext *context = g_option_context_new("[FILE|DIRECTORY...] - run inputs and mutations of them");
+    g_option_context_add_main_entries(context, entries, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &error))
+    {
+        g_printerr("fuzz_dispatch: %s\n", error->message);
+        return EXIT_FAILURE;
+    }
+    g_option_context_free(context);
+
+    GPtrArray *inputs = g_ptr_array_new_with_free_func((GDestroyNotify)g_bytes_unref);
+    for (int i = 1; i < argc; i++)
+    {
+        add_input(inputs, argv[i]);
+    }
+    if (0 == inputs->len)
+    {
+        g_printerr("fuzz_dispatch: No inputs\n");
+        return EXIT_FAILURE;
+    }
+    for (guint i = 0; i < inputs->len; i++)
+    {
+        gsize size;
+        const guint8 *data = g_bytes_get_data(g_ptr_array_index(inputs, i), &size);
+        LLVMFuzzerTestOneInput(data, size);
+    }
+
+    GRand *rand = g_rand_new_with_seed(options.seed);
+    guint8 buf[MODBUS_TCP_MAX_ADU_LENGTH + 1];
+    for (gint run = 0; run < options.runs; run++)
+    {
+        gsize size;
+        const guint8 *data = g_bytes_get_data(g_ptr_array_index(inputs, g_rand_int_range(rand, 0, inputs->len)), &size);
+        size = MIN(size, sizeof(buf));
+        memcpy(buf, data, size);
+        size = mutate(rand, buf, size);
+        LLVMFuzzerTestOneInput(buf, size);
+    }
+    printf("fuzz_dispatch: %u inputs and %d mutations passed\n", inputs->len, options.runs);
+    g_rand_free(rand);
+    g_ptr_array_free(inputs, TRUE);
+    return EXIT_SUCCESS;
+}
+
+#endif
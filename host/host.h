@@ -0,0 +1,40 @@
+/**
+ * Copyright (C) 2023, Axis Communications AB, Lund, Sweden
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Interfaces of the host stand-ins that the ACAP SDK does not have, used by
+// the benchmarks and tests to drive the application without a camera
+
+#ifndef _HOST_H_
+#define _HOST_H_
+
+#include <glib.h>
+
+// Parameters start from the defaults in manifest.json and are overridden by
+// environment variables named AXPARAM_<name>, e.g. AXPARAM_Server=127.0.0.1
+
+// Change a parameter of the running application as from its settings page;
+// may be called from any thread, it is set from the default main context
+void host_parameter_set(const gchar *name, const gchar *value);
+
+// Raise a stateful AOA event with topic2 for the matching subscriptions, as
+// the camera would for an object analytics scenario; may be called from any
+// thread, the callbacks are run from the default main context like those
+// of events from the event system
+void host_event_publish(const gchar *topic2, const gboolean active);
+// Number of events sent on declared events, e.g. by the poll events
+guint host_events_sent(void);
+
+#endif /* _HOST_H_ */
@@ -0,0 +1,419 @@
+/**
+ * Copyright (C) 2023, Axis Communications AB, Lund, Sweden
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE // ppoll()
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "modbus_dispatch.h"
+#include "peer.h"
+
+#define PEER_MAX_CONNECTIONS 32
+// Responses per connection waiting for their time to be sent
+#define PEER_PENDING 64
+// Linux' minimum retransmission timeout, the delay after a lost TCP segment
+#define PEER_TCP_RETRANSMIT (200 * 1000)
+
+struct response
+{
+    gint64 due;
+    int length;
+    struct sockaddr_in to;
+    guint8 adu[MODBUS_TCP_MAX_ADU_LENGTH];
+};
+
+// A TCP connection, or all UDP clients sharing the socket
+struct connection
+{
+    int fd; // -1 if unused
+    guint len;
+    guint8 buf[2 * MODBUS_TCP_MAX_ADU_LENGTH];
+    guint head;
+    guint count;
+    struct response pending[PEER_PENDING];
+};
+
+struct peer
+{
+    struct peer_config config;
+    int fd; // Listening TCP socket, or the UDP socket
+    int wake_fd;
+    guint16 port;
+    pthread_t thread;
+    gboolean started;
+    modbus_mapping_t *mapping;
+    GRand *rand;
+    struct connection connections[PEER_MAX_CONNECTIONS];
+    volatile gint accepted;
+    volatile gint requests[256];
+    volatile gint total;
+    guint32 *writes;
+    volatile gint nwrites;
+};
+
+static guint16 get_u16(const guint8 *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+static void log_write(struct peer *peer, const guint16 address, const gboolean value)
+{
+    const gint n = g_atomic_int_get(&peer->nwrites);
+    if (PEER_MAX_WRITES > n)
+    {
+        peer->writes[n] = (guint32)address << 1 | (value ? 1 : 0);
+        g_atomic_int_set(&peer->nwrites, n + 1);
+    }
+}
+
+static void log_coil_writes(struct peer *peer, const guint8 *pdu, const int length)
+{
+    if (MODBUS_FC_WRITE_SINGLE_COIL == pdu[0] && 5 <= length)
+    {
+        log_write(peer, get_u16(&pdu[1]), 0xff == pdu[3]);
+    }
+    else if (MODBUS_FC_WRITE_MULTIPLE_COILS == pdu[0] && 6 <= length)
+    {
+        const guint16 address = get_u16(&pdu[1]);
+        const guint n = MIN(get_u16(&pdu[3]), (guint)(length - 6) * 8);
+        for (guint i = 0; i < n; i++)
+        {
+            log_write(peer, address + i, pdu[6 + i / 8] >> (i % 8) & 1);
+        }
+    }
+}
+
+// Answer the request in adu from its due time; returns FALSE if it is lost
+static gboolean handle_request(struct peer *peer, struct connection *c, const guint8 *adu, const int length)
+{
+    const gboolean lost = peer->config.loss_percent > (guint)g_rand_int_range(peer->rand, 0, 100);
+    if (lost && peer->config.udp)
+    {
+        return FALSE;
+    }
+
+    struct response *r = &c->pending[(c->head + c->count) % PEER_PENDING];
+    memcpy(r->adu, adu, length);
+    log_coil_writes(peer, &adu[MBAP_HEADER_LENGTH], length - MBAP_HEADER_LENGTH);
+    g_atomic_int_inc(&peer->requests[adu[MBAP_HEADER_LENGTH]]);
+    g_atomic_int_inc(&peer->total);
+    r->length = modbus_dispatch_request(r->adu, length, peer->mapping);
+    r->due = g_get_monotonic_time() + peer->config.latency_us + (lost ? PEER_TCP_RETRANSMIT : 0);
+    if (0 < c->count)
+    {
+        // In order, as a TCP stream or a PLC handling one request at a time
+        r->due = MAX(r->due, c->pending[(c->head + c->count - 1) % PEER_PENDING].due);
+    }
+    c->count++;
+    return TRUE;
+}
+
+static void close_connection(struct connection *c)
+{
+    close(c->fd);
+    c->fd = -1;
+    c->len = 0;
+    c->count = 0;
+}
+
+// Handle the complete frames received on a TCP connection, while there is
+// room for their responses
+static void handle_frames(struct peer *peer, struct connection *c)
+{
+    guint offset = 0;
+    while (MBAP_HEADER_LENGTH <= c->len - offset && PEER_PENDING > c->count)
+    {
+        const guint length = 6 + get_u16(&c->buf[offset + MBAP_LENGTH]);
+        if (MBAP_HEADER_LENGTH + 1 > length || MODBUS_TCP_MAX_ADU_LENGTH < length)
+        {
+            close_connection(c);
+            return;
+        }
+        if (length > c->len - offset)
+        {
+            break;
+        }
+        if (!peer->config.stop_and_wait || 0 == c->count)
+        {
+            handle_request(peer, c, &c->buf[offset], length);
+        }
+        offset += length;
+    }
+    memmove(c->buf, &c->buf[offset], c->len - offset);
+    c->len -= offset;
+}
+
+static void receive_tcp(struct peer *peer, struct connection *c)
+{
+    const ssize_t n = recv(c->fd, &c->buf[c->len], sizeof(c->buf) - c->len, MSG_DONTWAIT);
+    if (0 == n || (-1 == n && EAGAIN != errno && EWOULDBLOCK != errno && EINTR != errno))
+    {
+        close_connection(c);
+        return;
+    }
+    if (0 < n)
+    {
+        c->len += n;
+    }
+    handle_frames(peer, c);
+}
+
+static void receive_udp(struct peer *peer, struct connection *c)
+{
+    guint8 adu[MODBUS_TCP_MAX_ADU_LENGTH];
+    struct sockaddr_in from;
+    socklen_t fromlen = sizeof(from);
+    const ssize_t n = recvfrom(c->fd, adu, sizeof(adu), MSG_DONTWAIT, (struct sockaddr *)&from, &fromlen);
+    if (MBAP_HEADER_LENGTH + 1 > n || 6 + get_u16(&adu[MBAP_LENGTH]) != n)
+    {
+        return;
+    }
+    if (handle_request(peer, c, adu, n))
+    {
+        c->pending[(c->head + c->count - 1) % PEER_PENDING].to = from;
+    }
+}
+
+static void accept_connection(struct peer *peer)
+{
+    const int fd = accept(peer->fd, NULL, NULL);
+    if (-1 == fd)
+    {
+        return;
+    }
+    for (guint i = 0; i < PEER_MAX_CONNECTIONS; i++)
+    {
+        if (-1 == peer->connections[i].fd)
+        {
+            const int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            peer->connections[i].fd = fd;
+            g_atomic_int_inc(&peer->accepted);
+            return;
+        }
+    }
+    close(fd);
+}
+
+// Send the responses that are due, returns the time the next one is due or 0
+static gint64 send_due(struct peer *peer, struct connection *c)
+{
+    const gint64 now = g_get_monotonic_time();
+    while (0 < c->count && now >= c->pending[c->head].due)
+    {
+        struct response *r = &c->pending[c->head];
+        ssize_t sent = r->length;
+        if (0 < r->length)
+        {
+            sent = peer->config.udp ? sendto(c->fd, r->adu, r->length, 0, (struct sockaddr *)&r->to, sizeof(r->to))
+                                    : send(c->fd, r->adu, r->length, MSG_NOSIGNAL);
+        }
+        c->head = (c->head + 1) % PEER_PENDING;
+        c->count--;
+        if (sent != r->length && !peer->config.udp)
+        {
+            close_connection(c);
+            return 0;
+        }
+    }
+    if (!peer->config.udp)
+    {
+        // Frames left waiting for room in the queue
+        handle_frames(peer, c);
+    }
+    return 0 < c->count ? c->pending[c->head].due : 0;
+}
+
+static void *run_peer(void *arg)
+{
+    struct peer *peer = arg;
+    struct pollfd fds[PEER_MAX_CONNECTIONS + 2];
+    struct connection *polled[PEER_MAX_CONNECTIONS];
+
+    for (;;)
+    {
+        gint64 next = 0;
+        for (guint i = 0; i < PEER_MAX_CONNECTIONS; i++)
+        {
+            struct connection *c = &peer->connections[i];
+            if (-1 != c->fd)
+            {
+                const gint64 due = send_due(peer, c);
+                next = 0 == next || (0 != due && due < next) ? due : next;
+            }
+        }
+
+        nfds_t nfds = 0;
+        fds[nfds++] = (struct pollfd){.fd = peer->wake_fd, .events = POLLIN};
+        if (!peer->config.udp)
+        {
+            fds[nfds++] = (struct pollfd){.fd = peer->fd, .events = POLLIN};
+        }
+        const nfds_t first = nfds;
+        for (guint i = 0; i < PEER_MAX_CONNECTIONS; i++)
+        {
+            struct connection *c = &peer->connections[i];
+            if (-1 != c->fd && PEER_PENDING > c->count)
+            {
+                polled[nfds - first] = c;
+                fds[nfds++] = (struct pollfd){.fd = c->fd, .events = POLLIN};
+            }
+        }
+
+        struct timespec timeout = {0};
+        if (0 != next)
+        {
+            const gint64 wait = MAX(0, next - g_get_monotonic_time());
+            timeout.tv_sec = wait / G_USEC_PER_SEC;
+            timeout.tv_nsec = wait % G_USEC_PER_SEC * 1000;
+        }
+        if (-1 == ppoll(fds, nfds, 0 != next ? &timeout : NULL, NULL) && EINTR != errno)
+        {
+            break;
+        }
+        if (fds[0].revents)
+        {
+            break;
+        }
+        if (!peer->config.udp && fds[1].revents)
+        {
+            accept_connection(peer);
+        }
+        for (nfds_t i = first; i < nfds; i++)
+        {
+            if (fds[i].revents)
+            {
+                if (peer->config.udp)
+                {
+                    receive_udp(peer, polled[i - first]);
+                }
+                else
+                {
+                    receive_tcp(peer, polled[i - first]);
+                }
+            }
+        }
+    }
+    return NULL;
+}
+
+struct peer *peer_start(const guint16 port, const struct peer_config *config)
+{
+    struct peer *peer = g_new0(struct peer, 1);
+    peer->config = *config;
+    peer->wake_fd = eventfd(0, EFD_CLOEXEC);
+    peer->fd = socket(AF_INET, (config->udp ? SOCK_DGRAM : SOCK_STREAM) | SOCK_CLOEXEC, 0);
+    peer->mapping = modbus_mapping_new(0x10000, 0x10000, 0x10000, 0x10000);
+    peer->rand = g_rand_new_with_seed(port);
+    peer->writes = g_new(guint32, PEER_MAX_WRITES);
+    for (guint i = 0; i < PEER_MAX_CONNECTIONS; i++)
+    {
+        peer->connections[i].fd = -1;
+    }
+
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(port)};
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addrlen = sizeof(addr);
+    const int one = 1;
+    if (-1 == peer->wake_fd || -1 == peer->fd || NULL == peer->mapping ||
+        -1 == setsockopt(peer->fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) ||
+        -1 == bind(peer->fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+        (!config->udp && -1 == listen(peer->fd, PEER_MAX_CONNECTIONS)) ||
+        -1 == getsockname(peer->fd, (struct sockaddr *)&addr, &addrlen))
+    {
+        g_printerr("peer: Failed to serve port %u (%s)\n", port, strerror(errno));
+        peer_stop(peer);
+        return NULL;
+    }
+    peer->port = ntohs(addr.sin_port);
+    if (config->udp)
+    {
+        peer->connections[0].fd = peer->fd;
+    }
+    if (0 != pthread_create(&peer->thread, NULL, run_peer, peer))
+    {
+        g_printerr("peer: Failed to create thread\n");
+        peer_stop(peer);
+        return NULL;
+    }
+    peer->started = TRUE;
+    return peer;
+}
+
+guint16 peer_port(const struct peer *peer)
+{
+    return peer->port;
+}
+
+guint peer_connections(const struct peer *peer)
+{
+    return g_atomic_int_get(&peer->accepted);
+}
+
+guint peer_requests(const struct peer *peer, const guint8 function)
+{
+    return g_atomic_int_get(0 == function ? &peer->total : &peer->requests[function]);
+}
+
+guint peer_coil_writes(const struct peer *peer, const guint32 **writes)
+{
+    *writes = peer->writes;
+    return g_atomic_int_get(&peer->nwrites);
+}
+
+void peer_stop(struct peer *peer)
+{
+    if (NULL == peer)
+    {
+        return;
+    }
+    if (peer->started)
+    {
+        eventfd_write(peer->wake_fd, 1);
+        pthread_join(peer->thread, NULL);
+    }
+    for (guint i = 0; i < PEER_MAX_CONNECTIONS; i++)
+    {
+        if (-1 != peer->connections[i].fd && peer->fd != peer->connections[i].fd)
+        {
+            close(peer->connections[i].fd);
+        }
+    }
+    if (-1 != peer->fd)
+    {
+        close(peer->fd);
+    }
+    if (-1 != peer->wake_fd)
+    {
+        close(peer->wake_fd);
+    }
+    if (NULL != peer->mapping)
+    {
+        modbus_mapping_free(peer->mapping);
+    }
+    g_rand_free(peer->rand);
+    g_free(peer->writes);
+    g_free(peer);
+}
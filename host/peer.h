@@ -0,0 +1,59 @@
+/**
+ * Copyright (C) 2023, Axis Communications AB, Lund, Sweden
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _PEER_H_
+#define _PEER_H_
+
+#include <glib.h>
+
+// A loopback stand-in for a PLC for the benchmarks and tests: it serves
+// Modbus/TCP or Modbus/UDP on 127.0.0.1 from one thread and answers with
+// modbus_dispatch_request() from a full register image. It counts the
+// requests into the server diagnostics counters, so it should not share a
+// process with the application in server mode.
+struct peer;
+
+struct peer_config
+{
+    gboolean udp;
+    // Added to every response, later requests are still read and answered
+    // in order, so this acts as the round trip time to a remote PLC
+    guint latency_us;
+    // Requests lost in percent: over UDP they are never answered, over TCP
+    // the response and the ones after it are held back as for a lost segment
+    guint loss_percent;
+    // Over TCP, requests received while a response is still pending are
+    // discarded, as by a PLC that does not support pipelining
+    gboolean stop_and_wait;
+};
+
+// Coil writes are logged in the order they are received, one entry per coil
+#define PEER_MAX_WRITES (1 << 20)
+#define PEER_WRITE_ADDRESS(entry) ((entry) >> 1)
+#define PEER_WRITE_VALUE(entry) ((entry)&1)
+
+// Port 0 picks a free port
+struct peer *peer_start(const guint16 port, const struct peer_config *config);
+guint16 peer_port(const struct peer *peer);
+// TCP connections accepted
+guint peer_connections(const struct peer *peer);
+// Requests answered, all of them if function is 0
+guint peer_requests(const struct peer *peer, const guint8 function);
+// The coil writes logged so far, address << 1 | value; *writes is valid for the returned count
+guint peer_coil_writes(const struct peer *peer, const guint32 **writes);
+void peer_stop(struct peer *peer);
+
+#endif /* _PEER_H_ */
@@ -0,0 +1,361 @@
+/**
+ * Copyright (C) 2023, Axis Communications AB, Lund, Sweden
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Test that the client send path and the server request path do not
+// allocate memory in steady state: malloc(), calloc() and realloc() are
+// interposed and counted, process wide, from the end of a warm-up until the
+// events or requests after it are done. Every case runs in a process of its
+// own. With TEST_ALLOC_ABORT set, the first allocation counted aborts, for
+// a core dump or a debugger to show where it is made.
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <modbus.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "modbus_client.h"
+#include "modbus_server.h"
+#include "peer.h"
+#include "register_map.h"
+
+// Coils written by the client, each once per round
+#define ADDRESSES 64
+#define WARM_UP_ROUNDS 20
+#define ROUNDS 300
+#define WARM_UP_REQUESTS 1000
+#define REQUESTS 20000
+#define TIMEOUT (5 * G_USEC_PER_SEC)
+
+// glibc's allocator, under the names interposed below
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *p, size_t size);
+
+static volatile gint counting = FALSE;
+static volatile gint allocations = 0;
+static gboolean abort_on_allocation = FALSE;
+
+static void count_allocation(void)
+{
+    if (g_atomic_int_get(&counting))
+    {
+        g_atomic_int_inc(&allocations);
+        if (abort_on_allocation)
+        {
+            abort();
+        }
+    }
+}
+
+void *malloc(size_t size)
+{
+    count_allocation();
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+    count_allocation();
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t size)
+{
+    count_allocation();
+    return __libc_realloc(p, size);
+}
+
+static int report(const char *name, const guint n, const char *what)
+{
+    const gint counted = g_atomic_int_get(&allocations);
+    printf("%s: %d allocations in %u %s after warm-up\n", name, counted, n, what);
+    return 0 == counted ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Wait for the peer to have at least n coil writes
+static gboolean wait_for_writes(struct peer *peer, const guint n)
+{
+    const guint32 *writes;
+    const gint64 deadline = g_get_monotonic_time() + TIMEOUT;
+    while (n > peer_coil_writes(peer, &writes))
+    {
+        if (g_get_monotonic_time() > deadline)
+        {
+            return FALSE;
+        }
+        g_usleep(100);
+    }
+    return TRUE;
+}
+
+// Write every coil once per round, and wait for the writes at the peer
+static gboolean send_rounds(struct peer *peer, const guint rounds, guint *events)
+{
+    const guint32 *writes;
+    for (guint round = 0; round < rounds; round++)
+    {
+        const guint before = peer_coil_writes(peer, &writes);
+        for (guint address = 0; address < ADDRESSES; address++)
+        {
+            if (!modbus_client_send_event(address, 0 == *events / ADDRESSES % 2, g_get_monotonic_time()))
+            {
+                g_printerr("test_alloc: Client queue full\n");
+                return FALSE;
+            }
+            (*events)++;
+        }
+        if (!wait_for_writes(peer, before + ADDRESSES))
+        {
+            g_printerr("test_alloc: Writes missing at the peer\n");
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+static int test_client(const char *name, const gboolean udp, const guint depth)
+{
+    const struct peer_config config = {.udp = udp};
+    struct peer *peer = peer_start(0, &config);
+    if (NULL == peer)
+    {
+        return EXIT_FAILURE;
+    }
+    modbus_client_set_pipeline_depth(depth);
+    if (!modbus_client_prepare("127.0.0.1", peer_port(peer), udp, "", 1))
+    {
+        g_printerr("test_alloc: Failed to prepare the client\n");
+        return EXIT_FAILURE;
+    }
+    const gint64 deadline = g_get_monotonic_time() + TIMEOUT;
+    while (!modbus_client_ready() && g_get_monotonic_time() < deadline)
+    {
+        g_usleep(1000);
+    }
+    modbus_client_commit();
+
+    guint events = 0;
+    if (!send_rounds(peer, WARM_UP_ROUNDS, &events))
+    {
+        return EXIT_FAILURE;
+    }
+    events = 0;
+    g_atomic_int_set(&counting, TRUE);
+    const gboolean sent = send_rounds(peer, ROUNDS, &events);
+    g_atomic_int_set(&counting, FALSE);
+    modbus_client_cleanup();
+    peer_stop(peer);
+    return sent ? report(name, events, "events") : EXIT_FAILURE;
+}
+
+static int test_client_tcp(void)
+{
+    return test_client("client TCP", FALSE, 1);
+}
+
+static int test_client_pipelined(void)
+{
+    return test_client("client TCP pipelined", FALSE, 8);
+}
+
+static int test_client_udp(void)
+{
+    return test_client("client UDP", TRUE, 1);
+}
+
+// A free port, as far as it can be known before it is used
+static guint16 free_port(void)
+{
+    struct sockaddr_in addr = {.sin_family = AF_INET};
+    socklen_t addrlen = sizeof(addr);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    const int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (-1 == fd || -1 == bind(fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+        -1 == getsockname(fd, (struct sockaddr *)&addr, &addrlen))
+    {
+        g_printerr("test_alloc: Failed to find a free port (%s)\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+    return ntohs(addr.sin_port);
+}
+
+static gboolean poll_requests(modbus_t *ctx, const guint n)
+{
+    guint8 bits[REGMAP_MAX_SLOTS];
+    guint16 registers[REGMAP_MAX_SLOTS * REGMAP_IR_PER_SLOT];
+
+    for (guint i = 0; i < n; i++)
+    {
+        int rc;
+        switch (i % 4)
+        {
+        case 0:
+            rc = modbus_read_bits(ctx, 0, REGMAP_MAX_SLOTS, bits);
+            break;
+        case 1:
+            rc = modbus_read_input_registers(ctx, 0, REGMAP_MAX_SLOTS * REGMAP_IR_PER_SLOT, registers);
+            break;
+        case 2:
+            rc = modbus_read_registers(ctx, 0, REGMAP_HOLDING_REGISTERS, registers);
+            break;
+        default:
+            // Not the control register
+            rc = modbus_write_register(ctx, REGMAP_HR_CONTROL + 1, i);
+            break;
+        }
+        if (-1 == rc)
+        {
+            g_printerr("test_alloc: Request failed (%s)\n", modbus_strerror(errno));
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+// The SCADA side of the server test, in a process of its own since libmodbus
+// allocates: warm up, tell the server side to start counting with 'w', wait
+// for 'g', then poll and report 'd' before disconnecting on 'q'
+static int run_poller(const guint16 port, const int to_server, const int from_server)
+{
+    modbus_t *ctx = modbus_new_tcp("127.0.0.1", port);
+    const gint64 deadline = g_get_monotonic_time() + TIMEOUT;
+    while (NULL != ctx && -1 == modbus_connect(ctx))
+    {
+        if (g_get_monotonic_time() > deadline)
+        {
+            return EXIT_FAILURE;
+        }
+        g_usleep(10 * 1000);
+    }
+    char c;
+    if (NULL == ctx || !poll_requests(ctx, WARM_UP_REQUESTS) || 1 != write(to_server, "w", 1) ||
+        1 != read(from_server, &c, 1) || !poll_requests(ctx, REQUESTS) || 1 != write(to_server, "d", 1) ||
+        1 != read(from_server, &c, 1))
+    {
+        return EXIT_FAILURE;
+    }
+    modbus_close(ctx);
+    modbus_free(ctx);
+    return EXIT_SUCCESS;
+}
+
+// Wait for the poller to send c, publishing events into the register map meanwhile
+static gboolean wait_for_poller(const int fd, const char expected)
+{
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    const gint64 deadline = g_get_monotonic_time() + TIMEOUT;
+    guint published = 0;
+    char c;
+
+    while (g_get_monotonic_time() < deadline)
+    {
+        register_map_publish(published % REGMAP_MAX_SLOTS, 0 == published / REGMAP_MAX_SLOTS % 2);
+        published++;
+        if (1 == poll(&pfd, 1, 1))
+        {
+            return 1 == read(fd, &c, 1) && expected == c;
+        }
+    }
+    return FALSE;
+}
+
+static int test_server(void)
+{
+    const guint16 port = free_port();
+    guint16 addresses[REGMAP_MAX_SLOTS];
+    guint8 units[REGMAP_MAX_SLOTS] = {0};
+    for (guint i = 0; i < REGMAP_MAX_SLOTS; i++)
+    {
+        addresses[i] = i;
+    }
+    register_map_set_slots(addresses, units, REGMAP_MAX_SLOTS, FALSE);
+
+    int to_server[2];
+    int from_server[2];
+    if (-1 == pipe(to_server) || -1 == pipe(from_server))
+    {
+        return EXIT_FAILURE;
+    }
+    const pid_t pid = fork();
+    if (0 == pid)
+    {
+        _exit(run_poller(port, to_server[1], from_server[0]));
+    }
+    if (-1 == pid || !modbus_server_start(port, FALSE, FALSE))
+    {
+        g_printerr("test_alloc: Failed to start the server\n");
+        return EXIT_FAILURE;
+    }
+
+    gboolean ok = wait_for_poller(to_server[0], 'w');
+    g_atomic_int_set(&counting, TRUE);
+    ok = ok && 1 == write(from_server[1], "g", 1) && wait_for_poller(to_server[0], 'd');
+    g_atomic_int_set(&counting, FALSE);
+    ok = ok && 1 == write(from_server[1], "q", 1);
+
+    int status = 0;
+    waitpid(pid, &status, 0);
+    modbus_server_stop();
+    if (!ok || !WIFEXITED(status) || EXIT_SUCCESS != WEXITSTATUS(status))
+    {
+        g_printerr("test_alloc: The poller failed\n");
+        return EXIT_FAILURE;
+    }
+    return report("server", REQUESTS, "requests");
+}
+
+static const struct
+{
+    const char *name;
+    int (*run)(void);
+} tests[] = {
+    {"client TCP", test_client_tcp},
+    {"client TCP pipelined", test_client_pipelined},
+    {"client UDP", test_client_udp},
+    {"server", test_server},
+};
+
+int main(void)
+{
+    abort_on_allocation = NULL != g_getenv("TEST_ALLOC_ABORT");
+    int failed = 0;
+    for (guint i = 0; i < G_N_ELEMENTS(tests); i++)
+    {
+        fflush(stdout);
+        const pid_t pid = fork();
+        if (0 == pid)
+        {
+            exit(tests[i].run());
+        }
+        int status = 0;
+        if (-1 == pid || -1 == waitpid(pid, &status, 0) || !WIFEXITED(status) ||
+            EXIT_SUCCESS != WEXITSTATUS(status))
+        {
+            printf("%s: FAILED\n", tests[i].name);
+            failed++;
+        }
+    }
+    return 0 == failed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,289 @@
+/**
+ * Copyright (C) 2023, Axis Communications AB, Lund, Sweden
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Test that journaled transitions survive the process being killed in the
+// middle of a burst: a child process raises events for a PLC that is down,
+// one coil address per event in increasing order, and reports each one on a
+// pipe until it is killed with SIGKILL. Then the PLC comes up, and a client
+// in this process drains the journal. The coils must be written in the
+// order their events were raised, with none missing before the last one
+// written, and at least every event reported well before the kill must be
+// written.
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "modbus_client.h"
+#include "modbusacap_common.h"
+#include "peer.h"
+
+#define JOURNAL_SIZE 4096
+// Events raised by the child, one per millisecond
+#define EVENTS 400
+// Events reported at least this long before the kill must have been journaled
+#define JOURNAL_DELAY (100 * 1000)
+#define TIMEOUT (5 * G_USEC_PER_SEC)
+// The drain is done when no coil has been written for this long
+#define DRAIN_IDLE (2 * G_USEC_PER_SEC)
+#define DRAIN_TIMEOUT (60 * G_USEC_PER_SEC)
+
+// A free port, as far as it can be known before it is used
+static guint16 free_port(void)
+{
+    struct sockaddr_in addr = {.sin_family = AF_INET};
+    socklen_t addrlen = sizeof(addr);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    const int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (-1 == fd || -1 == bind(fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+        -1 == getsockname(fd, (struct sockaddr *)&addr, &addrlen))
+    {
+        g_printerr("test_journal: Failed to find a free port (%s)\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+    return ntohs(addr.sin_port);
+}
+
+// Commit the client, once it is connected if the PLC is up
+static gboolean start_client(const guint16 port, const gboolean plc_up)
+{
+    modbus_client_set_journal_size(JOURNAL_SIZE);
+    modbus_client_set_journal_max_age(0);
+    if (!modbus_client_prepare("127.0.0.1", port, FALSE, "", 1))
+    {
+        g_printerr("test_journal: Failed to prepare the client\n");
+        return FALSE;
+    }
+    const gint64 deadline = g_get_monotonic_time() + TIMEOUT;
+    while (plc_up && !modbus_client_ready() && g_get_monotonic_time() < deadline)
+    {
+        g_usleep(1000);
+    }
+    modbus_client_commit();
+    return TRUE;
+}
+
+// The child: raise events while the PLC is down, once the sender has opened
+// its journal, until killed
+static int raise_events(const guint16 port, const int report)
+{
+    // Connection attempts fail all along
+    log_level = LOG_CRIT;
+    if (!start_client(port, FALSE))
+    {
+        return EXIT_FAILURE;
+    }
+    gchar *path = g_strdup_printf("localdata/journal-127.0.0.1_%u.bin", port);
+    const gint64 deadline = g_get_monotonic_time() + TIMEOUT;
+    while (!g_file_test(path, G_FILE_TEST_IS_REGULAR))
+    {
+        if (g_get_monotonic_time() > deadline)
+        {
+            g_printerr("test_journal: No journal %s\n", path);
+            return EXIT_FAILURE;
+        }
+        g_usleep(1000);
+    }
+    g_free(path);
+    // Created just before the sender holds it
+    g_usleep(10 * 1000);
+
+    for (guint16 i = 0; i < EVENTS; i++)
+    {
+        if (!modbus_client_send_event(i, TRUE, g_get_monotonic_time()) || sizeof(i) != write(report, &i, sizeof(i)))
+        {
+            return EXIT_FAILURE;
+        }
+        g_usleep(1000);
+    }
+    // Not killed in time, which the parent reports
+    pause();
+    return EXIT_SUCCESS;
+}
+
+// Read the events reported by the child until about half of them are, and
+// kill it; returns the number reported, and in *early those reported at
+// least JOURNAL_DELAY before the kill
+static guint kill_mid_burst(const pid_t pid, const int report, guint *early)
+{
+    gint64 reported_at[EVENTS];
+    struct pollfd pfd = {.fd = report, .events = POLLIN};
+    guint n = 0;
+    guint16 i;
+
+    // The child opens its journal first
+    const gint64 deadline = g_get_monotonic_time() + 2 * TIMEOUT;
+    while (EVENTS / 2 > n && g_get_monotonic_time() < deadline)
+    {
+        if (1 == poll(&pfd, 1, 10) && sizeof(i) == read(report, &i, sizeof(i)) && i == n)
+        {
+            reported_at[n++] = g_get_monotonic_time();
+        }
+    }
+    kill(pid, SIGKILL);
+    const gint64 killed = g_get_monotonic_time();
+    waitpid(pid, NULL, 0);
+
+    // The rest written before the kill, reported later than they were
+    while (EVENTS > n && sizeof(i) == read(report, &i, sizeof(i)) && i == n)
+    {
+        reported_at[n++] = killed;
+    }
+    for (*early = 0; *early < n && JOURNAL_DELAY <= killed - reported_at[*early]; (*early)++)
+    {
+    }
+    return n;
+}
+
+// Wait until the journal has been drained to the peer
+static void wait_for_drain(struct peer *peer)
+{
+    const guint32 *writes;
+    const gint64 start = g_get_monotonic_time();
+    gint64 last_write = start;
+    guint n = 0;
+
+    while (g_get_monotonic_time() - last_write < DRAIN_IDLE && g_get_monotonic_time() - start < DRAIN_TIMEOUT)
+    {
+        const guint now_written = peer_coil_writes(peer, &writes);
+        if (now_written != n)
+        {
+            n = now_written;
+            last_write = g_get_monotonic_time();
+        }
+        g_usleep(10 * 1000);
+    }
+}
+
+// The coils set at the peer, in the order of their first write; a write may
+// be repeated after a reconnect. Returns the number of coils set in order
+// from address 0, or -1 if any is out of order.
+static gint first_writes_in_order(struct peer *peer)
+{
+    const guint32 *writes;
+    const guint n = peer_coil_writes(peer, &writes);
+    gboolean seen[EVENTS] = {FALSE};
+    gint next = 0;
+
+    for (guint i = 0; i < n; i++)
+    {
+        const guint address = PEER_WRITE_ADDRESS(writes[i]);
+        if (!PEER_WRITE_VALUE(writes[i]) || EVENTS <= address || seen[address])
+        {
+            continue;
+        }
+        if ((guint)next != address)
+        {
+            g_printerr("test_journal: Coil %u written before coil %d\n", address, next);
+            return -1;
+        }
+        seen[address] = TRUE;
+        next++;
+    }
+    return next;
+}
+
+static void remove_tree(const gchar *path)
+{
+    GDir *dir = g_dir_open(path, 0, NULL);
+    const gchar *name;
+    while (NULL != dir && NULL != (name = g_dir_read_name(dir)))
+    {
+        gchar *child = g_build_filename(path, name, NULL);
+        if (g_file_test(child, G_FILE_TEST_IS_DIR))
+        {
+            remove_tree(child);
+        }
+        else
+        {
+            unlink(child);
+        }
+        g_free(child);
+    }
+    if (NULL != dir)
+    {
+        g_dir_close(dir);
+    }
+    rmdir(path);
+}
+
+int main(void)
+{
+    GError *error = NULL;
+    gchar *dir = g_dir_make_tmp("test_journal-XXXXXX", &error);
+    if (NULL == dir || -1 == chdir(dir) || -1 == mkdir("localdata", 0755))
+    {
+        g_printerr("test_journal: Failed to create a working directory\n");
+        return EXIT_FAILURE;
+    }
+
+    // Nothing listens on the port until the child has been killed
+    const guint16 port = free_port();
+    int report[2];
+    if (-1 == pipe(report))
+    {
+        return EXIT_FAILURE;
+    }
+    fflush(stdout);
+    const pid_t pid = fork();
+    if (0 == pid)
+    {
+        close(report[0]);
+        _exit(raise_events(port, report[1]));
+    }
+    close(report[1]);
+    guint early;
+    const guint reported = kill_mid_burst(pid, report[0], &early);
+    close(report[0]);
+    if (0 == early || EVENTS <= reported)
+    {
+        g_printerr("test_journal: The child was not killed mid-burst (%u events reported)\n", reported);
+        return EXIT_FAILURE;
+    }
+
+    const struct peer_config config = {0};
+    struct peer *peer = peer_start(port, &config);
+    if (NULL == peer || !start_client(port, TRUE))
+    {
+        return EXIT_FAILURE;
+    }
+    wait_for_drain(peer);
+    const gint written = first_writes_in_order(peer);
+    modbus_client_cleanup();
+    peer_stop(peer);
+    remove_tree(dir);
+    g_free(dir);
+
+    // An event reported just before the kill may not have been journaled
+    // yet, and one raised just before it may not have been reported yet
+    printf(
+        "journal: %u events reported, %u of them %d ms before the kill, %d written in order\n",
+        reported,
+        early,
+        JOURNAL_DELAY / 1000,
+        written);
+    return early <= (guint)MAX(written, 0) && written <= (gint)reported + 1 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,152 @@
+/**
+ * Copyright (C) 2023, Axis Communications AB, Lund, Sweden
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <glib-unix.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "ingest.h"
+#include "modbusacap_common.h"
+
+// Datagrams read per main loop iteration, so that a busy sender cannot starve the event handling
+#define INGEST_BURST 16
+// The socket is created in the application's own data directory
+#define INGEST_DIR "localdata"
+
+static int ingest_fd = -1;
+static guint ingest_source = 0;
+static gchar *ingest_path = NULL;
+static IngestCallback ingest_callback = NULL;
+
+static gboolean ingest_source_callback(gint fd, GIOCondition condition, gpointer data)
+{
+    guint8 buf[INGEST_MAX_RECORDS * INGEST_RECORD_SIZE + 1];
+
+    (void)condition;
+    (void)data;
+    for (guint i = 0; i < INGEST_BURST; i++)
+    {
+        const ssize_t len = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+        if (-1 == len)
+        {
+            if (EAGAIN != errno && EWOULDBLOCK != errno && EINTR != errno)
+            {
+                LOG_E("%s/%s: recv failed (%s)", __FILE__, __FUNCTION__, strerror(errno));
+            }
+            break;
+        }
+        const gint64 received = g_get_monotonic_time();
+        if (0 == len || 0 != len % INGEST_RECORD_SIZE || INGEST_MAX_RECORDS * INGEST_RECORD_SIZE < len)
+        {
+            LOG_E("%s/%s: Dropping datagram of %zd bytes", __FILE__, __FUNCTION__, len);
+            continue;
+        }
+        for (const guint8 *record = buf; record < buf + len; record += INGEST_RECORD_SIZE)
+        {
+            ingest_callback(record[0], (record[2] << 8) | record[3], (record[4] << 8) | record[5], received);
+        }
+    }
+    return G_SOURCE_CONTINUE;
+}
+
+gboolean ingest_open(const gchar *name, IngestCallback callback)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    struct stat st;
+
+    assert(NULL != name);
+    assert(NULL != callback);
+    ingest_close();
+    if ('\0' == *name || NULL != strchr(name, '/') || 0 == strcmp(name, ".") || 0 == strcmp(name, ".."))
+    {
+        LOG_E("%s/%s: Socket name %s is not a file name", __FILE__, __FUNCTION__, name);
+        return FALSE;
+    }
+    gchar *path = g_build_filename(INGEST_DIR, name, NULL);
+    if (sizeof(addr.sun_path) <= strlen(path))
+    {
+        LOG_E("%s/%s: Socket path %s is too long", __FILE__, __FUNCTION__, path);
+        g_free(path);
+        return FALSE;
+    }
+    strcpy(addr.sun_path, path);
+    // A stale socket from an earlier run would make bind fail, but anything
+    // else at the path is left alone
+    if (0 == lstat(path, &st))
+    {
+        if (!S_ISSOCK(st.st_mode))
+        {
+            LOG_E("%s/%s: %s exists and is not a socket", __FILE__, __FUNCTION__, path);
+            g_free(path);
+            return FALSE;
+        }
+        unlink(path);
+    }
+
+    ingest_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (-1 == ingest_fd)
+    {
+        LOG_E("%s/%s: Failed to create socket (%s)", __FILE__, __FUNCTION__, strerror(errno));
+        g_free(path);
+        return FALSE;
+    }
+    // Sending requires write permission, so only processes running as the
+    // application's user or in its group can drive the PLC
+    if (-1 == bind(ingest_fd, (struct sockaddr *)&addr, sizeof(addr)))
+    {
+        LOG_E("%s/%s: Failed to bind %s (%s)", __FILE__, __FUNCTION__, path, strerror(errno));
+        close(ingest_fd);
+        ingest_fd = -1;
+        g_free(path);
+        return FALSE;
+    }
+    if (-1 == chmod(path, 0660))
+    {
+        LOG_E("%s/%s: Failed to restrict %s (%s)", __FILE__, __FUNCTION__, path, strerror(errno));
+        close(ingest_fd);
+        ingest_fd = -1;
+        unlink(path);
+        g_free(path);
+        return FALSE;
+    }
+
+    ingest_path = path;
+    ingest_callback = callback;
+    ingest_source = g_unix_fd_add(ingest_fd, G_IO_IN, ingest_source_callback, NULL);
+    LOG_I("%s/%s: Accepting writes on %s", __FILE__, __FUNCTION__, path);
+    return TRUE;
+}
+
+void ingest_close(void)
+{
+    if (0 != ingest_source)
+    {
+        g_source_remove(ingest_source);
+        ingest_source = 0;
+    }
+    if (-1 != ingest_fd)
+    {
+        close(ingest_fd);
+        ingest_fd = -1;
+        unlink(ingest_path);
+    }
+    g_free(ingest_path);
+    ingest_path = NULL;
+}
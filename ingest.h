@@ -0,0 +1,45 @@
+/**
+ * Copyright (C) 2023, Axis Communications AB, Lund, Sweden
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _INGEST_H_
+#define _INGEST_H_
+
+#include <glib.h>
+
+// Other applications on the device submit writes as datagrams on a Unix
+// domain socket. A datagram is a batch of up to INGEST_MAX_RECORDS records
+// of INGEST_RECORD_SIZE bytes, each one:
+//
+//   byte 0     table, INGEST_TABLE_COIL or INGEST_TABLE_HOLDING_REGISTER
+//   byte 1     reserved, 0
+//   bytes 2-3  address, network byte order
+//   bytes 4-5  value, network byte order; for coils 0 is off, anything else on
+//
+// There is no reply; datagrams of the wrong size are dropped as a whole.
+#define INGEST_TABLE_COIL 0
+#define INGEST_TABLE_HOLDING_REGISTER 1
+#define INGEST_RECORD_SIZE 6
+#define INGEST_MAX_RECORDS 128
+
+// Called on the main loop for each record, received is the monotonic time the datagram was read
+typedef void (*IngestCallback)(const guint8 table, const guint16 address, const guint16 value, const gint64 received);
+
+// Bind a socket named name in the application's localdata directory, readable
+// and writable by its user and group only
+gboolean ingest_open(const gchar *name, IngestCallback callback);
+void ingest_close(void);
+
+#endif /* _INGEST_H_ */
@@ -0,0 +1,223 @@
+/**
+ * Copyright (C) 2023, Axis Communications AB, Lund, Sweden
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "journal.h"
+#include "modbusacap_common.h"
+
+#define JOURNAL_MAGIC 0x4d424a31 // "MBJ1"
+
+// The file is this header followed by capacity records in a ring; head is the
+// sequence number of the next record to append and tail of the oldest one.
+// A record is written before head is advanced, so a crash between the two
+// loses only the record being appended.
+struct journal_header
+{
+    guint32 magic;
+    guint32 capacity;
+    guint64 head;
+    guint64 tail;
+    guint8 reserved[8];
+};
+
+struct journal
+{
+    gchar *path;
+    int fd;
+    gsize size;
+    struct journal_header *header;
+    struct journal_record *records;
+};
+
+struct journal *journal_open(const gchar *path, guint capacity)
+{
+    assert(NULL != path);
+
+    const int fd = open(path, O_RDWR | O_CLOEXEC | (0 < capacity ? O_CREAT : 0), 0644);
+    if (-1 == fd)
+    {
+        LOG_E("%s/%s: Failed to open %s (%s)", __FILE__, __FUNCTION__, path, strerror(errno));
+        return NULL;
+    }
+    if (-1 == flock(fd, LOCK_EX | LOCK_NB))
+    {
+        // Still held by a replaced server being closed, errno is EWOULDBLOCK
+        const int error = errno;
+        if (EWOULDBLOCK != error)
+        {
+            LOG_E("%s/%s: Failed to lock %s (%s)", __FILE__, __FUNCTION__, path, strerror(error));
+        }
+        close(fd);
+        errno = error;
+        return NULL;
+    }
+    struct stat opened;
+    struct stat named;
+    if (-1 == fstat(fd, &opened) || -1 == stat(path, &named) || opened.st_ino != named.st_ino ||
+        opened.st_dev != named.st_dev)
+    {
+        // Deleted by the server that held it while we waited for the lock
+        close(fd);
+        errno = EWOULDBLOCK;
+        return NULL;
+    }
+    if (0 == capacity)
+    {
+        // An existing journal, of the capacity it was created with
+        struct journal_header header;
+        if (sizeof(header) != pread(fd, &header, sizeof(header), 0) || JOURNAL_MAGIC != header.magic ||
+            0 == header.capacity)
+        {
+            LOG_E("%s/%s: %s is not a journal", __FILE__, __FUNCTION__, path);
+            close(fd);
+            errno = EINVAL;
+            return NULL;
+        }
+        capacity = header.capacity;
+    }
+    const gsize size = sizeof(struct journal_header) + capacity * sizeof(struct journal_record);
+    if (-1 == ftruncate(fd, size))
+    {
+        LOG_E("%s/%s: Failed to size %s (%s)", __FILE__, __FUNCTION__, path, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (MAP_FAILED == map)
+    {
+        LOG_E("%s/%s: Failed to map %s (%s)", __FILE__, __FUNCTION__, path, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    struct journal *journal = g_new0(struct journal, 1);
+    journal->path = g_strdup(path);
+    journal->fd = fd;
+    journal->size = size;
+    journal->header = map;
+    journal->records = (struct journal_record *)(journal->header + 1);
+
+    if (JOURNAL_MAGIC != journal->header->magic || capacity != journal->header->capacity ||
+        journal->header->head < journal->header->tail || capacity < journal->header->head - journal->header->tail)
+    {
+        if (JOURNAL_MAGIC == journal->header->magic)
+        {
+            LOG_E("%s/%s: Discarding %s, its size has changed", __FILE__, __FUNCTION__, path);
+        }
+        memset(journal->header, 0, sizeof(*journal->header));
+        journal->header->capacity = capacity;
+        journal->header->magic = JOURNAL_MAGIC;
+    }
+    else if (0 < journal_pending(journal))
+    {
+        LOG_I("%s/%s: %u journaled transitions pending in %s", __FILE__, __FUNCTION__, journal_pending(journal), path);
+    }
+    return journal;
+}
+
+void journal_close(struct journal *journal)
+{
+    if (NULL == journal)
+    {
+        return;
+    }
+    msync(journal->header, journal->size, MS_SYNC);
+    munmap(journal->header, journal->size);
+    close(journal->fd);
+    g_free(journal->path);
+    g_free(journal);
+}
+
+void journal_remove(struct journal *journal)
+{
+    if (NULL == journal)
+    {
+        return;
+    }
+    // Unlinked before the lock is released, journal_open() tells a file deleted
+    // while it waited for the lock from a new one by its inode
+    if (-1 == unlink(journal->path))
+    {
+        LOG_E("%s/%s: Failed to delete %s (%s)", __FILE__, __FUNCTION__, journal->path, strerror(errno));
+    }
+    else if (0 < journal_pending(journal))
+    {
+        LOG_I(
+            "%s/%s: Discarded %u journaled transitions in %s",
+            __FILE__,
+            __FUNCTION__,
+            journal_pending(journal),
+            journal->path);
+    }
+    munmap(journal->header, journal->size);
+    close(journal->fd);
+    g_free(journal->path);
+    g_free(journal);
+}
+
+gboolean journal_append(struct journal *journal, const guint16 address, const gboolean active, const gint64 time)
+{
+    struct journal_header *header = journal->header;
+    if (header->capacity <= header->head - header->tail)
+    {
+        return FALSE;
+    }
+
+    struct journal_record *record = &journal->records[header->head % header->capacity];
+    record->seq = header->head;
+    record->time = time;
+    record->address = address;
+    record->active = active;
+    __atomic_store_n(&header->head, header->head + 1, __ATOMIC_RELEASE);
+    return TRUE;
+}
+
+guint journal_pending(const struct journal *journal)
+{
+    return journal->header->head - journal->header->tail;
+}
+
+guint journal_peek(const struct journal *journal, struct journal_record *records, const guint n)
+{
+    const struct journal_header *header = journal->header;
+    guint copied = 0;
+
+    for (guint64 seq = header->tail; seq < header->head && copied < n; seq++)
+    {
+        const struct journal_record *record = &journal->records[seq % header->capacity];
+        if (seq != record->seq)
+        {
+            // Corrupt record, consumed along with the records around it
+            LOG_E("%s/%s: Skipping journal record %llu", __FILE__, __FUNCTION__, (unsigned long long)seq);
+            continue;
+        }
+        records[copied++] = *record;
+    }
+    return copied;
+}
+
+void journal_consume(struct journal *journal, const guint64 seq)
+{
+    struct journal_header *header = journal->header;
+    header->tail = CLAMP(seq, header->tail, header->head);
+}
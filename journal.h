@@ -0,0 +1,50 @@
+/**
+ * Copyright (C) 2023, Axis Communications AB, Lund, Sweden
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _JOURNAL_H_
+#define _JOURNAL_H_
+
+#include <glib.h>
+
+// A bounded append-only journal of coil transitions in a memory-mapped
+// file, so that its content survives the application crashing or being
+// restarted. A journal is not thread safe and is used by one thread only.
+struct journal;
+
+struct journal_record
+{
+    guint64 seq;
+    gint64 time; // Real time in microseconds
+    guint16 address;
+    guint8 active;
+    guint8 reserved[5];
+};
+
+// Returns NULL with errno set to EWOULDBLOCK if the journal is open elsewhere;
+// a capacity of 0 opens an existing journal, of the capacity it has
+struct journal *journal_open(const gchar *path, guint capacity);
+void journal_close(struct journal *journal);
+// Close the journal and delete its file, discarding any pending records
+void journal_remove(struct journal *journal);
+// Returns FALSE if the journal is full; time is the real time of the transition
+gboolean journal_append(struct journal *journal, const guint16 address, const gboolean active, const gint64 time);
+guint journal_pending(const struct journal *journal);
+// Copy up to n of the oldest records, without removing them; returns the number copied
+guint journal_peek(const struct journal *journal, struct journal_record *records, const guint n);
+// Remove the records with a sequence number below seq
+void journal_consume(struct journal *journal, const guint64 seq);
+
+#endif /* _JOURNAL_H_ */
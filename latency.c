@@ -0,0 +1,173 @@
+/**
+ * Copyright (C) 2023, Axis Communications AB, Lund, Sweden
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "latency.h"
+#include "modbusacap_common.h"
+
+// Log-linear (HDR style) buckets: values below 2^SUB_BITS get a bucket each,
+// above that every power of two is split in 2^(SUB_BITS - 1) buckets, which
+// bounds the relative error to 1/2^(SUB_BITS - 1) at a fixed memory cost
+#define SUB_BITS 4
+#define SUB_COUNT (1 << SUB_BITS)
+#define HALF_COUNT (SUB_COUNT / 2)
+#define MAX_SHIFT 32
+#define BUCKETS (SUB_COUNT + MAX_SHIFT * HALF_COUNT)
+
+struct histogram
+{
+    volatile gint counts[BUCKETS];
+    volatile gint total;
+    volatile gint max;
+};
+
+static const gchar *stage_names[LATENCY_STAGES] = {
+    "event to queue",
+    "queue wait",
+    "round trip",
+    "event to ack",
+    "server request",
+};
+
+static struct histogram histograms[LATENCY_STAGES];
+
+static guint bucket_index(const guint64 value)
+{
+    if (SUB_COUNT > value)
+    {
+        return value;
+    }
+    const guint shift = MIN((guint)(63 - __builtin_clzll(value)) - (SUB_BITS - 1), MAX_SHIFT);
+    const guint64 sub = MIN(value >> shift, SUB_COUNT - 1);
+    return SUB_COUNT + (shift - 1) * HALF_COUNT + (sub - HALF_COUNT);
+}
+
+// Highest value that maps to the bucket
+static guint64 bucket_value(const guint index)
+{
+    if (SUB_COUNT > index)
+    {
+        return index;
+    }
+    const guint shift = (index - SUB_COUNT) / HALF_COUNT + 1;
+    const guint64 sub = (index - SUB_COUNT) % HALF_COUNT + HALF_COUNT;
+    return ((sub + 1) << shift) - 1;
+}
+
+void latency_record(const enum latency_stage stage, const gint64 us)
+{
+    assert(LATENCY_STAGES > stage);
+    struct histogram *h = &histograms[stage];
+    const gint value = CLAMP(us, 0, G_MAXINT32);
+
+    g_atomic_int_inc(&h->counts[bucket_index(value)]);
+    g_atomic_int_inc(&h->total);
+    gint max = g_atomic_int_get(&h->max);
+    while (value > max && !g_atomic_int_compare_and_exchange(&h->max, max, value))
+    {
+        max = g_atomic_int_get(&h->max);
+    }
+}
+
+static guint64 percentile(const struct histogram *h, const guint total, const gdouble p)
+{
+    const guint64 rank = MAX(1, (guint64)(p * total + 0.5));
+    guint64 seen = 0;
+
+    for (guint i = 0; i < BUCKETS; i++)
+    {
+        seen += (guint)g_atomic_int_get(&h->counts[i]);
+        if (seen >= rank)
+        {
+            return MIN(bucket_value(i), (guint64)g_atomic_int_get(&h->max));
+        }
+    }
+    return g_atomic_int_get(&h->max);
+}
+
+static void format_stage(const enum latency_stage stage, gchar *buf, const gsize size)
+{
+    const struct histogram *h = &histograms[stage];
+    const guint total = g_atomic_int_get(&h->total);
+
+    g_snprintf(
+        buf,
+        size,
+        "%s: count %u, p50 %llu us, p99 %llu us, p999 %llu us, max %d us",
+        stage_names[stage],
+        total,
+        (unsigned long long)(0 < total ? percentile(h, total, 0.5) : 0),
+        (unsigned long long)(0 < total ? percentile(h, total, 0.99) : 0),
+        (unsigned long long)(0 < total ? percentile(h, total, 0.999) : 0),
+        g_atomic_int_get(&h->max));
+}
+
+void latency_log(void)
+{
+    gchar buf[160];
+    for (guint stage = 0; stage < LATENCY_STAGES; stage++)
+    {
+        format_stage(stage, buf, sizeof(buf));
+        LOG_I("%s/%s: %s", __FILE__, __FUNCTION__, buf);
+    }
+}
+
+// Written with a stack buffer and plain file descriptor calls, so that the
+// periodic update does not touch the heap
+gboolean latency_write_file(const gchar *path)
+{
+    assert(NULL != path);
+    gchar buf[LATENCY_STAGES * 160];
+    gsize len = 0;
+
+    for (guint stage = 0; stage < LATENCY_STAGES; stage++)
+    {
+        format_stage(stage, buf + len, sizeof(buf) - len - 1);
+        len += strlen(buf + len);
+        buf[len++] = '\n';
+    }
+
+    const int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (-1 == fd)
+    {
+        LOG_E("%s/%s: Failed to open %s (%s)", __FILE__, __FUNCTION__, path, strerror(errno));
+        return FALSE;
+    }
+    const gboolean written = (ssize_t)len == write(fd, buf, len);
+    if (!written)
+    {
+        LOG_E("%s/%s: Failed to write %s (%s)", __FILE__, __FUNCTION__, path, strerror(errno));
+    }
+    close(fd);
+    return written;
+}
+
+void latency_reset(void)
+{
+    for (guint stage = 0; stage < LATENCY_STAGES; stage++)
+    {
+        struct histogram *h = &histograms[stage];
+        for (guint i = 0; i < BUCKETS; i++)
+        {
+            g_atomic_int_set(&h->counts[i], 0);
+        }
+        g_atomic_int_set(&h->total, 0);
+        g_atomic_int_set(&h->max, 0);
+    }
+}
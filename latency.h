@@ -0,0 +1,37 @@
+/**
+ * Copyright (C) 2023, Axis Communications AB, Lund, Sweden
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _LATENCY_H_
+#define _LATENCY_H_
+
+#include <glib.h>
+
+enum latency_stage
+{
+    LATENCY_EVENT_TO_QUEUE,  // Event received to queued for sending
+    LATENCY_QUEUE_WAIT,      // Queued to sent
+    LATENCY_ROUND_TRIP,      // Sent to acknowledged by the server
+    LATENCY_EVENT_TO_ACK,    // Event received to acknowledged by the server
+    LATENCY_SERVER_REQUEST,  // Server request received to reply sent
+    LATENCY_STAGES
+};
+
+void latency_record(const enum latency_stage stage, const gint64 us);
+void latency_log(void);
+gboolean latency_write_file(const gchar *path);
+void latency_reset(void);
+
+#endif /* _LATENCY_H_ */
@@ -14,49 +14,2128 @@
  * limitations under the License.
  */
 
+#define _GNU_SOURCE // sem_clockwait()
+
 #include <assert.h>
 #include <errno.h>
 #include <modbus.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
 
+#include "journal.h"
+#include "latency.h"
 #include "modbus_client.h"
+#include "modbus_diag.h"
+#include "modbus_dispatch.h"
+#include "modbus_poll.h"
 #include "modbusacap_common.h"
 
-static modbus_t *ctx = NULL;
+// Number of queue slots, must be a power of two
+#define SEND_QUEUE_SIZE 256
+#define STATS_INTERVAL (60 * G_USEC_PER_SEC)
+#define RECONNECT_MIN_DELAY (100 * 1000)
+#define RECONNECT_MAX_DELAY (30 * G_USEC_PER_SEC)
+// Most coils written by one pipelined request, longer runs are split
+#define PIPELINE_MAX_RUN 64
+// Coils and registers are spread over the connections to a server in blocks of
+// this many consecutive addresses, so that adjacent ones are still coalesced
+#define CONNECTION_BLOCK 64
+// Modbus/UDP response timeout in milliseconds until the round trip time has
+// been measured, and number of retransmissions
+#define UDP_RESPONSE_TIMEOUT 100
+#define UDP_RETRIES 3
+// Bounds in milliseconds for the response timeout derived from the round trip
+// time over TCP, where a timeout drops the connection; over UDP the lower bound
+// is UDP_RESPONSE_TIMEOUT, since a timeout only retransmits the request
+#define RTT_MIN_TIMEOUT 500
+#define RTT_MAX_TIMEOUT 5000
+// The link is reported as degraded while the smoothed round trip time is this
+// many times the lowest one measured, and above RTT_DEGRADED_MIN microseconds
+#define RTT_DEGRADED_FACTOR 4
+#define RTT_DEGRADED_MIN (10 * 1000)
+// Journal file per server, and how fast and in how large steps it is drained
+#define JOURNAL_PATH "localdata/journal-%s.bin"
+// Journal of a replaced connection, until the new connections have taken it over
+#define JOURNAL_HANDOVER_PATH "localdata/handover-%s-%u.bin"
+#define JOURNAL_DRAIN_BATCH 16
+#define JOURNAL_DRAIN_RATE 100
+// Delay between attempts to open a journal still held by a replaced server
+#define JOURNAL_RETRY_DELAY (100 * 1000)
+
+// The journals of the replaced connections to a server that stays configured
+// over other connections, renamed by the replaced connections as they close
+// them; each new connection takes over the transitions routed to it
+struct journal_handover
+{
+    gchar *paths[MODBUS_CLIENT_MAX_TARGETS * MODBUS_CLIENT_MAX_CONNECTIONS];
+    guint n;
+    guint connections; // Of the new set, to route the transitions
+    volatile gint closing; // Replaced connections that have not closed their journals yet
+    volatile gint refs; // The files are deleted with the last reference
+};
+
+struct send_entry
+{
+    guint16 address;
+    gboolean active;
+    gboolean holding_register; // Write value to a holding register instead of active to a coil
+    guint16 value;
+    gint64 received;
+    gint64 enqueued;
+};
+
+// A pipelined request waiting for its response
+struct in_flight
+{
+    guint16 transaction_id;
+    guint8 function;
+    guint n;
+    gint64 sent;
+    struct send_entry entries[PIPELINE_MAX_RUN];
+};
+
+struct target
+{
+    gchar *name;
+    modbus_t *ctx; // Modbus/TCP only
+    gboolean udp;
+    gchar *host;
+    guint32 port;
+    guint connection; // Among the connections to the same server
+    int udp_fd;
+    volatile gint run;
+    pthread_t thread_id;
+
+    // Bounded single-producer (GMainLoop thread) single-consumer (sender thread)
+    // ring buffer; head is only written by the producer and tail by the consumer
+    struct send_entry queue[SEND_QUEUE_SIZE];
+    volatile gint head;
+    volatile gint tail;
+    sem_t sem;
+
+    struct
+    {
+        volatile gint dropped;
+        guint max_depth;
+        guint sent;
+        guint failed;
+        guint requests;
+        guint coalesced;
+        guint suppressed;
+        guint verified;
+        guint drifted;
+        guint retries;
+        guint duplicates;
+        gint64 ack_total;
+        gint64 ack_max;
+        guint reconnects;
+        gint64 downtime;
+        guint journaled;
+        guint journal_full;
+        guint drained;
+        guint expired;
+        guint heartbeats;
+        guint heartbeat_failures;
+        guint polls;
+        guint poll_changes;
+    } stats;
+
+    // Connection supervision, only used by the sender thread
+    volatile gboolean connected; // Also read by modbus_client_ready()
+    gint64 disconnected_since;
+    gint64 reconnect_delay;
+    gint64 next_connect;
+    gint64 last_verify;
+
+    // Coil transitions that could not be written, kept in order across restarts
+    // and drained at a limited rate; only used by the sender thread
+    gchar *journal_path; // Set until the journal is opened
+    guint journal_capacity;
+    struct journal *journal;
+    gint64 next_journal_open;
+    gint64 next_drain;
+    gboolean discard_journal; // Set when retired by a new configuration
+    gboolean keep_journal; // Reopened by the connection replacing this one
+    struct journal_handover *handover; // Renamed into it when closed, if replaced
+    gchar *handover_path;
+    struct journal_handover *inherited; // To take over, set when committed
+
+    // Pipelined requests, only used by the sender thread; stop_and_wait is set
+    // for servers that turn out not to handle more than one request at a time
+    struct in_flight in_flight[MODBUS_CLIENT_MAX_PIPELINE];
+    guint ninflight;
+    guint16 next_transaction_id;
+    gboolean pipelined;
+    gboolean stop_and_wait;
+    int response_timeout; // Milliseconds
+    int configured_timeout; // Before the round trip time has been measured
+
+    // Round trip time estimate in microseconds, as for TCP retransmissions
+    // (RFC 6298), which the response timeout is derived from; only used by
+    // the sender thread
+    gint64 srtt; // 0 until the first sample
+    gint64 rttvar;
+    guint backoff; // The response timeout is doubled this many times
+    gint64 rtt_min;
+    gboolean rtt_degraded;
+    gboolean retried; // The last Modbus/UDP request was retransmitted
+    gint64 next_heartbeat;
+    gboolean heartbeat_state;
+
+    // Coils and registers read from the first server, NULL if not polling
+    struct modbus_poll *poll;
+
+    // Last state queued per coil address, pushed to the server after (re)connect
+    guint8 coil_known[(G_MAXUINT16 + 1) / 8];
+    guint8 coil_state[(G_MAXUINT16 + 1) / 8];
+
+    // Last state acknowledged by the server per coil address, writes that would
+    // not change it are suppressed; forgotten when the connection is lost
+    guint8 shadow_known[(G_MAXUINT16 + 1) / 8];
+    guint8 shadow_state[(G_MAXUINT16 + 1) / 8];
+
+    struct send_entry batch[SEND_QUEUE_SIZE];
+    guint8 batch_bits[MODBUS_MAX_WRITE_BITS];
+};
+
+// The connections to each server are consecutive, and a coil or register is
+// always written over the same connection, chosen by its block of addresses,
+// to keep the writes to it in order
+struct target_set
+{
+    struct target *targets[MODBUS_CLIENT_MAX_TARGETS * MODBUS_CLIENT_MAX_CONNECTIONS];
+    guint n;
+    guint connections; // Per server
+};
+
+// Events are sent to the active set; a new configuration is built in the
+// pending set and swapped in by modbus_client_commit()
+static struct target_set active;
+static struct target_set pending;
+
+// Number of threads freeing retired sets
+static volatile gint retiring = 0;
+
+// Flush window in milliseconds for coalescing coil writes, 0 disables batching
+static volatile gint batch_window = 0;
+
+// Interval in seconds for reading back acknowledged coils, 0 disables verification
+static volatile gint verify_interval = 0;
+
+// Number of write requests kept in flight per server, 1 is stop-and-wait
+static volatile gint pipeline_depth = 1;
+
+// Number of transitions journaled per server, 0 disables the journal
+static volatile gint journal_size = 0;
+
+// Age in seconds beyond which journaled transitions are dropped, 0 keeps them
+static volatile gint journal_max_age = 0;
+
+// Heartbeat request, sent every heartbeat_interval milliseconds to heartbeat_address
+static volatile gint heartbeat_mode = MODBUS_CLIENT_HEARTBEAT_OFF;
+static volatile gint heartbeat_address = 0;
+static volatile gint heartbeat_interval = 1000;
+
+// Called by the sender thread with polled values that have changed
+static ModbusClientPollCallback poll_callback = NULL;
+
+static guint queue_depth(struct target *t)
+{
+    return (guint)g_atomic_int_get(&t->head) - (guint)g_atomic_int_get(&t->tail);
+}
+
+static void log_stats(struct target *t)
+{
+    LOG_I(
+        "%s/%s: [%s] Send queue depth %u (max %u), %u sent in %u requests, %u coalesced, %u suppressed, %u failed, "
+        "%d dropped, enqueue-to-ACK avg %lld us, max %lld us, %u reconnects, downtime %lld ms, %u coils verified, "
+        "%u drifted, %u retries, %u duplicate responses, %u journaled (%u pending, %u journal full), %u drained, "
+        "%u expired, %u heartbeats (%u failed), RTT %lld us (variation %lld us, min %lld us), "
+        "response timeout %d ms, %u polls, %u polled changes",
+        __FILE__,
+        __FUNCTION__,
+        t->name,
+        queue_depth(t),
+        t->stats.max_depth,
+        t->stats.sent,
+        t->stats.requests,
+        t->stats.coalesced,
+        t->stats.suppressed,
+        t->stats.failed,
+        g_atomic_int_get(&t->stats.dropped),
+        (long long)(0 < t->stats.sent ? t->stats.ack_total / t->stats.sent : 0),
+        (long long)t->stats.ack_max,
+        t->stats.reconnects,
+        (long long)(t->stats.downtime / 1000),
+        t->stats.verified,
+        t->stats.drifted,
+        t->stats.retries,
+        t->stats.duplicates,
+        t->stats.journaled,
+        NULL != t->journal ? journal_pending(t->journal) : 0,
+        t->stats.journal_full,
+        t->stats.drained,
+        t->stats.expired,
+        t->stats.heartbeats,
+        t->stats.heartbeat_failures,
+        (long long)t->srtt,
+        (long long)t->rttvar,
+        (long long)t->rtt_min,
+        t->response_timeout,
+        t->stats.polls,
+        t->stats.poll_changes);
+}
 
-gboolean modbus_client_send_event(const guint16 address, const gboolean active)
+static gboolean get_bit(const guint8 *bits, const guint16 address)
 {
-    assert(NULL != ctx);
+    return 0 != (bits[address >> 3] & (1 << (address & 7)));
+}
 
-    if (1 != modbus_write_bit(ctx, address, active))
+static void set_bit(guint8 *bits, const guint16 address, const gboolean value)
+{
+    if (value)
     {
-        LOG_E("%s/%s: Failed to write Modbus (%s)", __FILE__, __FUNCTION__, modbus_strerror(errno));
+        bits[address >> 3] |= 1 << (address & 7);
+    }
+    else
+    {
+        bits[address >> 3] &= ~(1 << (address & 7));
     }
-    LOG_I("%s/%s: Successfully called modbus_write_bit", __FILE__, __FUNCTION__);
-    return TRUE;
 }
 
-gboolean modbus_client_init(const gchar *server, const guint32 port)
+// Modbus exception responses prove that the link is alive, anything else
+// (timeouts, resets, garbled responses) is treated as a dead connection
+static gboolean is_link_error(const int error)
 {
-    assert(NULL != server);
-    assert(1024 <= port && 65535 >= port);
-    modbus_free(ctx);
-    LOG_I("Trying to create Modbus TCP context for %s:%u", server, port);
-    ctx = modbus_new_tcp(server, port);
-    if (NULL == ctx)
+    return !(EMBXILFUN <= error && EMBXGTAR >= error);
+}
+
+static void put_u16(guint8 *p, const guint16 value)
+{
+    p[0] = value >> 8;
+    p[1] = value & 0xff;
+}
+
+// Build a Read Coils (FC01), Write Single Coil (FC05) or Write Multiple Coils
+// (FC15) request for n coils from address, with one byte per coil in bits, a
+// Read Holding Registers (FC03) request for n registers, or a Write Single
+// Register (FC06) request with the value in bits in network byte order;
+// returns the ADU length
+static guint build_request(
+    guint8 *adu,
+    const guint16 transaction_id,
+    const guint8 function,
+    const guint16 address,
+    const guint n,
+    const guint8 *bits)
+{
+    guint8 *pdu = &adu[MBAP_HEADER_LENGTH];
+    guint length = 5;
+
+    pdu[0] = function;
+    put_u16(&pdu[1], address);
+    switch (function)
     {
-        LOG_E("%s/%s: Unable to create the libmodbus context (%s)", __FILE__, __FUNCTION__, modbus_strerror(errno));
-        return FALSE;
+    case MODBUS_FC_WRITE_SINGLE_COIL:
+        put_u16(&pdu[3], bits[0] ? 0xff00 : 0x0000);
+        break;
+    case MODBUS_FC_WRITE_SINGLE_REGISTER:
+        pdu[3] = bits[0];
+        pdu[4] = bits[1];
+        break;
+    case MODBUS_FC_WRITE_MULTIPLE_COILS:
+        put_u16(&pdu[3], n);
+        pdu[5] = (n + 7) / 8;
+        memset(&pdu[6], 0, pdu[5]);
+        for (guint i = 0; i < n; i++)
+        {
+            pdu[6 + i / 8] |= (bits[i] ? 1 : 0) << (i % 8);
+        }
+        length = 6 + pdu[5];
+        break;
+    default:
+        put_u16(&pdu[3], n);
+        break;
+    }
+    put_u16(&adu[0], transaction_id);
+    put_u16(&adu[2], 0);
+    put_u16(&adu[MBAP_LENGTH], length + 1);
+    adu[MBAP_UNIT_ID] = MODBUS_TCP_SLAVE;
+    return MBAP_HEADER_LENGTH + length;
+}
+
+// Check a Modbus/UDP response to a request for n coils or registers, and
+// unpack read coils into bits, or copy read registers to bits in network byte
+// order; returns n, or -1 with errno set like libmodbus
+static int parse_response(const guint8 *adu, const gsize len, const guint n, guint8 *bits)
+{
+    const guint8 *pdu = &adu[MBAP_HEADER_LENGTH];
+
+    if (0 != (pdu[0] & 0x80))
+    {
+        errno = MODBUS_ENOBASE + pdu[1];
+        return -1;
+    }
+    if (MODBUS_FC_READ_HOLDING_REGISTERS == pdu[0])
+    {
+        if (2 * n != pdu[1] || MBAP_HEADER_LENGTH + 2 + pdu[1] > len)
+        {
+            errno = EMBBADDATA;
+            return -1;
+        }
+        memcpy(bits, &pdu[2], 2 * n);
+        return n;
+    }
+    if (MODBUS_FC_READ_COILS != pdu[0])
+    {
+        return n;
+    }
+    if ((n + 7) / 8 != pdu[1] || MBAP_HEADER_LENGTH + 2 + pdu[1] > len)
+    {
+        errno = EMBBADDATA;
+        return -1;
+    }
+    for (guint i = 0; i < n; i++)
+    {
+        bits[i] = (pdu[2 + i / 8] >> (i % 8)) & 1;
+    }
+    return n;
+}
+
+// Set the response timeout from the round trip time estimate: the smoothed
+// round trip time plus four times its mean deviation, within bounds, or the
+// configured timeout until it has been measured; doubled for each expiry since
+// the last response, as TCP backs off its retransmission timer (RFC 6298)
+static void update_timeout(struct target *t)
+{
+    const int floor = t->udp ? UDP_RESPONSE_TIMEOUT : RTT_MIN_TIMEOUT;
+    gint64 timeout = 0 == t->srtt ? t->configured_timeout
+                                  : CLAMP((t->srtt + 4 * t->rttvar + 999) / 1000, floor, RTT_MAX_TIMEOUT);
+    timeout = MIN(timeout << t->backoff, MAX(RTT_MAX_TIMEOUT, t->configured_timeout));
+    if (timeout != t->response_timeout)
+    {
+        t->response_timeout = timeout;
+        if (!t->udp)
+        {
+            modbus_set_response_timeout(t->ctx, timeout / 1000, (timeout % 1000) * 1000);
+        }
+    }
+}
+
+// A request has timed out
+static void rtt_expired(struct target *t)
+{
+    if (RTT_MAX_TIMEOUT > t->response_timeout)
+    {
+        t->backoff++;
+        update_timeout(t);
+    }
+}
+
+// Forget the estimate before connecting, so that the connection attempt and the
+// resync wait the configured timeout, backed off by any expiries since the last
+// response, rather than one learned on a link that has just failed
+static void rtt_reset(struct target *t)
+{
+    t->srtt = 0;
+    t->rttvar = 0;
+    update_timeout(t);
+}
+
+// Send a Modbus/UDP request and wait for its response, retransmitting the
+// request with the same transaction identifier when no response arrives in
+// time; late responses to earlier attempts or transactions are dropped
+static int udp_request(struct target *t, const guint8 function, const guint16 address, const guint n, guint8 *bits)
+{
+    guint8 adu[MODBUS_TCP_MAX_ADU_LENGTH];
+    guint8 response[MODBUS_TCP_MAX_ADU_LENGTH];
+    const guint16 transaction_id = t->next_transaction_id++;
+    const guint len = build_request(adu, transaction_id, function, address, n, bits);
+
+    for (guint attempt = 0; attempt <= UDP_RETRIES; attempt++)
+    {
+        if (0 < attempt)
+        {
+            t->stats.retries++;
+            rtt_expired(t);
+        }
+        t->retried = 0 < attempt;
+        if ((ssize_t)len != send(t->udp_fd, adu, len, 0))
+        {
+            return -1;
+        }
+        const gint64 deadline = g_get_monotonic_time() + t->response_timeout * 1000;
+        gint64 remaining;
+        while (0 < (remaining = deadline - g_get_monotonic_time()))
+        {
+            struct pollfd pfd = {.fd = t->udp_fd, .events = POLLIN};
+            const int ready = poll(&pfd, 1, (remaining + 999) / 1000);
+            if (-1 == ready && EINTR != errno)
+            {
+                return -1;
+            }
+            if (1 != ready)
+            {
+                continue;
+            }
+            // Fails with ECONNREFUSED if the server port is unreachable
+            const ssize_t rlen = recv(t->udp_fd, response, sizeof(response), 0);
+            if (-1 == rlen)
+            {
+                return -1;
+            }
+            if (MBAP_HEADER_LENGTH + 2 > rlen || transaction_id != ((response[0] << 8) | response[1]) ||
+                function != (response[MBAP_HEADER_LENGTH] & 0x7f))
+            {
+                t->stats.duplicates++;
+                continue;
+            }
+            return parse_response(response, rlen, n, bits);
+        }
+    }
+    rtt_expired(t);
+    errno = ETIMEDOUT;
+    return -1;
+}
+
+// Count the outcome of a request in the client communication counters, error is 0 for a response
+static void count_response(struct target *t, const int error)
+{
+    if (0 == error)
+    {
+        modbus_diag_count(&modbus_diag_client, MODBUS_DIAG_BUS_MESSAGE);
+        modbus_diag_completed(&modbus_diag_client);
+    }
+    else if (ETIMEDOUT == error)
+    {
+        modbus_diag_count(&modbus_diag_client, MODBUS_DIAG_SERVER_NO_RESPONSE);
+        if (!t->udp)
+        {
+            // Modbus/UDP backs off for each retransmission instead
+            rtt_expired(t);
+        }
+    }
+    else if (!is_link_error(error))
+    {
+        modbus_diag_count(&modbus_diag_client, MODBUS_DIAG_BUS_MESSAGE);
+        modbus_diag_count(&modbus_diag_client, MODBUS_DIAG_BUS_EXCEPTION);
+    }
+    else
+    {
+        modbus_diag_count(&modbus_diag_client, MODBUS_DIAG_BUS_COMM_ERROR);
+    }
+}
+
+// Write n coils from address over the target's transport, one byte per coil in bits;
+// returns n on success like libmodbus
+static int write_bits(struct target *t, const guint16 address, const guint n, const guint8 *bits)
+{
+    const guint8 function = 1 == n ? MODBUS_FC_WRITE_SINGLE_COIL : MODBUS_FC_WRITE_MULTIPLE_COILS;
+    int rc;
+
+    if (t->udp)
+    {
+        rc = udp_request(t, function, address, n, (guint8 *)bits);
+    }
+    else
+    {
+        rc = 1 == n ? modbus_write_bit(t->ctx, address, bits[0]) : modbus_write_bits(t->ctx, address, n, bits);
+    }
+    count_response(t, (int)n == rc ? 0 : errno);
+    return rc;
+}
+
+static int write_register(struct target *t, const guint16 address, const guint16 value)
+{
+    guint8 bits[2];
+    int rc;
+
+    if (t->udp)
+    {
+        put_u16(bits, value);
+        rc = udp_request(t, MODBUS_FC_WRITE_SINGLE_REGISTER, address, 1, bits);
+    }
+    else
+    {
+        rc = modbus_write_register(t->ctx, address, value);
+    }
+    count_response(t, 1 == rc ? 0 : errno);
+    return rc;
+}
+
+static int read_registers(struct target *t, const guint16 address, const guint n, guint16 *values)
+{
+    guint8 bytes[2 * MODBUS_MAX_READ_REGISTERS];
+    int rc;
+
+    assert(MODBUS_MAX_READ_REGISTERS >= n);
+    if (t->udp)
+    {
+        rc = udp_request(t, MODBUS_FC_READ_HOLDING_REGISTERS, address, n, bytes);
+        for (guint i = 0; (int)n == rc && i < n; i++)
+        {
+            values[i] = (bytes[2 * i] << 8) | bytes[2 * i + 1];
+        }
+    }
+    else
+    {
+        rc = modbus_read_registers(t->ctx, address, n, values);
+    }
+    count_response(t, (int)n == rc ? 0 : errno);
+    return rc;
+}
+
+static int read_bits(struct target *t, const guint16 address, const guint n, guint8 *bits)
+{
+    const int rc = t->udp ? udp_request(t, MODBUS_FC_READ_COILS, address, n, bits)
+                          : modbus_read_bits(t->ctx, address, n, bits);
+    count_response(t, (int)n == rc ? 0 : errno);
+    return rc;
+}
+
+static gboolean open_transport(struct target *t)
+{
+    if (!t->udp)
+    {
+        return 0 == modbus_connect(t->ctx);
     }
-    if (0 != modbus_connect(ctx))
+
+    struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_DGRAM};
+    struct addrinfo *addresses;
+    gchar *service = g_strdup_printf("%u", t->port);
+    const int rc = getaddrinfo(t->host, service, &hints, &addresses);
+    g_free(service);
+    if (0 != rc)
     {
-        LOG_E("%s/%s: Failed to connect (%s)", __FILE__, __FUNCTION__, modbus_strerror(errno));
-        modbus_free(ctx);
+        LOG_E("%s/%s: [%s] Failed to resolve (%s)", __FILE__, __FUNCTION__, t->name, gai_strerror(rc));
+        errno = EHOSTUNREACH;
         return FALSE;
     }
+    for (struct addrinfo *ai = addresses; NULL != ai && -1 == t->udp_fd; ai = ai->ai_next)
+    {
+        // Connecting the socket makes the kernel drop datagrams from anyone else
+        t->udp_fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (-1 != t->udp_fd && -1 == connect(t->udp_fd, ai->ai_addr, ai->ai_addrlen))
+        {
+            close(t->udp_fd);
+            t->udp_fd = -1;
+        }
+    }
+    freeaddrinfo(addresses);
+    return -1 != t->udp_fd;
+}
+
+static void close_transport(struct target *t)
+{
+    if (!t->udp)
+    {
+        modbus_close(t->ctx);
+    }
+    else if (-1 != t->udp_fd)
+    {
+        close(t->udp_fd);
+        t->udp_fd = -1;
+    }
+}
+
+// Transitions are pending in the journal, or in journals handed over to it
+static gboolean journal_waiting(struct target *t)
+{
+    return NULL != g_atomic_pointer_get(&t->inherited) || 0 < journal_pending(t->journal);
+}
+
+// New transitions go to the journal while the server is down and until the
+// journal has been drained, so that they reach the server in order
+static gboolean journaling(struct target *t)
+{
+    return NULL != t->journal && (!t->connected || journal_waiting(t));
+}
+
+// Append the coil entries among n entries to the journal; when it is full the
+// transitions are lost, but the final states are still written by resync()
+static void journal_entries(struct target *t, const struct send_entry *entries, const guint n)
+{
+    if (NULL == t->journal)
+    {
+        return;
+    }
+    for (guint i = 0; i < n; i++)
+    {
+        if (entries[i].holding_register)
+        {
+            continue;
+        }
+        if (!journal_append(t->journal, entries[i].address, entries[i].active, g_get_real_time()))
+        {
+            t->stats.journal_full++;
+            continue;
+        }
+        t->stats.journaled++;
+    }
+}
+
+static void open_journal(struct target *t)
+{
+    const gint64 now = g_get_monotonic_time();
+    if (NULL == t->journal_path || now < t->next_journal_open)
+    {
+        return;
+    }
+    t->journal = journal_open(t->journal_path, t->journal_capacity);
+    if (NULL == t->journal && EWOULDBLOCK == errno)
+    {
+        t->next_journal_open = now + JOURNAL_RETRY_DELAY;
+        return;
+    }
+    g_free(t->journal_path);
+    t->journal_path = NULL;
+}
+
+// Drop a reference to a handover, deleting its files with the last one
+static void release_handover(struct journal_handover *handover)
+{
+    if (NULL == handover || !g_atomic_int_dec_and_test(&handover->refs))
+    {
+        return;
+    }
+    for (guint i = 0; i < handover->n; i++)
+    {
+        if (-1 == unlink(handover->paths[i]) && ENOENT != errno)
+        {
+            LOG_E("%s/%s: Failed to delete %s (%s)", __FILE__, __FUNCTION__, handover->paths[i], strerror(errno));
+        }
+        g_free(handover->paths[i]);
+    }
+    g_free(handover);
+}
+
+static gint compare_time(gconstpointer a, gconstpointer b, gpointer data)
+{
+    const struct journal_record *record_a = a;
+    const struct journal_record *record_b = b;
+    (void)data;
+    return record_a->time < record_b->time ? -1 : record_a->time > record_b->time ? 1 : 0;
+}
+
+static void disconnect(struct target *t)
+{
+    // Unanswered requests are journaled in the order they were sent, or else
+    // lost and their coils written again by resync()
+    for (guint i = 0; i < t->ninflight; i++)
+    {
+        guint oldest = i;
+        for (guint j = i + 1; j < t->ninflight; j++)
+        {
+            // Transaction IDs wrap, so order them by their distance to the next one
+            if ((guint16)(t->in_flight[j].transaction_id - t->next_transaction_id) <
+                (guint16)(t->in_flight[oldest].transaction_id - t->next_transaction_id))
+            {
+                oldest = j;
+            }
+        }
+        const struct in_flight request = t->in_flight[oldest];
+        t->in_flight[oldest] = t->in_flight[i];
+        t->in_flight[i] = request;
+        t->stats.failed += request.n;
+    }
+    g_atomic_int_set(&t->connected, FALSE);
+    for (guint i = 0; i < t->ninflight; i++)
+    {
+        journal_entries(t, t->in_flight[i].entries, t->in_flight[i].n);
+    }
+    t->ninflight = 0;
+    close_transport(t);
+    t->disconnected_since = g_get_monotonic_time();
+    t->reconnect_delay = RECONNECT_MIN_DELAY;
+    t->next_connect = t->disconnected_since;
+    memset(t->shadow_known, 0, sizeof(t->shadow_known));
+}
+
+// Record that the server has acknowledged a coil state
+static void set_shadow(struct target *t, const guint16 address, const gboolean value)
+{
+    set_bit(t->shadow_known, address, TRUE);
+    set_bit(t->shadow_state, address, value);
+}
+
+// Monotonic time when the next read-back is due, 0 if disabled
+static gint64 verify_deadline(struct target *t)
+{
+    const gint interval = g_atomic_int_get(&verify_interval);
+    return 0 < interval ? t->last_verify + interval * G_USEC_PER_SEC : 0;
+}
+
+// Write the last known state of all coils, one request per run of adjacent addresses
+static gboolean resync(struct target *t)
+{
+    guint address = 0;
+
+    while (G_MAXUINT16 >= address)
+    {
+        if (!get_bit(t->coil_known, address))
+        {
+            address++;
+            continue;
+        }
+        guint n = 0;
+        while (MODBUS_MAX_WRITE_BITS > n && G_MAXUINT16 >= address + n && get_bit(t->coil_known, address + n))
+        {
+            t->batch_bits[n] = get_bit(t->coil_state, address + n);
+            n++;
+        }
+        t->stats.requests++;
+        if ((int)n != write_bits(t, address, n, t->batch_bits))
+        {
+            LOG_E("%s/%s: [%s] Failed to resync coils (%s)", __FILE__, __FUNCTION__, t->name, modbus_strerror(errno));
+            return FALSE;
+        }
+        for (guint i = 0; i < n; i++)
+        {
+            set_shadow(t, address + i, t->batch_bits[i]);
+        }
+        address += n;
+    }
     return TRUE;
 }
 
-void modbus_client_cleanup()
+static void try_connect(struct target *t)
+{
+    const gint64 now = g_get_monotonic_time();
+    if (now < t->next_connect)
+    {
+        return;
+    }
+    rtt_reset(t);
+    // With transitions journaled, resync() waits until they have been drained
+    if (open_transport(t) && ((NULL != t->journal && journal_waiting(t)) || resync(t)))
+    {
+        g_atomic_int_set(&t->connected, TRUE);
+        if (0 < t->disconnected_since)
+        {
+            t->stats.reconnects++;
+            t->stats.downtime += g_get_monotonic_time() - t->disconnected_since;
+            LOG_I(
+                "%s/%s: [%s] Reconnected after %lld ms (%u reconnects)",
+                __FILE__,
+                __FUNCTION__,
+                t->name,
+                (long long)((g_get_monotonic_time() - t->disconnected_since) / 1000),
+                t->stats.reconnects);
+        }
+        t->disconnected_since = 0;
+        t->reconnect_delay = RECONNECT_MIN_DELAY;
+        t->last_verify = g_get_monotonic_time();
+        t->next_heartbeat = t->last_verify + g_atomic_int_get(&heartbeat_interval) * 1000;
+        if (NULL != t->poll)
+        {
+            modbus_poll_reset(t->poll);
+        }
+        return;
+    }
+    LOG_E("%s/%s: [%s] Failed to connect (%s)", __FILE__, __FUNCTION__, t->name, modbus_strerror(errno));
+    close_transport(t);
+    if (0 == t->disconnected_since)
+    {
+        t->disconnected_since = now;
+    }
+
+    // Exponential backoff with jitter, so that many cameras do not retry in lockstep
+    t->next_connect = now + t->reconnect_delay / 2 + g_random_int_range(0, t->reconnect_delay / 2 + 1);
+    t->reconnect_delay = MIN(2 * t->reconnect_delay, RECONNECT_MAX_DELAY);
+}
+
+// Update the round trip time estimate with the time from sending a request
+// to its response, and the response timeout with it
+static void rtt_sample(struct target *t, const gint64 rtt)
+{
+    if (t->udp && t->retried)
+    {
+        // Ambiguous, the response may be to any of the attempts
+        return;
+    }
+    if (0 == t->srtt)
+    {
+        t->srtt = MAX(rtt, 1);
+        t->rttvar = rtt / 2;
+        t->rtt_min = rtt;
+    }
+    else
+    {
+        t->rttvar = (3 * t->rttvar + ABS(t->srtt - rtt)) / 4;
+        t->srtt = MAX((7 * t->srtt + rtt) / 8, 1);
+        t->rtt_min = MIN(t->rtt_min, rtt);
+    }
+    t->backoff = 0;
+    update_timeout(t);
+
+    const gboolean degraded = RTT_DEGRADED_MIN < t->srtt && RTT_DEGRADED_FACTOR * t->rtt_min < t->srtt;
+    if (degraded != t->rtt_degraded)
+    {
+        t->rtt_degraded = degraded;
+        LOG_I(
+            "%s/%s: [%s] Round trip time %s, %lld us (min %lld us), response timeout %d ms",
+            __FILE__,
+            __FUNCTION__,
+            t->name,
+            degraded ? "degraded" : "recovered",
+            (long long)t->srtt,
+            (long long)t->rtt_min,
+            t->response_timeout);
+    }
+}
+
+// Account for n entries acknowledged by the server, written at sent
+static void acknowledged(struct target *t, const struct send_entry *entries, const guint n, const gint64 sent)
+{
+    const gint64 now = g_get_monotonic_time();
+    latency_record(LATENCY_ROUND_TRIP, now - sent);
+    rtt_sample(t, now - sent);
+    for (guint i = 0; i < n; i++)
+    {
+        if (!entries[i].holding_register)
+        {
+            set_shadow(t, entries[i].address, entries[i].active);
+        }
+        const gint64 ack_time = now - entries[i].enqueued;
+        t->stats.ack_total += ack_time;
+        t->stats.ack_max = MAX(t->stats.ack_max, ack_time);
+        latency_record(LATENCY_QUEUE_WAIT, sent - entries[i].enqueued);
+        latency_record(LATENCY_EVENT_TO_ACK, now - entries[i].received);
+    }
+    t->stats.sent += n;
+}
+
+static guint pipeline_window(struct target *t)
+{
+    // Modbus/UDP requests are retransmitted one at a time
+    return t->stop_and_wait || t->udp ? 1 : (guint)g_atomic_int_get(&pipeline_depth);
+}
+
+// Receive exactly len bytes, waiting at most the response timeout for each part
+static gboolean receive_all(const int fd, guint8 *buf, const gsize len, const int timeout)
+{
+    gsize received = 0;
+
+    while (received < len)
+    {
+        struct pollfd pfd = {.fd = fd, .events = POLLIN};
+        const int ready = poll(&pfd, 1, timeout);
+        if (0 == ready)
+        {
+            errno = ETIMEDOUT;
+            return FALSE;
+        }
+        if (-1 == ready)
+        {
+            if (EINTR == errno)
+            {
+                continue;
+            }
+            return FALSE;
+        }
+        const ssize_t rc = recv(fd, buf + received, len - received, 0);
+        if (0 == rc)
+        {
+            errno = ECONNRESET;
+            return FALSE;
+        }
+        if (-1 == rc)
+        {
+            if (EINTR == errno)
+            {
+                continue;
+            }
+            return FALSE;
+        }
+        received += rc;
+    }
+    return TRUE;
+}
+
+// Wait for one response and complete its request; responses may arrive in any order
+static void pipeline_receive(struct target *t)
 {
-    modbus_free(ctx);
+    guint8 adu[MODBUS_TCP_MAX_ADU_LENGTH];
+    const int fd = modbus_get_socket(t->ctx);
+    guint i;
+
+    assert(0 < t->ninflight);
+    gboolean ok = receive_all(fd, adu, MBAP_HEADER_LENGTH + 1, t->response_timeout);
+    const guint length = (adu[MBAP_LENGTH] << 8) | adu[MBAP_LENGTH + 1];
+    // The unit identifier, the function code and at least an exception code
+    if (ok && (3 > length || MODBUS_TCP_MAX_ADU_LENGTH - MBAP_HEADER_LENGTH + 1 < length))
+    {
+        errno = EMBBADDATA;
+        ok = FALSE;
+    }
+    ok = ok && receive_all(fd, adu + MBAP_HEADER_LENGTH + 1, length - 2, t->response_timeout);
+
+    const guint16 transaction_id = (adu[0] << 8) | adu[1];
+    for (i = 0; ok && i < t->ninflight; i++)
+    {
+        if (transaction_id == t->in_flight[i].transaction_id)
+        {
+            break;
+        }
+    }
+    // Only writes are pipelined: a response echoes the address and the value or
+    // quantity, and an exception response holds just the exception code
+    const gboolean exception = 0 != (adu[MBAP_HEADER_LENGTH] & 0x80);
+    if (ok && (t->ninflight == i || t->in_flight[i].function != (adu[MBAP_HEADER_LENGTH] & 0x7f) ||
+               (exception ? 3 : 6) != length))
+    {
+        errno = EMBBADDATA;
+        ok = FALSE;
+    }
+    if (!ok)
+    {
+        const int error = errno;
+        count_response(t, error);
+        LOG_E(
+            "%s/%s: [%s] Failed to receive Modbus response (%s)",
+            __FILE__,
+            __FUNCTION__,
+            t->name,
+            modbus_strerror(error));
+        if (!t->pipelined && 1 < t->ninflight)
+        {
+            // Never got a response with more than one request outstanding
+            LOG_I("%s/%s: [%s] Falling back to stop-and-wait", __FILE__, __FUNCTION__, t->name);
+            t->stop_and_wait = TRUE;
+        }
+        disconnect(t);
+        return;
+    }
+
+    struct in_flight *request = &t->in_flight[i];
+    if (1 < t->ninflight)
+    {
+        t->pipelined = TRUE;
+    }
+    count_response(t, exception ? MODBUS_ENOBASE + adu[MBAP_HEADER_LENGTH + 1] : 0);
+    if (exception)
+    {
+        LOG_E(
+            "%s/%s: [%s] Failed to write Modbus (%s)",
+            __FILE__,
+            __FUNCTION__,
+            t->name,
+            modbus_strerror(MODBUS_ENOBASE + adu[MBAP_HEADER_LENGTH + 1]));
+        t->stats.failed += request->n;
+    }
+    else
+    {
+        acknowledged(t, request->entries, request->n, request->sent);
+    }
+    *request = t->in_flight[--t->ninflight];
+
+    // Responses may overtake each other, so a coil with a later write still
+    // outstanding has no acknowledged state yet
+    for (i = 0; i < t->ninflight; i++)
+    {
+        for (guint j = 0; j < t->in_flight[i].n; j++)
+        {
+            set_bit(t->shadow_known, t->in_flight[i].entries[j].address, FALSE);
+        }
+    }
+}
+
+static void pipeline_drain(struct target *t)
+{
+    while (t->connected && 0 < t->ninflight)
+    {
+        pipeline_receive(t);
+    }
+}
+
+// Read back all acknowledged coils, one request per run of adjacent addresses,
+// and rewrite those that no longer hold their state, e.g. after a PLC restart
+static void verify_coils(struct target *t)
+{
+    guint address = 0;
+
+    t->last_verify = g_get_monotonic_time();
+    pipeline_drain(t);
+    if (!t->connected)
+    {
+        return;
+    }
+    while (G_MAXUINT16 >= address)
+    {
+        if (!get_bit(t->shadow_known, address))
+        {
+            address++;
+            continue;
+        }
+        guint n = 0;
+        while (MODBUS_MAX_WRITE_BITS > n && G_MAXUINT16 >= address + n && get_bit(t->shadow_known, address + n))
+        {
+            n++;
+        }
+        t->stats.requests++;
+        if ((int)n != read_bits(t, address, n, t->batch_bits))
+        {
+            const int error = errno;
+            LOG_E(
+                "%s/%s: [%s] Failed to read back coils (%s)",
+                __FILE__,
+                __FUNCTION__,
+                t->name,
+                modbus_strerror(error));
+            if (is_link_error(error))
+            {
+                disconnect(t);
+            }
+            return;
+        }
+        t->stats.verified += n;
+        for (guint i = 0; i < n; i++)
+        {
+            const guint16 coil = address + i;
+            const gboolean state = get_bit(t->coil_state, coil);
+            if (state == (0 != t->batch_bits[i]))
+            {
+                continue;
+            }
+            LOG_I("%s/%s: [%s] Coil %u has drifted, rewriting it", __FILE__, __FUNCTION__, t->name, coil);
+            t->stats.drifted++;
+            t->stats.requests++;
+            set_bit(t->shadow_known, coil, FALSE);
+            const guint8 value = state;
+            if (1 != write_bits(t, coil, 1, &value))
+            {
+                const int error = errno;
+                LOG_E(
+                    "%s/%s: [%s] Failed to rewrite coil (%s)",
+                    __FILE__,
+                    __FUNCTION__,
+                    t->name,
+                    modbus_strerror(error));
+                if (is_link_error(error))
+                {
+                    disconnect(t);
+                    return;
+                }
+                continue;
+            }
+            set_shadow(t, coil, state);
+        }
+        address += n;
+    }
+}
+
+// Monotonic time when the next heartbeat is due, 0 if disabled; only the first
+// connection to a server sends heartbeats, so that a toggled watchdog coil
+// alternates regularly
+static gint64 heartbeat_deadline(struct target *t)
+{
+    return 0 == t->connection && MODBUS_CLIENT_HEARTBEAT_OFF != g_atomic_int_get(&heartbeat_mode)
+               ? MAX(t->next_heartbeat, 1)
+               : 0;
+}
+
+// Read a holding register or toggle a watchdog coil, which tells the server
+// that the camera is alive and keeps the round trip time estimate current
+static void heartbeat(struct target *t)
+{
+    const guint16 address = g_atomic_int_get(&heartbeat_address);
+    int rc;
+
+    t->next_heartbeat = g_get_monotonic_time() + g_atomic_int_get(&heartbeat_interval) * 1000;
+    pipeline_drain(t);
+    if (!t->connected)
+    {
+        return;
+    }
+    t->stats.requests++;
+    t->stats.heartbeats++;
+    const gint64 sent = g_get_monotonic_time();
+    if (MODBUS_CLIENT_HEARTBEAT_TOGGLE_COIL == g_atomic_int_get(&heartbeat_mode))
+    {
+        const guint8 value = !t->heartbeat_state;
+        rc = write_bits(t, address, 1, &value);
+        if (1 == rc)
+        {
+            t->heartbeat_state = value;
+        }
+    }
+    else
+    {
+        guint16 value;
+        rc = read_registers(t, address, 1, &value);
+    }
+    if (1 != rc)
+    {
+        const int error = errno;
+        LOG_E("%s/%s: [%s] Heartbeat failed (%s)", __FILE__, __FUNCTION__, t->name, modbus_strerror(error));
+        t->stats.heartbeat_failures++;
+        if (is_link_error(error))
+        {
+            disconnect(t);
+        }
+        return;
+    }
+    rtt_sample(t, g_get_monotonic_time() - sent);
+}
+
+static int poll_read(void *data, const gboolean holding_register, const guint16 address, const guint n, guint16 *values)
+{
+    struct target *t = data;
+    guint8 bits[MODBUS_MAX_READ_BITS];
+
+    t->stats.requests++;
+    t->stats.polls++;
+    if (holding_register)
+    {
+        return read_registers(t, address, n, values);
+    }
+    const int rc = read_bits(t, address, n, bits);
+    for (guint i = 0; (int)n == rc && i < n; i++)
+    {
+        values[i] = bits[i];
+    }
+    return rc;
+}
+
+static void poll_changed(void *data, const gboolean holding_register, const guint16 address, const guint16 value)
+{
+    struct target *t = data;
+    t->stats.poll_changes++;
+    const ModbusClientPollCallback callback = g_atomic_pointer_get(&poll_callback);
+    if (NULL != callback)
+    {
+        callback(holding_register, address, value);
+    }
+}
+
+// Do one due read of the polled coils and registers, while no writes are queued
+static void poll_server(struct target *t)
+{
+    pipeline_drain(t);
+    if (!t->connected)
+    {
+        return;
+    }
+    if (!modbus_poll_run(t->poll, poll_read, t, poll_changed))
+    {
+        const int error = errno;
+        LOG_E("%s/%s: [%s] Failed to poll (%s)", __FILE__, __FUNCTION__, t->name, modbus_strerror(error));
+        if (is_link_error(error))
+        {
+            disconnect(t);
+        }
+    }
+}
+
+// Monotonic time when the next drain step is due, 0 if nothing is journaled;
+// the journal is drained once the journals handed over to it have been taken over
+static gint64 drain_deadline(struct target *t)
+{
+    return NULL != t->journal && NULL == g_atomic_pointer_get(&t->inherited) && 0 < journal_pending(t->journal)
+               ? t->next_drain
+               : 0;
+}
+
+// Earliest of two deadlines, where 0 means none
+static gint64 earliest(const gint64 a, const gint64 b)
+{
+    return 0 == a ? b : 0 == b ? a : MIN(a, b);
+}
+
+// Wait for a queued entry, or until the next connection attempt, read-back,
+// heartbeat, poll, drain step or attempt to open or take over a journal is due
+static void wait_for_entry(struct target *t)
+{
+    gint64 deadline = t->connected ? earliest(earliest(verify_deadline(t), heartbeat_deadline(t)), drain_deadline(t))
+                                   : t->next_connect;
+    if (t->connected && NULL != t->poll)
+    {
+        deadline = earliest(deadline, modbus_poll_deadline(t->poll));
+    }
+    if (NULL != t->journal_path || (NULL != t->journal && NULL != g_atomic_pointer_get(&t->inherited)))
+    {
+        deadline = earliest(deadline, t->next_journal_open);
+    }
+    if (t->connected && 0 == deadline)
+    {
+        sem_wait(&t->sem);
+        return;
+    }
+
+    // The deadlines are on the monotonic clock of g_get_monotonic_time(), so
+    // that stepping the real time clock neither stalls nor spins the sender
+    const struct timespec ts = {
+        .tv_sec = deadline / G_USEC_PER_SEC,
+        .tv_nsec = (deadline % G_USEC_PER_SEC) * 1000,
+    };
+    while (-1 == sem_clockwait(&t->sem, CLOCK_MONOTONIC, &ts) && EINTR == errno)
+    {
+    }
+}
+
+static gboolean dequeue(struct target *t, struct send_entry *entry)
+{
+    const guint tail = g_atomic_int_get(&t->tail);
+    if (tail == (guint)g_atomic_int_get(&t->head))
+    {
+        return FALSE;
+    }
+    t->stats.max_depth = MAX(t->stats.max_depth, queue_depth(t));
+    *entry = t->queue[tail & (SEND_QUEUE_SIZE - 1)];
+    g_atomic_int_set(&t->tail, tail + 1);
+    if (!entry->holding_register)
+    {
+        set_bit(t->coil_known, entry->address, TRUE);
+        set_bit(t->coil_state, entry->address, entry->active);
+    }
+    return TRUE;
+}
+
+// Send a request for n entries with consecutive addresses without waiting for
+// its response, unless the window is full
+static void pipeline_send(struct target *t, const struct send_entry *entries, const guint n)
+{
+    guint8 adu[MODBUS_TCP_MAX_ADU_LENGTH];
+
+    assert(0 < n && PIPELINE_MAX_RUN >= n);
+    while (t->connected && pipeline_window(t) <= t->ninflight)
+    {
+        pipeline_receive(t);
+    }
+    if (!t->connected)
+    {
+        journal_entries(t, entries, n);
+        return;
+    }
+
+    struct in_flight *request = &t->in_flight[t->ninflight];
+    request->transaction_id = t->next_transaction_id++;
+    request->n = n;
+    memcpy(request->entries, entries, n * sizeof(*entries));
+    for (guint i = 0; i < n; i++)
+    {
+        // Unknown until acknowledged, so that a later write is never suppressed
+        set_bit(t->shadow_known, entries[i].address, FALSE);
+    }
+
+    for (guint i = 0; i < n; i++)
+    {
+        t->batch_bits[i] = entries[i].active;
+    }
+    request->function = 1 == n ? MODBUS_FC_WRITE_SINGLE_COIL : MODBUS_FC_WRITE_MULTIPLE_COILS;
+    const guint length =
+        build_request(adu, request->transaction_id, request->function, entries[0].address, n, t->batch_bits);
+
+    t->stats.requests++;
+    request->sent = g_get_monotonic_time();
+    if ((ssize_t)length != send(modbus_get_socket(t->ctx), adu, length, MSG_NOSIGNAL))
+    {
+        LOG_E("%s/%s: [%s] Failed to write Modbus (%s)", __FILE__, __FUNCTION__, t->name, strerror(errno));
+        count_response(t, errno);
+        t->stats.failed += n;
+        disconnect(t);
+        journal_entries(t, entries, n);
+        return;
+    }
+    t->ninflight++;
+}
+
+// Write n entries with consecutive addresses, using FC05 for a single coil and FC15 otherwise
+static void write_coils(struct target *t, const struct send_entry *entries, const guint n)
+{
+    assert(0 < n && MODBUS_MAX_WRITE_BITS >= n);
+    if (!t->connected)
+    {
+        // Kept in the coil state and written when reconnected
+        journal_entries(t, entries, n);
+        return;
+    }
+    if (1 < pipeline_window(t))
+    {
+        for (guint i = 0; i < n; i += PIPELINE_MAX_RUN)
+        {
+            pipeline_send(t, &entries[i], MIN(n - i, PIPELINE_MAX_RUN));
+        }
+        return;
+    }
+
+    // Pipelining may just have been turned off
+    pipeline_drain(t);
+    if (!t->connected)
+    {
+        journal_entries(t, entries, n);
+        return;
+    }
+    for (guint i = 0; i < n; i++)
+    {
+        t->batch_bits[i] = entries[i].active;
+    }
+    const gint64 sent = g_get_monotonic_time();
+    const int rc = write_bits(t, entries[0].address, n, t->batch_bits);
+    t->stats.requests++;
+    if ((int)n != rc)
+    {
+        const int error = errno;
+        LOG_E("%s/%s: [%s] Failed to write Modbus (%s)", __FILE__, __FUNCTION__, t->name, modbus_strerror(error));
+        t->stats.failed += n;
+        if (is_link_error(error))
+        {
+            disconnect(t);
+            journal_entries(t, entries, n);
+        }
+        return;
+    }
+
+    acknowledged(t, entries, n, sent);
+}
+
+// Holding registers are not part of the coil image, so a register write is
+// lost rather than written again if the connection is down
+static void write_holding_register(struct target *t, const struct send_entry *entry)
+{
+    if (t->connected)
+    {
+        // Registers are written stop-and-wait, after any pipelined coils
+        pipeline_drain(t);
+    }
+    t->stats.requests++;
+    const gint64 sent = g_get_monotonic_time();
+    if (!t->connected || 1 != write_register(t, entry->address, entry->value))
+    {
+        const int error = errno;
+        LOG_E("%s/%s: [%s] Failed to write register %u", __FILE__, __FUNCTION__, t->name, entry->address);
+        t->stats.failed++;
+        if (t->connected && is_link_error(error))
+        {
+            disconnect(t);
+        }
+        return;
+    }
+    acknowledged(t, entry, 1, sent);
+}
+
+// Write the holding registers among the n first batch entries in queue order,
+// then coalesce the coils to the latest state per address, drop those the
+// server already holds and write each run of adjacent addresses in one request;
+// while journaling, the coils are journaled as they are instead
+static void flush_batch(struct target *t, guint n)
+{
+    struct send_entry *batch = t->batch;
+    guint i;
+    guint unique = 0;
+    guint coils = 0;
+
+    for (i = 0; i < n; i++)
+    {
+        if (batch[i].holding_register)
+        {
+            write_holding_register(t, &batch[i]);
+        }
+        else
+        {
+            batch[coils++] = batch[i];
+        }
+    }
+    n = coils;
+    if (journaling(t))
+    {
+        journal_entries(t, batch, n);
+        return;
+    }
+
+    // Insertion sort on address; stable, so queue order is kept per address
+    for (i = 1; i < n; i++)
+    {
+        const struct send_entry entry = batch[i];
+        guint j = i;
+        while (0 < j && batch[j - 1].address > entry.address)
+        {
+            batch[j] = batch[j - 1];
+            j--;
+        }
+        batch[j] = entry;
+    }
+
+    // Keep the last (most recent) entry for each address
+    for (i = 0; i < n; i++)
+    {
+        if (i + 1 < n && batch[i + 1].address == batch[i].address)
+        {
+            t->stats.coalesced++;
+            continue;
+        }
+        if (get_bit(t->shadow_known, batch[i].address) &&
+            batch[i].active == get_bit(t->shadow_state, batch[i].address))
+        {
+            t->stats.suppressed++;
+            continue;
+        }
+        batch[unique++] = batch[i];
+    }
+
+    guint start = 0;
+    for (i = 1; i <= unique; i++)
+    {
+        if (i == unique || batch[i].address != batch[i - 1].address + 1)
+        {
+            write_coils(t, &batch[start], i - start);
+            start = i;
+        }
+    }
+}
+
+// Merge the transitions routed to this connection in the journals handed over
+// by the replaced connections into its own journal, in the order they were
+// journaled, once the replaced connections have closed them
+static void take_handover(struct target *t)
+{
+    struct journal_handover *handover = g_atomic_pointer_get(&t->inherited);
+    const gint64 now = g_get_monotonic_time();
+    if (NULL == handover || NULL == t->journal || now < t->next_journal_open)
+    {
+        return;
+    }
+    if (0 < g_atomic_int_get(&handover->closing))
+    {
+        t->next_journal_open = now + JOURNAL_RETRY_DELAY;
+        return;
+    }
+
+    guint n = journal_pending(t->journal);
+    struct journal_record *records = g_new(struct journal_record, n);
+    n = journal_peek(t->journal, records, n);
+    const guint own = n;
+    for (guint i = 0; i < handover->n; i++)
+    {
+        // Not renamed if the replaced connection never opened its journal
+        if (!g_file_test(handover->paths[i], G_FILE_TEST_EXISTS))
+        {
+            continue;
+        }
+        struct journal *journal = journal_open(handover->paths[i], 0);
+        if (NULL == journal && EWOULDBLOCK == errno)
+        {
+            // Being read by another new connection
+            g_free(records);
+            t->next_journal_open = now + JOURNAL_RETRY_DELAY;
+            return;
+        }
+        if (NULL == journal)
+        {
+            continue;
+        }
+        const guint pending = journal_pending(journal);
+        records = g_renew(struct journal_record, records, n + pending);
+        const guint peeked = journal_peek(journal, records + n, pending);
+        journal_close(journal);
+        guint kept = n;
+        for (guint j = n; j < n + peeked; j++)
+        {
+            if (t->connection == records[j].address / CONNECTION_BLOCK % handover->connections)
+            {
+                records[kept++] = records[j];
+            }
+        }
+        n = kept;
+    }
+
+    // Stable, so that transitions journaled at the same time stay in order
+    g_qsort_with_data(records, n, sizeof(*records), compare_time, NULL);
+    journal_consume(t->journal, G_MAXUINT64);
+    for (guint i = 0; i < n; i++)
+    {
+        if (!journal_append(t->journal, records[i].address, records[i].active, records[i].time))
+        {
+            t->stats.journal_full += n - i;
+            break;
+        }
+    }
+    g_free(records);
+    g_atomic_pointer_set(&t->inherited, NULL);
+    release_handover(handover);
+    LOG_I("%s/%s: [%s] Took over %u journaled transitions", __FILE__, __FUNCTION__, t->name, n - own);
+
+    // With nothing to drain, the coil image is written right away
+    if (t->connected && 0 == journal_pending(t->journal) && !resync(t) && is_link_error(errno))
+    {
+        disconnect(t);
+    }
+}
+
+// Write the oldest journaled transitions, one request per run of increasing
+// adjacent addresses, and schedule the next step so that draining a long outage
+// does not flood the server; the coil image is written once the journal is empty.
+// Transitions older than journal_max_age are dropped, the coil image written
+// afterwards still brings the server up to date
+static void drain_journal(struct target *t)
+{
+    struct journal_record records[JOURNAL_DRAIN_BATCH];
+    const gint max_age = g_atomic_int_get(&journal_max_age);
+    const gint64 oldest = g_get_real_time() - (gint64)max_age * G_USEC_PER_SEC;
+
+    pipeline_drain(t);
+    if (!t->connected)
+    {
+        return;
+    }
+    const guint peeked = journal_peek(t->journal, records, JOURNAL_DRAIN_BATCH);
+    const guint64 consumed = 0 < peeked ? records[peeked - 1].seq + 1 : G_MAXUINT64;
+    guint n = 0;
+    for (guint i = 0; i < peeked; i++)
+    {
+        if (0 < max_age && oldest > records[i].time)
+        {
+            t->stats.expired++;
+            continue;
+        }
+        records[n++] = records[i];
+    }
+    guint start = 0;
+    for (guint i = 1; i <= n; i++)
+    {
+        if (i < n && records[i].address == records[i - 1].address + 1)
+        {
+            continue;
+        }
+        for (guint j = start; j < i; j++)
+        {
+            t->batch_bits[j - start] = records[j].active;
+        }
+        t->stats.requests++;
+        if ((int)(i - start) != write_bits(t, records[start].address, i - start, t->batch_bits))
+        {
+            const int error = errno;
+            LOG_E(
+                "%s/%s: [%s] Failed to write journaled coils (%s)",
+                __FILE__,
+                __FUNCTION__,
+                t->name,
+                modbus_strerror(error));
+            if (is_link_error(error))
+            {
+                // Along with the expired records before the run
+                journal_consume(t->journal, records[start].seq);
+                disconnect(t);
+                return;
+            }
+            // Rejected by the server, so retrying would not help
+            t->stats.failed += i - start;
+        }
+        else
+        {
+            for (guint j = start; j < i; j++)
+            {
+                set_shadow(t, records[j].address, records[j].active);
+            }
+            t->stats.drained += i - start;
+        }
+        journal_consume(t->journal, records[i - 1].seq + 1);
+        start = i;
+    }
+    // Along with the expired or corrupt records after the last run
+    journal_consume(t->journal, consumed);
+    t->next_drain = g_get_monotonic_time() + MAX(n, 1) * G_USEC_PER_SEC / JOURNAL_DRAIN_RATE;
+    if (0 == journal_pending(t->journal))
+    {
+        LOG_I("%s/%s: [%s] Journal drained (%u transitions)", __FILE__, __FUNCTION__, t->name, t->stats.drained);
+        if (!resync(t) && is_link_error(errno))
+        {
+            disconnect(t);
+        }
+    }
+}
+
+static void *run_modbus_sender(void *arg)
+{
+    assert(NULL != arg);
+    struct target *t = arg;
+    gint64 last_stats = g_get_monotonic_time();
+    guint last_handled = 0;
+
+    while (g_atomic_int_get(&t->run))
+    {
+        open_journal(t);
+        take_handover(t);
+        if (!t->connected)
+        {
+            try_connect(t);
+        }
+        const gint64 drain = drain_deadline(t);
+        if (t->connected && 0 < drain && g_get_monotonic_time() >= drain)
+        {
+            drain_journal(t);
+        }
+        // The server holds older states until the journal has been drained
+        const gint64 deadline = verify_deadline(t);
+        if (t->connected && 0 == drain_deadline(t) && 0 < deadline && g_get_monotonic_time() >= deadline)
+        {
+            verify_coils(t);
+        }
+        const gint64 beat = heartbeat_deadline(t);
+        if (t->connected && 0 < beat && g_get_monotonic_time() >= beat)
+        {
+            heartbeat(t);
+        }
+        // Queued writes go first, and at most one read is done before checking
+        // for writes again, so polling delays a write by one read at most
+        if (t->connected && NULL != t->poll && 0 == queue_depth(t) &&
+            g_get_monotonic_time() >= modbus_poll_deadline(t->poll))
+        {
+            poll_server(t);
+        }
+        wait_for_entry(t);
+
+        if (!dequeue(t, &t->batch[0]))
+        {
+            // Woken up for shutdown or a connection attempt
+            continue;
+        }
+
+        const gint window = g_atomic_int_get(&batch_window);
+        if (0 < window && t->connected && !journaling(t))
+        {
+            // Wait out the flush window and collect everything queued meanwhile
+            guint n = 1;
+            const gint64 remaining = t->batch[0].enqueued + window * 1000 - g_get_monotonic_time();
+            if (0 < remaining)
+            {
+                g_usleep(remaining);
+            }
+            while (SEND_QUEUE_SIZE > n && 0 == sem_trywait(&t->sem) && dequeue(t, &t->batch[n]))
+            {
+                n++;
+            }
+            flush_batch(t, n);
+        }
+        else
+        {
+            flush_batch(t, 1);
+        }
+
+        if (0 == queue_depth(t))
+        {
+            // Collect the outstanding responses before waiting for more events
+            pipeline_drain(t);
+        }
+
+        const gint64 now = g_get_monotonic_time();
+        const guint handled = t->stats.sent + t->stats.suppressed;
+        if (STATS_INTERVAL <= now - last_stats && last_handled != handled)
+        {
+            log_stats(t);
+            last_stats = now;
+            last_handled = handled;
+        }
+    }
+
+    pthread_exit(NULL);
+}
+
+static gboolean enqueue(struct target *t, const struct send_entry *queued)
+{
+    const guint head = g_atomic_int_get(&t->head);
+    if (SEND_QUEUE_SIZE <= head - (guint)g_atomic_int_get(&t->tail))
+    {
+        g_atomic_int_inc(&t->stats.dropped);
+        return FALSE;
+    }
+
+    struct send_entry *entry = &t->queue[head & (SEND_QUEUE_SIZE - 1)];
+    *entry = *queued;
+    entry->enqueued = g_get_monotonic_time();
+    g_atomic_int_set(&t->head, head + 1);
+    sem_post(&t->sem);
+    return TRUE;
+}
+
+void modbus_client_set_batch_window(const guint ms)
+{
+    g_atomic_int_set(&batch_window, ms);
+}
+
+void modbus_client_set_pipeline_depth(const guint depth)
+{
+    assert(1 <= depth && MODBUS_CLIENT_MAX_PIPELINE >= depth);
+    g_atomic_int_set(&pipeline_depth, depth);
+}
+
+void modbus_client_set_verify_interval(const guint seconds)
+{
+    g_atomic_int_set(&verify_interval, seconds);
+}
+
+void modbus_client_set_journal_size(const guint records)
+{
+    g_atomic_int_set(&journal_size, records);
+}
+
+void modbus_client_set_journal_max_age(const guint seconds)
+{
+    g_atomic_int_set(&journal_max_age, seconds);
+}
+
+void modbus_client_set_poll_callback(ModbusClientPollCallback callback)
+{
+    g_atomic_pointer_set(&poll_callback, callback);
+}
+
+void modbus_client_set_heartbeat(const enum modbus_client_heartbeat mode, const guint16 address, const guint interval)
+{
+    assert(0 < interval);
+    g_atomic_int_set(&heartbeat_interval, interval);
+    g_atomic_int_set(&heartbeat_address, address);
+    g_atomic_int_set(&heartbeat_mode, mode);
+}
+
+static gboolean enqueue_all(const struct send_entry *entry)
+{
+    gboolean queued = 0 < active.n;
+
+    for (guint i = 0; i < active.n; i += active.connections)
+    {
+        queued &= enqueue(active.targets[i + entry->address / CONNECTION_BLOCK % active.connections], entry);
+    }
+    return queued;
+}
+
+gboolean modbus_client_send_event(const guint16 address, const gboolean is_active, const gint64 received)
+{
+    const struct send_entry entry = {.address = address, .active = is_active, .received = received};
+    const gboolean queued = enqueue_all(&entry);
+    latency_record(LATENCY_EVENT_TO_QUEUE, g_get_monotonic_time() - received);
+    return queued;
+}
+
+gboolean modbus_client_send_register(const guint16 address, const guint16 value, const gint64 received)
+{
+    const struct send_entry entry = {
+        .address = address,
+        .holding_register = TRUE,
+        .value = value,
+        .received = received,
+    };
+    const gboolean queued = enqueue_all(&entry);
+    latency_record(LATENCY_EVENT_TO_QUEUE, g_get_monotonic_time() - received);
+    return queued;
+}
+
+// The path of the journal of a connection, named after it
+static gchar *journal_file(const gchar *name)
+{
+    gchar *file = g_strdelimit(g_strdup(name), "/:", '_');
+    gchar *path = g_strdup_printf(JOURNAL_PATH, file);
+    g_free(file);
+    return path;
+}
+
+static void free_target(struct target *t)
+{
+    if (t->run)
+    {
+        LOG_I("%s/%s: [%s] Joining sender thread ...", __FILE__, __FUNCTION__, t->name);
+        g_atomic_int_set(&t->run, FALSE);
+        sem_post(&t->sem);
+        pthread_join(t->thread_id, NULL);
+        log_stats(t);
+    }
+    if (NULL != t->handover)
+    {
+        // Renamed before the lock is released, so that a new connection of the
+        // same name creates a journal of its own
+        gchar *path = journal_file(t->name);
+        if (NULL != t->journal && -1 == rename(path, t->handover_path))
+        {
+            LOG_E("%s/%s: Failed to rename %s (%s)", __FILE__, __FUNCTION__, path, strerror(errno));
+        }
+        g_free(path);
+        journal_close(t->journal);
+        g_atomic_int_dec_and_test(&t->handover->closing);
+        release_handover(t->handover);
+    }
+    else if (t->discard_journal)
+    {
+        journal_remove(t->journal);
+    }
+    else
+    {
+        journal_close(t->journal);
+    }
+    // Not taken over if replaced before it could be
+    release_handover(g_atomic_pointer_get(&t->inherited));
+    g_free(t->journal_path);
+    modbus_poll_free(t->poll);
+    sem_destroy(&t->sem);
+    if (NULL != t->ctx)
+    {
+        modbus_free(t->ctx);
+    }
+    g_free(t->host);
+    g_free(t->name);
+    g_free(t);
+}
+
+static struct target *new_target(
+    const gchar *server,
+    const guint32 port,
+    const gboolean udp,
+    const gchar *poll,
+    const guint connection,
+    const guint connections)
+{
+    struct target *t = g_new0(struct target, 1);
+    t->name = 1 < connections ? g_strdup_printf("%s:%u%s#%u", server, port, udp ? "/udp" : "", connection + 1)
+                              : g_strdup_printf("%s:%u%s", server, port, udp ? "/udp" : "");
+    t->udp = udp;
+    t->host = g_strdup(server);
+    t->port = port;
+    t->connection = connection;
+    t->udp_fd = -1;
+    t->reconnect_delay = RECONNECT_MIN_DELAY;
+    t->journal_capacity = g_atomic_int_get(&journal_size);
+    if (0 < t->journal_capacity)
+    {
+        // Opened by the sender thread, once a replaced server has closed it
+        t->journal_path = journal_file(t->name);
+    }
+    t->poll = modbus_poll_new(poll);
+    sem_init(&t->sem, 0, 0);
+
+    if (udp)
+    {
+        t->configured_timeout = UDP_RESPONSE_TIMEOUT;
+    }
+    else
+    {
+        LOG_I("Trying to create Modbus TCP context for %s", t->name);
+        t->ctx = modbus_new_tcp(server, port);
+        if (NULL == t->ctx)
+        {
+            LOG_E("%s/%s: Unable to create the libmodbus context (%s)", __FILE__, __FUNCTION__, modbus_strerror(errno));
+            free_target(t);
+            return NULL;
+        }
+        uint32_t sec;
+        uint32_t usec;
+        modbus_get_response_timeout(t->ctx, &sec, &usec);
+        t->configured_timeout = sec * 1000 + usec / 1000;
+    }
+    t->response_timeout = t->configured_timeout;
+
+    // The sender thread connects, and reconnects whenever the link is lost
+    t->run = TRUE;
+    int result = pthread_create(&t->thread_id, NULL, run_modbus_sender, t);
+    if (0 != result)
+    {
+        LOG_E("%s/%s: Failed to create sender thread (%s)", __FILE__, __FUNCTION__, strerror(result));
+        t->run = FALSE;
+        free_target(t);
+        return NULL;
+    }
+    return t;
+}
+
+static void free_set(struct target_set *set)
+{
+    while (0 < set->n)
+    {
+        free_target(set->targets[--set->n]);
+    }
+}
+
+static void *run_retire(void *arg)
+{
+    struct target_set *set = arg;
+    free_set(set);
+    g_free(set);
+    g_atomic_int_dec_and_test(&retiring);
+    return NULL;
+}
+
+// Free a set from a background thread, since joining its sender threads may
+// have to wait for a connection attempt or a response to time out; with
+// discard_journals, the journals of its servers are deleted unless kept
+static void retire_set(struct target_set *set, const gboolean discard_journals)
+{
+    pthread_t thread_id;
+
+    if (0 == set->n)
+    {
+        return;
+    }
+    for (guint i = 0; i < set->n; i++)
+    {
+        set->targets[i]->discard_journal = discard_journals && !set->targets[i]->keep_journal;
+    }
+    struct target_set *retired = g_new(struct target_set, 1);
+    *retired = *set;
+    set->n = 0;
+    g_atomic_int_inc(&retiring);
+    int result = pthread_create(&thread_id, NULL, run_retire, retired);
+    if (0 != result)
+    {
+        LOG_E("%s/%s: Failed to create thread (%s), freeing in place", __FILE__, __FUNCTION__, strerror(result));
+        run_retire(retired);
+        return;
+    }
+    pthread_detach(thread_id);
+}
+
+gboolean modbus_client_prepare(
+    const gchar *servers,
+    const guint32 port,
+    const gboolean udp,
+    const gchar *poll,
+    const guint connections)
+{
+    assert(NULL != servers);
+    assert(1024 <= port && 65535 >= port);
+    assert(1 <= connections && MODBUS_CLIENT_MAX_CONNECTIONS >= connections);
+    retire_set(&pending, FALSE);
+    pending.connections = connections;
+
+    // Comma separated list of host or host:port, the port parameter is the default
+    gchar **list = g_strsplit(servers, ",", -1);
+    for (gchar **server = list; NULL != *server; server++)
+    {
+        gchar *host = g_strstrip(*server);
+        guint32 target_port = port;
+        gchar *colon = strrchr(host, ':');
+
+        if ('\0' == *host)
+        {
+            continue;
+        }
+        if (MODBUS_CLIENT_MAX_TARGETS * connections <= pending.n)
+        {
+            LOG_E("%s/%s: Too many servers, ignoring %s", __FILE__, __FUNCTION__, host);
+            continue;
+        }
+        if (NULL != colon && colon == strchr(host, ':'))
+        {
+            // Exactly one colon, i.e. not a bare IPv6 address
+            *colon = '\0';
+            target_port = atoi(colon + 1);
+        }
+        if (1024 > target_port || 65535 < target_port)
+        {
+            LOG_E("%s/%s: Invalid port for %s", __FILE__, __FUNCTION__, host);
+            continue;
+        }
+        // Only the first connection to the first server polls
+        const guint first = pending.n;
+        for (guint i = 0; i < connections; i++)
+        {
+            struct target *t = new_target(host, target_port, udp, 0 == pending.n ? poll : NULL, i, connections);
+            if (NULL == t)
+            {
+                // A server is served by all of its connections or not at all
+                while (first < pending.n)
+                {
+                    free_target(pending.targets[--pending.n]);
+                }
+                break;
+            }
+            pending.targets[pending.n++] = t;
+        }
+    }
+    g_strfreev(list);
+
+    return 0 < pending.n;
+}
+
+gboolean modbus_client_ready(void)
+{
+    for (guint i = 0; i < pending.n; i++)
+    {
+        if (!g_atomic_int_get(&pending.targets[i]->connected))
+        {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+// Keep the journals of the servers that stay configured: a new connection of
+// the same name, over as many connections per server, reopens its journal, and
+// otherwise the new connections to the server take the journals over
+static void hand_over_journals(void)
+{
+    static guint handovers = 0;
+
+    for (guint i = 0; i < active.n && active.connections == pending.connections; i++)
+    {
+        struct target *old = active.targets[i];
+        for (guint j = 0; j < pending.n; j++)
+        {
+            old->keep_journal |= 0 < old->journal_capacity && 0 < pending.targets[j]->journal_capacity &&
+                                 0 == g_strcmp0(old->name, pending.targets[j]->name);
+        }
+    }
+    for (guint i = 0; i < pending.n; i += pending.connections)
+    {
+        struct journal_handover *handover = NULL;
+        for (guint j = 0; j < active.n && 0 < pending.targets[i]->journal_capacity; j++)
+        {
+            struct target *old = active.targets[j];
+            if (0 == old->journal_capacity || old->keep_journal || NULL != old->handover ||
+                0 != g_strcmp0(old->host, pending.targets[i]->host))
+            {
+                continue;
+            }
+            if (NULL == handover)
+            {
+                handover = g_new0(struct journal_handover, 1);
+                handover->connections = pending.connections;
+                handover->refs = pending.connections;
+            }
+            old->handover = handover;
+            gchar *file = g_strdelimit(g_strdup(old->name), "/:", '_');
+            old->handover_path = g_strdup_printf(JOURNAL_HANDOVER_PATH, file, handovers++);
+            g_free(file);
+            handover->paths[handover->n++] = old->handover_path;
+            handover->closing++;
+            handover->refs++;
+        }
+        for (guint j = 0; NULL != handover && j < pending.connections; j++)
+        {
+            g_atomic_pointer_set(&pending.targets[i + j]->inherited, handover);
+        }
+    }
+}
+
+void modbus_client_commit(void)
+{
+    // The journals of the servers no longer configured are deleted, their
+    // transitions would otherwise be replayed whenever a server of the same
+    // name comes back
+    hand_over_journals();
+    retire_set(&active, TRUE);
+    active = pending;
+    pending.n = 0;
+}
+
+void modbus_client_abort(void)
+{
+    retire_set(&pending, FALSE);
+}
+
+void modbus_client_stop(void)
+{
+    retire_set(&pending, FALSE);
+    retire_set(&active, FALSE);
+}
+
+void modbus_client_cleanup()
+{
+    free_set(&pending);
+    free_set(&active);
+    while (0 < g_atomic_int_get(&retiring))
+    {
+        g_usleep(10 * 1000);
+    }
 }
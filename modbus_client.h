@@ -19,8 +19,61 @@
 
 #include <glib.h>
 
-gboolean modbus_client_send_event(const guint16 address, const gboolean active);
-gboolean modbus_client_init(const gchar *server, const guint32 port);
+#define MODBUS_CLIENT_MAX_TARGETS 8
+#define MODBUS_CLIENT_MAX_PIPELINE 16
+#define MODBUS_CLIENT_MAX_CONNECTIONS 8
+
+// Called from a sender thread with a polled coil (0 or 1) or holding register
+// value that is new or has changed
+typedef void (*ModbusClientPollCallback)(const gboolean holding_register, const guint16 address, const guint16 value);
+
+enum modbus_client_heartbeat
+{
+    MODBUS_CLIENT_HEARTBEAT_OFF,
+    MODBUS_CLIENT_HEARTBEAT_READ_REGISTER, // Read Holding Registers (FC03)
+    MODBUS_CLIENT_HEARTBEAT_TOGGLE_COIL,   // Write Single Coil (FC05), alternating on and off
+};
+
+// Queue an event for the sender thread of each active server, returns FALSE if any queue is full;
+// received is the monotonic time when the event was received, for latency statistics
+gboolean modbus_client_send_event(const guint16 address, const gboolean is_active, const gint64 received);
+// Queue a write of a holding register, like modbus_client_send_event()
+gboolean modbus_client_send_register(const guint16 address, const guint16 value, const gint64 received);
+void modbus_client_set_batch_window(const guint ms);
+// Keep up to depth write requests in flight per server, 1 waits for each response
+void modbus_client_set_pipeline_depth(const guint depth);
+// Read back acknowledged coils every given number of seconds and rewrite drifted ones, 0 disables
+void modbus_client_set_verify_interval(const guint seconds);
+// Journal up to the given number of coil transitions per server while it is
+// unreachable, 0 disables; applies to servers configured after the call
+void modbus_client_set_journal_size(const guint records);
+// Drop journaled transitions older than the given number of seconds instead of writing them, 0 keeps them
+void modbus_client_set_journal_max_age(const guint seconds);
+// Send a heartbeat request to address every interval milliseconds while connected
+void modbus_client_set_heartbeat(const enum modbus_client_heartbeat mode, const guint16 address, const guint interval);
+void modbus_client_set_poll_callback(ModbusClientPollCallback callback);
+
+// Reconfiguration is make-before-break: prepare() starts connecting to a
+// comma separated list of host or host:port, over Modbus/UDP if udp is set,
+// in the background, with the given number of connections to each, which
+// share the coils and registers by address, and polling the first of them
+// for the addresses in poll (see modbus_poll_new()); ready() tells when all
+// of them are connected, and commit() makes them the servers that events are
+// sent to; the replaced servers are closed in the background and their
+// journals deleted
+gboolean modbus_client_prepare(
+    const gchar *servers,
+    const guint32 port,
+    const gboolean udp,
+    const gchar *poll,
+    const guint connections);
+gboolean modbus_client_ready(void);
+void modbus_client_commit(void);
+// Close the prepared servers in the background without committing them
+void modbus_client_abort(void);
+// Close all servers in the background
+void modbus_client_stop(void);
+// Close all servers and wait until they are closed
 void modbus_client_cleanup(void);
 
 #endif /* _MODBUS_CLIENT_H_ */
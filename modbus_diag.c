@@ -0,0 +1,93 @@
+/**
+ * Copyright (C) 2023, Axis Communications AB, Lund, Sweden
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <assert.h>
+
+#include "modbus_diag.h"
+#include "modbusacap_common.h"
+
+struct modbus_diag modbus_diag_server = {.name = "server"};
+struct modbus_diag modbus_diag_client = {.name = "client"};
+
+void modbus_diag_count(struct modbus_diag *diag, const enum modbus_diag_counter counter)
+{
+    assert(MODBUS_DIAG_COUNTERS > counter);
+    g_atomic_int_inc(&diag->counters[counter]);
+}
+
+void modbus_diag_completed(struct modbus_diag *diag)
+{
+    g_atomic_int_inc(&diag->event_count);
+}
+
+void modbus_diag_event(struct modbus_diag *diag, const guint8 event)
+{
+    const guint head = g_atomic_int_get(&diag->event_head);
+    diag->events[head % MODBUS_DIAG_EVENT_LOG_SIZE] = event;
+    g_atomic_int_set(&diag->event_head, head + 1);
+}
+
+// The Modbus counters are 16 bits and wrap
+guint16 modbus_diag_get(struct modbus_diag *diag, const enum modbus_diag_counter counter)
+{
+    assert(MODBUS_DIAG_COUNTERS > counter);
+    return g_atomic_int_get(&diag->counters[counter]) & 0xffff;
+}
+
+guint modbus_diag_get_events(struct modbus_diag *diag, guint8 *events)
+{
+    const guint head = g_atomic_int_get(&diag->event_head);
+    const guint n = MIN(head, MODBUS_DIAG_EVENT_LOG_SIZE);
+
+    for (guint i = 0; i < n; i++)
+    {
+        events[i] = diag->events[(head - 1 - i) % MODBUS_DIAG_EVENT_LOG_SIZE];
+    }
+    return n;
+}
+
+void modbus_diag_clear(struct modbus_diag *diag)
+{
+    for (guint i = 0; i < MODBUS_DIAG_COUNTERS; i++)
+    {
+        g_atomic_int_set(&diag->counters[i], 0);
+    }
+    g_atomic_int_set(&diag->event_count, 0);
+    g_atomic_int_set(&diag->event_head, 0);
+    modbus_diag_event(diag, MODBUS_DIAG_EVENT_RESTART);
+}
+
+static void log_diag(struct modbus_diag *diag)
+{
+    LOG_I(
+        "%s/%s: Modbus %s: %d messages, %d communication errors, %d exceptions, %d handled, %d without response, "
+        "%d completed",
+        __FILE__,
+        __FUNCTION__,
+        diag->name,
+        g_atomic_int_get(&diag->counters[MODBUS_DIAG_BUS_MESSAGE]),
+        g_atomic_int_get(&diag->counters[MODBUS_DIAG_BUS_COMM_ERROR]),
+        g_atomic_int_get(&diag->counters[MODBUS_DIAG_BUS_EXCEPTION]),
+        g_atomic_int_get(&diag->counters[MODBUS_DIAG_SERVER_MESSAGE]),
+        g_atomic_int_get(&diag->counters[MODBUS_DIAG_SERVER_NO_RESPONSE]),
+        g_atomic_int_get(&diag->event_count));
+}
+
+void modbus_diag_log(void)
+{
+    log_diag(&modbus_diag_server);
+    log_diag(&modbus_diag_client);
+}
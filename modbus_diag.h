@@ -0,0 +1,71 @@
+/**
+ * Copyright (C) 2023, Axis Communications AB, Lund, Sweden
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MODBUS_DIAG_H_
+#define _MODBUS_DIAG_H_
+
+#include <glib.h>
+
+// Diagnostics (FC08) counters, in the order of their sub-functions 0x0B-0x12
+enum modbus_diag_counter
+{
+    MODBUS_DIAG_BUS_MESSAGE,        // Requests received, or responses received by the client
+    MODBUS_DIAG_BUS_COMM_ERROR,     // Malformed requests or responses, broken connections
+    MODBUS_DIAG_BUS_EXCEPTION,      // Exception responses sent, or received by the client
+    MODBUS_DIAG_SERVER_MESSAGE,     // Requests handled by the server
+    MODBUS_DIAG_SERVER_NO_RESPONSE, // Requests not answered, or timed out for the client
+    MODBUS_DIAG_SERVER_NAK,
+    MODBUS_DIAG_SERVER_BUSY,
+    MODBUS_DIAG_BUS_CHAR_OVERRUN,
+    MODBUS_DIAG_COUNTERS
+};
+
+#define MODBUS_DIAG_SUBFUNCTION_FIRST_COUNTER 0x0B
+
+// Communication event log (FC12) entries, see the Modbus specification
+#define MODBUS_DIAG_EVENT_RECEIVE 0x80
+#define MODBUS_DIAG_EVENT_SEND 0x40
+#define MODBUS_DIAG_EVENT_SEND_READ_EXCEPTION 0x01
+#define MODBUS_DIAG_EVENT_SEND_ABORT_EXCEPTION 0x02
+#define MODBUS_DIAG_EVENT_SEND_BUSY_EXCEPTION 0x04
+#define MODBUS_DIAG_EVENT_SEND_NAK_EXCEPTION 0x08
+#define MODBUS_DIAG_EVENT_RESTART 0x00
+#define MODBUS_DIAG_EVENT_LOG_SIZE 64
+
+// Counters are updated with atomic operations only, so the request paths never
+// take a lock; the event log has a single writer, the thread serving requests
+struct modbus_diag
+{
+    const gchar *name;
+    volatile gint counters[MODBUS_DIAG_COUNTERS];
+    volatile gint event_count; // Successfully completed requests (FC11)
+    volatile gint event_head;
+    guint8 events[MODBUS_DIAG_EVENT_LOG_SIZE];
+};
+
+extern struct modbus_diag modbus_diag_server;
+extern struct modbus_diag modbus_diag_client;
+
+void modbus_diag_count(struct modbus_diag *diag, const enum modbus_diag_counter counter);
+void modbus_diag_completed(struct modbus_diag *diag);
+void modbus_diag_event(struct modbus_diag *diag, const guint8 event);
+guint16 modbus_diag_get(struct modbus_diag *diag, const enum modbus_diag_counter counter);
+// Copy up to MODBUS_DIAG_EVENT_LOG_SIZE events to events, most recent first; returns the number copied
+guint modbus_diag_get_events(struct modbus_diag *diag, guint8 *events);
+void modbus_diag_clear(struct modbus_diag *diag);
+void modbus_diag_log(void);
+
+#endif /* _MODBUS_DIAG_H_ */
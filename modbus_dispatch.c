@@ -0,0 +1,357 @@
+/**
+ * Copyright (C) 2023, Axis Communications AB, Lund, Sweden
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <assert.h>
+
+#include "modbus_diag.h"
+#include "modbus_dispatch.h"
+
+// A handler gets the PDU (function code first) and its length, and rewrites
+// the PDU with the response, setting *length to the response length. It
+// returns 0 or the exception code to reply with, in which case the PDU is
+// left to the dispatcher.
+typedef guint8 (*RequestHandler)(guint8 *pdu, guint *length, modbus_mapping_t *mapping);
+
+struct request_type
+{
+    // Smallest valid PDU length, including the function code
+    guint min_length;
+    RequestHandler handle;
+};
+
+static guint16 get_u16(const guint8 *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+static void put_u16(guint8 *p, const guint16 value)
+{
+    p[0] = value >> 8;
+    p[1] = value & 0xff;
+}
+
+static gboolean in_range(const guint address, const guint n, const int start, const int nb)
+{
+    return (int)address >= start && (int)(address + n) <= start + nb;
+}
+
+static guint8 read_bits(guint8 *pdu, guint *length, const guint8 *tab, const int start, const int nb)
+{
+    const guint address = get_u16(&pdu[1]);
+    const guint n = get_u16(&pdu[3]);
+
+    if (1 > n || MODBUS_MAX_READ_BITS < n)
+    {
+        return MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+    }
+    if (!in_range(address, n, start, nb))
+    {
+        return MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+    }
+    const guint bytes = (n + 7) / 8;
+    tab += address - start;
+    pdu[1] = bytes;
+    memset(&pdu[2], 0, bytes);
+    for (guint i = 0; i < n; i++)
+    {
+        pdu[2 + i / 8] |= (tab[i] ? 1 : 0) << (i % 8);
+    }
+    *length = 2 + bytes;
+    return 0;
+}
+
+static guint8 read_registers(guint8 *pdu, guint *length, const guint16 *tab, const int start, const int nb)
+{
+    const guint address = get_u16(&pdu[1]);
+    const guint n = get_u16(&pdu[3]);
+
+    if (1 > n || MODBUS_MAX_READ_REGISTERS < n)
+    {
+        return MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+    }
+    if (!in_range(address, n, start, nb))
+    {
+        return MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+    }
+    tab += address - start;
+    pdu[1] = 2 * n;
+    for (guint i = 0; i < n; i++)
+    {
+        put_u16(&pdu[2 + 2 * i], tab[i]);
+    }
+    *length = 2 + 2 * n;
+    return 0;
+}
+
+static guint8 read_coils(guint8 *pdu, guint *length, modbus_mapping_t *mapping)
+{
+    return read_bits(pdu, length, mapping->tab_bits, mapping->start_bits, mapping->nb_bits);
+}
+
+static guint8 read_discrete_inputs(guint8 *pdu, guint *length, modbus_mapping_t *mapping)
+{
+    return read_bits(pdu, length, mapping->tab_input_bits, mapping->start_input_bits, mapping->nb_input_bits);
+}
+
+static guint8 read_holding_registers(guint8 *pdu, guint *length, modbus_mapping_t *mapping)
+{
+    return read_registers(pdu, length, mapping->tab_registers, mapping->start_registers, mapping->nb_registers);
+}
+
+static guint8 read_input_registers(guint8 *pdu, guint *length, modbus_mapping_t *mapping)
+{
+    return read_registers(
+        pdu,
+        length,
+        mapping->tab_input_registers,
+        mapping->start_input_registers,
+        mapping->nb_input_registers);
+}
+
+// The write requests below are answered with an echo of the request
+// header, i.e. the first five bytes of the PDU are left as they are
+
+static guint8 write_single_coil(guint8 *pdu, guint *length, modbus_mapping_t *mapping)
+{
+    const guint address = get_u16(&pdu[1]);
+    const guint16 value = get_u16(&pdu[3]);
+
+    if (0xff00 != value && 0x0000 != value)
+    {
+        return MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+    }
+    if (!in_range(address, 1, mapping->start_bits, mapping->nb_bits))
+    {
+        return MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+    }
+    mapping->tab_bits[address - mapping->start_bits] = 0xff00 == value;
+    *length = 5;
+    return 0;
+}
+
+static guint8 write_single_register(guint8 *pdu, guint *length, modbus_mapping_t *mapping)
+{
+    const guint address = get_u16(&pdu[1]);
+
+    if (!in_range(address, 1, mapping->start_registers, mapping->nb_registers))
+    {
+        return MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+    }
+    mapping->tab_registers[address - mapping->start_registers] = get_u16(&pdu[3]);
+    *length = 5;
+    return 0;
+}
+
+static guint8 write_multiple_coils(guint8 *pdu, guint *length, modbus_mapping_t *mapping)
+{
+    const guint address = get_u16(&pdu[1]);
+    const guint n = get_u16(&pdu[3]);
+    const guint bytes = pdu[5];
+
+    if (1 > n || MODBUS_MAX_WRITE_BITS < n || (n + 7) / 8 != bytes || 6 + bytes > *length)
+    {
+        return MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+    }
+    if (!in_range(address, n, mapping->start_bits, mapping->nb_bits))
+    {
+        return MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+    }
+    guint8 *tab = &mapping->tab_bits[address - mapping->start_bits];
+    for (guint i = 0; i < n; i++)
+    {
+        tab[i] = (pdu[6 + i / 8] >> (i % 8)) & 1;
+    }
+    *length = 5;
+    return 0;
+}
+
+static guint8 write_multiple_registers(guint8 *pdu, guint *length, modbus_mapping_t *mapping)
+{
+    const guint address = get_u16(&pdu[1]);
+    const guint n = get_u16(&pdu[3]);
+    const guint bytes = pdu[5];
+
+    if (1 > n || MODBUS_MAX_WRITE_REGISTERS < n || 2 * n != bytes || 6 + bytes > *length)
+    {
+        return MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+    }
+    if (!in_range(address, n, mapping->start_registers, mapping->nb_registers))
+    {
+        return MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+    }
+    guint16 *tab = &mapping->tab_registers[address - mapping->start_registers];
+    for (guint i = 0; i < n; i++)
+    {
+        tab[i] = get_u16(&pdu[6 + 2 * i]);
+    }
+    *length = 5;
+    return 0;
+}
+
+// The write is done before the read, as required by the specification
+static guint8 write_and_read_registers(guint8 *pdu, guint *length, modbus_mapping_t *mapping)
+{
+    const guint read_address = get_u16(&pdu[1]);
+    const guint read_n = get_u16(&pdu[3]);
+    const guint write_address = get_u16(&pdu[5]);
+    const guint write_n = get_u16(&pdu[7]);
+    const guint bytes = pdu[9];
+
+    if (1 > read_n || MODBUS_MAX_WR_READ_REGISTERS < read_n || 1 > write_n ||
+        MODBUS_MAX_WR_WRITE_REGISTERS < write_n || 2 * write_n != bytes || 10 + bytes > *length)
+    {
+        return MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+    }
+    if (!in_range(read_address, read_n, mapping->start_registers, mapping->nb_registers) ||
+        !in_range(write_address, write_n, mapping->start_registers, mapping->nb_registers))
+    {
+        return MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+    }
+    guint16 *tab = &mapping->tab_registers[write_address - mapping->start_registers];
+    for (guint i = 0; i < write_n; i++)
+    {
+        tab[i] = get_u16(&pdu[10 + 2 * i]);
+    }
+    // The read address and quantity are where a read request has them
+    return read_holding_registers(pdu, length, mapping);
+}
+
+// Diagnostics sub-functions
+#define DIAG_RETURN_QUERY_DATA 0x00
+#define DIAG_RESTART_COMMUNICATIONS 0x01
+#define DIAG_RETURN_DIAGNOSTIC_REGISTER 0x02
+#define DIAG_CLEAR_COUNTERS 0x0A
+#define DIAG_CLEAR_OVERRUN_COUNTER 0x14
+
+static guint8 diagnostics(guint8 *pdu, guint *length, modbus_mapping_t *mapping)
+{
+    (void)mapping;
+    const guint16 subfunction = get_u16(&pdu[1]);
+
+    switch (subfunction)
+    {
+    case DIAG_RETURN_QUERY_DATA:
+        // Echo the request as it is
+        return 0;
+    case DIAG_RESTART_COMMUNICATIONS:
+    case DIAG_CLEAR_COUNTERS:
+        modbus_diag_clear(&modbus_diag_server);
+        break;
+    case DIAG_RETURN_DIAGNOSTIC_REGISTER:
+        put_u16(&pdu[3], 0);
+        break;
+    case DIAG_CLEAR_OVERRUN_COUNTER:
+        // Characters are never overrun on TCP
+        break;
+    default:
+        if (MODBUS_DIAG_SUBFUNCTION_FIRST_COUNTER > subfunction ||
+            MODBUS_DIAG_SUBFUNCTION_FIRST_COUNTER + MODBUS_DIAG_COUNTERS <= subfunction)
+        {
+            return MODBUS_EXCEPTION_ILLEGAL_FUNCTION;
+        }
+        put_u16(&pdu[3], modbus_diag_get(&modbus_diag_server, subfunction - MODBUS_DIAG_SUBFUNCTION_FIRST_COUNTER));
+        break;
+    }
+    *length = 5;
+    return 0;
+}
+
+static guint8 get_comm_event_counter(guint8 *pdu, guint *length, modbus_mapping_t *mapping)
+{
+    (void)mapping;
+    // Status 0, no previous command is still being processed
+    put_u16(&pdu[1], 0);
+    put_u16(&pdu[3], g_atomic_int_get(&modbus_diag_server.event_count));
+    *length = 5;
+    return 0;
+}
+
+static guint8 get_comm_event_log(guint8 *pdu, guint *length, modbus_mapping_t *mapping)
+{
+    (void)mapping;
+    const guint n = modbus_diag_get_events(&modbus_diag_server, &pdu[8]);
+    pdu[1] = 6 + n;
+    put_u16(&pdu[2], 0);
+    put_u16(&pdu[4], g_atomic_int_get(&modbus_diag_server.event_count));
+    put_u16(&pdu[6], modbus_diag_get(&modbus_diag_server, MODBUS_DIAG_BUS_MESSAGE));
+    *length = 8 + n;
+    return 0;
+}
+
+static const struct request_type request_types[256] = {
+    [MODBUS_FC_READ_COILS] = {5, read_coils},
+    [MODBUS_FC_READ_DISCRETE_INPUTS] = {5, read_discrete_inputs},
+    [MODBUS_FC_READ_HOLDING_REGISTERS] = {5, read_holding_registers},
+    [MODBUS_FC_READ_INPUT_REGISTERS] = {5, read_input_registers},
+    [MODBUS_FC_WRITE_SINGLE_COIL] = {5, write_single_coil},
+    [MODBUS_FC_WRITE_SINGLE_REGISTER] = {5, write_single_register},
+    [MODBUS_FC_DIAGNOSTICS] = {5, diagnostics},
+    [MODBUS_FC_GET_COMM_EVENT_COUNTER] = {1, get_comm_event_counter},
+    [MODBUS_FC_GET_COMM_EVENT_LOG] = {1, get_comm_event_log},
+    [MODBUS_FC_WRITE_MULTIPLE_COILS] = {7, write_multiple_coils},
+    [MODBUS_FC_WRITE_MULTIPLE_REGISTERS] = {8, write_multiple_registers},
+    [MODBUS_FC_WRITE_AND_READ_REGISTERS] = {12, write_and_read_registers},
+};
+
+int modbus_dispatch_request(guint8 *adu, const int length, modbus_mapping_t *mapping)
+{
+    assert(NULL != adu);
+    if (MBAP_HEADER_LENGTH + 1 > length || MODBUS_TCP_MAX_ADU_LENGTH < length)
+    {
+        modbus_diag_count(&modbus_diag_server, MODBUS_DIAG_BUS_COMM_ERROR);
+        return 0;
+    }
+    modbus_diag_count(&modbus_diag_server, MODBUS_DIAG_BUS_MESSAGE);
+    modbus_diag_count(&modbus_diag_server, MODBUS_DIAG_SERVER_MESSAGE);
+    modbus_diag_event(&modbus_diag_server, MODBUS_DIAG_EVENT_RECEIVE);
+
+    guint8 *pdu = &adu[MBAP_HEADER_LENGTH];
+    guint pdu_length = length - MBAP_HEADER_LENGTH;
+    const struct request_type *type = &request_types[pdu[0]];
+    const guint8 function = pdu[0];
+    guint8 exception = MODBUS_EXCEPTION_ILLEGAL_FUNCTION;
+
+    if (NULL == mapping)
+    {
+        exception = MODBUS_EXCEPTION_GATEWAY_TARGET;
+    }
+    else if (NULL != type->handle)
+    {
+        exception = type->min_length > pdu_length ? MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE
+                                                  : type->handle(pdu, &pdu_length, mapping);
+    }
+    if (0 != exception)
+    {
+        pdu[0] |= 0x80;
+        pdu[1] = exception;
+        pdu_length = 2;
+        modbus_diag_count(&modbus_diag_server, MODBUS_DIAG_BUS_EXCEPTION);
+        modbus_diag_event(&modbus_diag_server, MODBUS_DIAG_EVENT_SEND | MODBUS_DIAG_EVENT_SEND_READ_EXCEPTION);
+    }
+    else
+    {
+        // Fetching the event counter or log is not counted as an event
+        if (MODBUS_FC_GET_COMM_EVENT_COUNTER != function && MODBUS_FC_GET_COMM_EVENT_LOG != function)
+        {
+            modbus_diag_completed(&modbus_diag_server);
+        }
+        modbus_diag_event(&modbus_diag_server, MODBUS_DIAG_EVENT_SEND);
+    }
+
+    // The MBAP length covers the unit identifier and the PDU
+    put_u16(&adu[MBAP_LENGTH], pdu_length + 1);
+    return MBAP_HEADER_LENGTH + pdu_length;
+}
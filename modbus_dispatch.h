@@ -0,0 +1,47 @@
+/**
+ * Copyright (C) 2023, Axis Communications AB, Lund, Sweden
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MODBUS_DISPATCH_H_
+#define _MODBUS_DISPATCH_H_
+
+#include <glib.h>
+#include <modbus.h>
+
+// Offsets in a Modbus/TCP ADU: MBAP header followed by the PDU
+#define MBAP_LENGTH 4
+#define MBAP_UNIT_ID 6
+#define MBAP_HEADER_LENGTH 7
+
+// Function codes for serial line diagnostics, not defined by libmodbus
+#ifndef MODBUS_FC_DIAGNOSTICS
+#define MODBUS_FC_DIAGNOSTICS 0x08
+#endif
+#ifndef MODBUS_FC_GET_COMM_EVENT_COUNTER
+#define MODBUS_FC_GET_COMM_EVENT_COUNTER 0x0B
+#endif
+#ifndef MODBUS_FC_GET_COMM_EVENT_LOG
+#define MODBUS_FC_GET_COMM_EVENT_LOG 0x0C
+#endif
+
+// Handle the request in adu (length bytes, at least the MBAP header and the
+// function code) against mapping and overwrite it in place with the response
+// or an exception response; adu must hold MODBUS_TCP_MAX_ADU_LENGTH bytes.
+// A NULL mapping is a unit that is not served, which is answered with a
+// gateway exception. Returns the response length, or 0 if the request is not
+// even a header.
+int modbus_dispatch_request(guint8 *adu, const int length, modbus_mapping_t *mapping);
+
+#endif /* _MODBUS_DISPATCH_H_ */
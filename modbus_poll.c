@@ -0,0 +1,337 @@
+/**
+ * Copyright (C) 2023, Axis Communications AB, Lund, Sweden
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <modbus.h>
+
+#include "modbus_poll.h"
+#include "modbusacap_common.h"
+
+struct poll_range
+{
+    gboolean holding_register;
+    guint16 address;
+    guint n;
+    gint64 interval;
+    gint64 next;
+    gboolean known; // Values read at least once
+    guint16 *values;
+};
+
+struct modbus_poll
+{
+    struct poll_range ranges[MODBUS_POLL_MAX_RANGES];
+    guint nranges;
+    // Configured addresses, only these are reported
+    guint8 coils[(G_MAXUINT16 + 1) / 8];
+    guint8 registers[(G_MAXUINT16 + 1) / 8];
+};
+
+// Read intervals in microseconds
+static volatile gint min_interval = 100 * 1000;
+static volatile gint max_interval = 2000 * 1000;
+
+static gboolean get_bit(const guint8 *bits, const guint address)
+{
+    return 0 != (bits[address >> 3] & (1 << (address & 7)));
+}
+
+// Parse one "c<first>[-<last>]" or "h<first>[-<last>]" entry
+static gboolean parse_entry(struct modbus_poll *poll, const gchar *entry)
+{
+    guint8 *wanted;
+    gchar *end = NULL;
+
+    switch (entry[0])
+    {
+    case 'c':
+        wanted = poll->coils;
+        break;
+    case 'h':
+        wanted = poll->registers;
+        break;
+    default:
+        return FALSE;
+    }
+    const guint64 first = g_ascii_strtoull(entry + 1, &end, 10);
+    guint64 last = first;
+    if (end == entry + 1)
+    {
+        return FALSE;
+    }
+    if ('-' == *end)
+    {
+        const gchar *to = end + 1;
+        last = g_ascii_strtoull(to, &end, 10);
+        if (end == to)
+        {
+            return FALSE;
+        }
+    }
+    if ('\0' != *end || first > last || G_MAXUINT16 < last)
+    {
+        return FALSE;
+    }
+    for (guint64 address = first; address <= last; address++)
+    {
+        wanted[address >> 3] |= 1 << (address & 7);
+    }
+    return TRUE;
+}
+
+// Cover the configured addresses of one table with ranges, bridging gaps of
+// up to max_gap addresses and splitting at max_n addresses per request
+static gboolean add_ranges(
+    struct modbus_poll *poll,
+    const gboolean holding_register,
+    const guint8 *wanted,
+    const guint max_gap,
+    const guint max_n)
+{
+    guint address = 0;
+
+    while (G_MAXUINT16 >= address)
+    {
+        if (!get_bit(wanted, address))
+        {
+            address++;
+            continue;
+        }
+        if (MODBUS_POLL_MAX_RANGES <= poll->nranges)
+        {
+            LOG_E("%s/%s: More than %d reads needed", __FILE__, __FUNCTION__, MODBUS_POLL_MAX_RANGES);
+            return FALSE;
+        }
+        struct poll_range *range = &poll->ranges[poll->nranges++];
+        range->holding_register = holding_register;
+        range->address = address;
+        guint last = address;
+        for (guint next = address + 1; G_MAXUINT16 >= next && next - address < max_n && next - last <= max_gap + 1;
+             next++)
+        {
+            if (get_bit(wanted, next))
+            {
+                last = next;
+            }
+        }
+        range->n = last - address + 1;
+        range->values = g_new0(guint16, range->n);
+        address = last + 1;
+    }
+    return TRUE;
+}
+
+struct modbus_poll *modbus_poll_new(const gchar *spec)
+{
+    gboolean valid = TRUE;
+
+    gchar *list = g_strstrip(g_strdup(NULL == spec ? "" : spec));
+    if ('\0' == *list)
+    {
+        g_free(list);
+        return NULL;
+    }
+    struct modbus_poll *poll = g_new0(struct modbus_poll, 1);
+    gchar **entries = g_strsplit(list, ",", -1);
+    g_free(list);
+    for (gchar **entry = entries; NULL != *entry; entry++)
+    {
+        if (!parse_entry(poll, g_strstrip(*entry)))
+        {
+            LOG_E("%s/%s: Invalid poll entry '%s'", __FILE__, __FUNCTION__, *entry);
+            valid = FALSE;
+        }
+    }
+    g_strfreev(entries);
+
+    if (!valid ||
+        !add_ranges(poll, FALSE, poll->coils, MODBUS_POLL_MAX_GAP_BITS, MODBUS_MAX_READ_BITS) ||
+        !add_ranges(poll, TRUE, poll->registers, MODBUS_POLL_MAX_GAP_REGISTERS, MODBUS_MAX_READ_REGISTERS))
+    {
+        modbus_poll_free(poll);
+        return NULL;
+    }
+    for (guint i = 0; i < poll->nranges; i++)
+    {
+        LOG_I(
+            "%s/%s: Polling %u %s from %u",
+            __FILE__,
+            __FUNCTION__,
+            poll->ranges[i].n,
+            poll->ranges[i].holding_register ? "holding registers" : "coils",
+            poll->ranges[i].address);
+    }
+    modbus_poll_reset(poll);
+    return poll;
+}
+
+void modbus_poll_free(struct modbus_poll *poll)
+{
+    if (NULL == poll)
+    {
+        return;
+    }
+    for (guint i = 0; i < poll->nranges; i++)
+    {
+        g_free(poll->ranges[i].values);
+    }
+    g_free(poll);
+}
+
+void modbus_poll_set_intervals(const guint min_ms, const guint max_ms)
+{
+    assert(0 < min_ms);
+    g_atomic_int_set(&min_interval, min_ms * 1000);
+    g_atomic_int_set(&max_interval, MAX(min_ms, max_ms) * 1000);
+}
+
+gint64 modbus_poll_deadline(const struct modbus_poll *poll)
+{
+    gint64 deadline = G_MAXINT64;
+
+    for (guint i = 0; i < poll->nranges; i++)
+    {
+        deadline = MIN(deadline, poll->ranges[i].next);
+    }
+    return deadline;
+}
+
+void modbus_poll_reset(struct modbus_poll *poll)
+{
+    const gint64 now = g_get_monotonic_time();
+
+    for (guint i = 0; i < poll->nranges; i++)
+    {
+        poll->ranges[i].interval = g_atomic_int_get(&min_interval);
+        poll->ranges[i].next = now;
+    }
+}
+
+// Replace a range that bridges unconfigured addresses with one range per run
+// of configured addresses in it, for servers that reject reads of addresses
+// they do not map; returns FALSE if there is nothing to split or no room
+static gboolean split_range(struct modbus_poll *poll, const guint index)
+{
+    struct poll_range pieces[MODBUS_POLL_MAX_RANGES];
+    struct poll_range *range = &poll->ranges[index];
+    const guint8 *wanted = range->holding_register ? poll->registers : poll->coils;
+    const guint end = range->address + range->n;
+    guint npieces = 0;
+
+    for (guint address = range->address; address < end; address++)
+    {
+        if (!get_bit(wanted, address))
+        {
+            continue;
+        }
+        if (MODBUS_POLL_MAX_RANGES <= npieces)
+        {
+            return FALSE;
+        }
+        struct poll_range *piece = &pieces[npieces++];
+        memset(piece, 0, sizeof(*piece));
+        piece->holding_register = range->holding_register;
+        piece->address = address;
+        while (address + 1 < end && get_bit(wanted, address + 1))
+        {
+            address++;
+        }
+        piece->n = address - piece->address + 1;
+    }
+    if (2 > npieces || MODBUS_POLL_MAX_RANGES < poll->nranges - 1 + npieces)
+    {
+        return FALSE;
+    }
+
+    LOG_I(
+        "%s/%s: Reading %u %s from %u in %u parts",
+        __FILE__,
+        __FUNCTION__,
+        range->n,
+        range->holding_register ? "holding registers" : "coils",
+        range->address,
+        npieces);
+    g_free(range->values);
+    memmove(range + npieces, range + 1, (poll->nranges - index - 1) * sizeof(*range));
+    for (guint i = 0; i < npieces; i++)
+    {
+        pieces[i].values = g_new0(guint16, pieces[i].n);
+        pieces[i].interval = g_atomic_int_get(&min_interval);
+        pieces[i].next = g_get_monotonic_time();
+        poll->ranges[index + i] = pieces[i];
+    }
+    poll->nranges += npieces - 1;
+    return TRUE;
+}
+
+gboolean modbus_poll_run(struct modbus_poll *poll, ModbusPollRead read, void *data, ModbusPollChanged changed)
+{
+    guint16 values[MAX(MODBUS_MAX_READ_BITS, MODBUS_MAX_READ_REGISTERS)];
+    const gint64 now = g_get_monotonic_time();
+    struct poll_range *range = NULL;
+    guint index = 0;
+
+    for (guint i = 0; i < poll->nranges; i++)
+    {
+        if (now >= poll->ranges[i].next && (NULL == range || poll->ranges[i].next < range->next))
+        {
+            range = &poll->ranges[i];
+            index = i;
+        }
+    }
+    if (NULL == range)
+    {
+        return TRUE;
+    }
+    if ((int)range->n != read(data, range->holding_register, range->address, range->n, values))
+    {
+        const int error = errno;
+        if (EMBXILADD == error && split_range(poll, index))
+        {
+            return TRUE;
+        }
+        // Retried at the minimum interval, or at the maximum one if the server
+        // answered with an exception, since it is likely to do so again
+        range->interval = g_atomic_int_get(EMBXILFUN <= error && EMBXGTAR >= error ? &max_interval : &min_interval);
+        range->next = g_get_monotonic_time() + range->interval;
+        errno = error;
+        return FALSE;
+    }
+
+    const guint8 *wanted = range->holding_register ? poll->registers : poll->coils;
+    gboolean changes = FALSE;
+    for (guint j = 0; j < range->n; j++)
+    {
+        if (range->known && values[j] == range->values[j])
+        {
+            continue;
+        }
+        range->values[j] = values[j];
+        if (get_bit(wanted, range->address + j))
+        {
+            changes = TRUE;
+            changed(data, range->holding_register, range->address + j, values[j]);
+        }
+    }
+    range->known = TRUE;
+
+    // Poll fast while the values change, and back off by half the interval otherwise
+    range->interval = changes ? g_atomic_int_get(&min_interval)
+                              : MIN(range->interval + range->interval / 2, g_atomic_int_get(&max_interval));
+    range->next = g_get_monotonic_time() + range->interval;
+    return TRUE;
+}
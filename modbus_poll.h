@@ -0,0 +1,66 @@
+/**
+ * Copyright (C) 2023, Axis Communications AB, Lund, Sweden
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MODBUS_POLL_H_
+#define _MODBUS_POLL_H_
+
+#include <glib.h>
+
+// Most range reads per poller, and the largest gaps of unconfigured addresses
+// that are read along with their neighbours rather than in a request of their own
+#define MODBUS_POLL_MAX_RANGES 32
+#define MODBUS_POLL_MAX_GAP_BITS 64
+#define MODBUS_POLL_MAX_GAP_REGISTERS 8
+
+// Read n coils (as 0 or 1) or holding registers from address into values;
+// returns n, or -1 with errno set like libmodbus
+typedef int (*ModbusPollRead)(
+    void *data,
+    const gboolean holding_register,
+    const guint16 address,
+    const guint n,
+    guint16 *values);
+typedef void (*ModbusPollChanged)(
+    void *data,
+    const gboolean holding_register,
+    const guint16 address,
+    const guint16 value);
+
+// Coils and holding registers read periodically, merged into as few
+// contiguous Read Coils (FC01) and Read Holding Registers (FC03) requests as
+// possible. A merged read that the server rejects with an illegal data
+// address exception is split into the configured runs of addresses it spans.
+// Each read is repeated at the minimum interval while its values change, and
+// backs off towards the maximum interval while they do not.
+// A poller is not thread safe and is used by one thread only.
+struct modbus_poll;
+
+// Parse a comma separated list of c<address>[-<address>] (coils) and
+// h<address>[-<address>] (holding registers), e.g. "c0-15,h100"; returns
+// NULL if the list is empty or invalid
+struct modbus_poll *modbus_poll_new(const gchar *spec);
+void modbus_poll_free(struct modbus_poll *poll);
+void modbus_poll_set_intervals(const guint min_ms, const guint max_ms);
+// Monotonic time when the next read is due
+gint64 modbus_poll_deadline(const struct modbus_poll *poll);
+// Make every read due now, e.g. after reconnecting
+void modbus_poll_reset(struct modbus_poll *poll);
+// Do the most overdue read, if any is due, and report the configured addresses
+// whose value is new or has changed; returns FALSE with errno set if the read
+// failed. One read per call lets the caller send writes in between reads.
+gboolean modbus_poll_run(struct modbus_poll *poll, ModbusPollRead read, void *data, ModbusPollChanged changed);
+
+#endif /* _MODBUS_POLL_H_ */
@@ -17,154 +17,616 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <glib-unix.h>
 #include <modbus.h>
+#include <netinet/in.h>
 #include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
 #include <unistd.h>
 
+#include "latency.h"
+#include "modbus_diag.h"
+#include "modbus_dispatch.h"
 #include "modbus_server.h"
 #include "modbusacap_common.h"
+#include "register_map.h"
+
+#define MAX_CLIENTS 64
+// Number of recent UDP write responses kept for answering retransmitted
+// requests, and for how long in microseconds: long enough for the client in
+// this application to retransmit three times at its initial timeout
+// (100 + 200 + 400 ms), short enough that a client reusing a transaction
+// identifier later is not answered from the cache
+#define UDP_RESPONSE_CACHE 16
+#define UDP_RESPONSE_EXPIRY G_USEC_PER_SEC
+
+// Client sockets are non-blocking; the bytes of a request received so far are
+// kept until the request is complete, so a client that sends a request in
+// pieces never holds up the others
+struct client
+{
+    int fd;
+    guint source; // GSource id in main loop mode, 0 otherwise
+    guint len;
+    guint8 buf[MODBUS_TCP_MAX_ADU_LENGTH];
+};
 
 static gboolean run_server = FALSE;
 static pthread_t modbus_server_thread_id = -1;
 static guint32 modbus_port = 0;
 static modbus_t *srv_ctx = NULL;
+static struct register_units *units = NULL;
+static int listen_fd = -1;
+static guint listen_source = 0;
+static int wake_fd = -1;
+static struct client clients[MAX_CLIENTS];
+static guint nclients = 0;
+static gboolean modbus_udp = FALSE;
+static int udp_fd = -1;
+static guint udp_source = 0;
 
-static void *run_modbus_server(void *run)
+// A UDP write request and the response sent for it; a client that does not
+// get the response retransmits the identical request, which is answered from
+// here instead of being executed again. Reads are always executed, since they
+// can be repeated safely and a cached response would be stale.
+struct udp_response
 {
-    assert(NULL != run);
-    modbus_mapping_t *mb_mapping = NULL;
-    int s;
-    int flags;
+    gint64 time; // Monotonic time the response was sent
+    struct sockaddr_storage peer;
+    socklen_t peer_len;
+    int request_len;
+    guint8 request[MODBUS_TCP_MAX_ADU_LENGTH];
+    int response_len;
+    guint8 response[MODBUS_TCP_MAX_ADU_LENGTH];
+};
+
+static struct udp_response udp_responses[UDP_RESPONSE_CACHE];
+static guint udp_response_next = 0;
+
+// Answer a request in place with the published register image of the unit it
+// is addressed to; returns the response length or 0
+static int answer_request(guint8 *adu, const int length)
+{
+    // Bring the mapping up to date with the published register image
+    const guint8 unit = adu[MBAP_UNIT_ID];
+    const int slen = modbus_dispatch_request(adu, length, register_map_sync(units, unit));
+
+    // An exception response has the high bit set in the function code
+    const guint8 replied = adu[MBAP_HEADER_LENGTH];
+    if (0 < slen && (MODBUS_FC_WRITE_SINGLE_REGISTER == replied || MODBUS_FC_WRITE_MULTIPLE_REGISTERS == replied ||
+                     MODBUS_FC_WRITE_AND_READ_REGISTERS == replied))
+    {
+        register_map_handle_control(units, unit);
+    }
+    return slen;
+}
+
+// Answer one complete request; returns FALSE if the connection should be closed
+static gboolean handle_request(const int fd, const guint8 *request, const int rlen)
+{
+    guint8 req[MODBUS_TCP_MAX_ADU_LENGTH];
+
+    const gint64 received = g_get_monotonic_time();
+    memcpy(req, request, rlen);
+    const guint8 function = req[MBAP_HEADER_LENGTH];
+    if (MBAP_HEADER_LENGTH + 3 <= rlen)
+    {
+        LOG_D(
+            "%s/%s: Received function 0x%02x request on address %d",
+            __FILE__,
+            __FUNCTION__,
+            function,
+            (req[MBAP_HEADER_LENGTH + 1] << 8) | req[MBAP_HEADER_LENGTH + 2]);
+    }
+    if (MODBUS_FC_WRITE_SINGLE_COIL == function && MBAP_HEADER_LENGTH + 5 <= rlen)
+    {
+        LOG_D(
+            "%s/%s: The event trigger on the remote device is now %s",
+            __FILE__,
+            __FUNCTION__,
+            0xFF == req[MBAP_HEADER_LENGTH + 3] ? "ACTIVE" : "INACTIVE");
+    }
+
+    // Answer in place in a copy of the request, since a response can be longer
+    // than its request and the receive buffer may hold the next request
+    const int slen = answer_request(req, rlen);
+    if (0 == slen)
+    {
+        LOG_I("%s/%s: Closing connection on socket %d (%d byte request)", __FILE__, __FUNCTION__, fd, rlen);
+        modbus_diag_count(&modbus_diag_server, MODBUS_DIAG_SERVER_NO_RESPONSE);
+        return FALSE;
+    }
+    // A client that does not read its responses fills its socket buffer, and
+    // is disconnected rather than waited for
+    if (slen != send(fd, req, slen, MSG_NOSIGNAL | MSG_DONTWAIT))
+    {
+        LOG_E("%s/%s: Failed to send reply on socket %d (%s)", __FILE__, __FUNCTION__, fd, strerror(errno));
+        modbus_diag_count(&modbus_diag_server, MODBUS_DIAG_SERVER_NO_RESPONSE);
+        return FALSE;
+    }
+    latency_record(LATENCY_SERVER_REQUEST, g_get_monotonic_time() - received);
+    return TRUE;
+}
+
+// Read what a readable client socket holds without blocking, and answer every
+// complete request in it, as delimited by the MBAP length field; returns FALSE
+// if the connection should be closed
+static gboolean handle_client(struct client *client)
+{
+    const ssize_t rc = recv(client->fd, client->buf + client->len, sizeof(client->buf) - client->len, 0);
+    if (0 == rc)
+    {
+        LOG_I("%s/%s: Connection on socket %d closed by the client", __FILE__, __FUNCTION__, client->fd);
+        return FALSE;
+    }
+    if (-1 == rc)
+    {
+        if (EAGAIN == errno || EWOULDBLOCK == errno || EINTR == errno)
+        {
+            return TRUE;
+        }
+        LOG_I("%s/%s: Closing connection on socket %d (%s)", __FILE__, __FUNCTION__, client->fd, strerror(errno));
+        modbus_diag_count(&modbus_diag_server, MODBUS_DIAG_BUS_COMM_ERROR);
+        return FALSE;
+    }
+    client->len += rc;
+
+    guint start = 0;
+    while (MBAP_HEADER_LENGTH <= client->len - start)
+    {
+        const guint8 *adu = client->buf + start;
+        // The MBAP length covers the unit identifier and the PDU
+        const guint length = MBAP_LENGTH + 2 + ((adu[MBAP_LENGTH] << 8) | adu[MBAP_LENGTH + 1]);
+        if (MBAP_HEADER_LENGTH + 1 > length || MODBUS_TCP_MAX_ADU_LENGTH < length)
+        {
+            // The stream cannot be resynchronized after a bad length
+            LOG_I(
+                "%s/%s: Closing connection on socket %d (invalid length %u)",
+                __FILE__,
+                __FUNCTION__,
+                client->fd,
+                length);
+            modbus_diag_count(&modbus_diag_server, MODBUS_DIAG_BUS_COMM_ERROR);
+            modbus_diag_count(&modbus_diag_server, MODBUS_DIAG_SERVER_NO_RESPONSE);
+            return FALSE;
+        }
+        if (length > client->len - start)
+        {
+            break;
+        }
+        if (!handle_request(client->fd, adu, length))
+        {
+            return FALSE;
+        }
+        start += length;
+    }
+    client->len -= start;
+    memmove(client->buf, client->buf + start, client->len);
+    return TRUE;
+}
+
+// Requests that change the register image when executed twice
+static gboolean is_write(const guint8 function)
+{
+    switch (function)
+    {
+    case MODBUS_FC_WRITE_SINGLE_COIL:
+    case MODBUS_FC_WRITE_SINGLE_REGISTER:
+    case MODBUS_FC_WRITE_MULTIPLE_COILS:
+    case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+    case MODBUS_FC_WRITE_AND_READ_REGISTERS:
+        return TRUE;
+    default:
+        return FALSE;
+    }
+}
+
+static struct udp_response *find_udp_response(
+    const struct sockaddr_storage *peer,
+    const socklen_t peer_len,
+    const guint8 *adu,
+    const int len,
+    const gint64 now)
+{
+    for (guint i = 0; i < UDP_RESPONSE_CACHE; i++)
+    {
+        struct udp_response *cached = &udp_responses[i];
+        if (len == cached->request_len && UDP_RESPONSE_EXPIRY > now - cached->time && peer_len == cached->peer_len &&
+            0 == memcmp(peer, &cached->peer, peer_len) && 0 == memcmp(adu, cached->request, len))
+        {
+            return cached;
+        }
+    }
+    return NULL;
+}
+
+// Receive and answer one Modbus/UDP datagram, which holds exactly one ADU
+static void handle_datagram(void)
+{
+    guint8 adu[MODBUS_TCP_MAX_ADU_LENGTH];
+    struct sockaddr_storage peer;
+    socklen_t peer_len = sizeof(peer);
+
+    // Readiness does not guarantee a datagram, e.g. one with a bad checksum is
+    // dropped when it is read
+    const ssize_t rlen = recvfrom(udp_fd, adu, sizeof(adu), MSG_DONTWAIT, (struct sockaddr *)&peer, &peer_len);
+    if (-1 == rlen)
+    {
+        if (EAGAIN != errno && EWOULDBLOCK != errno && EINTR != errno)
+        {
+            LOG_E("%s/%s: recvfrom failed (%s)", __FILE__, __FUNCTION__, strerror(errno));
+        }
+        return;
+    }
+    const gint64 received = g_get_monotonic_time();
+    if (MBAP_HEADER_LENGTH + 1 > rlen || ((adu[MBAP_LENGTH] << 8) | adu[MBAP_LENGTH + 1]) + 6 != rlen)
+    {
+        LOG_D("%s/%s: Dropping malformed %zd byte datagram", __FILE__, __FUNCTION__, rlen);
+        modbus_diag_count(&modbus_diag_server, MODBUS_DIAG_BUS_COMM_ERROR);
+        modbus_diag_count(&modbus_diag_server, MODBUS_DIAG_SERVER_NO_RESPONSE);
+        return;
+    }
+
+    const guint8 *response = adu;
+    int slen;
+    struct udp_response *cached = NULL;
+    if (!is_write(adu[MBAP_HEADER_LENGTH]))
+    {
+        slen = answer_request(adu, rlen);
+    }
+    else if (NULL != (cached = find_udp_response(&peer, peer_len, adu, rlen, received)))
+    {
+        LOG_D("%s/%s: Answering retransmitted request from the cache", __FILE__, __FUNCTION__);
+        response = cached->response;
+        slen = cached->response_len;
+    }
+    else
+    {
+        cached = &udp_responses[udp_response_next++ % UDP_RESPONSE_CACHE];
+        cached->time = received;
+        cached->peer = peer;
+        cached->peer_len = peer_len;
+        cached->request_len = rlen;
+        memcpy(cached->request, adu, rlen);
+        slen = cached->response_len = answer_request(adu, rlen);
+        memcpy(cached->response, adu, slen);
+    }
+    if (slen != sendto(udp_fd, response, slen, MSG_DONTWAIT, (struct sockaddr *)&peer, peer_len))
+    {
+        LOG_E("%s/%s: Failed to send reply (%s)", __FILE__, __FUNCTION__, strerror(errno));
+        modbus_diag_count(&modbus_diag_server, MODBUS_DIAG_SERVER_NO_RESPONSE);
+        return;
+    }
+    latency_record(LATENCY_SERVER_REQUEST, g_get_monotonic_time() - received);
+}
+
+static gboolean udp_open(void)
+{
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(modbus_port),
+        .sin_addr.s_addr = htonl(INADDR_ANY),
+    };
+    const int enable = 1;
+
+    LOG_I("Listen for Modbus UDP requests ...");
+    udp_fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (-1 == udp_fd)
+    {
+        LOG_E("%s/%s: Failed to create UDP socket (%s)", __FILE__, __FUNCTION__, strerror(errno));
+        return FALSE;
+    }
+    if (-1 == setsockopt(udp_fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) ||
+        -1 == bind(udp_fd, (struct sockaddr *)&addr, sizeof(addr)))
+    {
+        LOG_E("%s/%s: Failed to bind UDP port %u (%s)", __FILE__, __FUNCTION__, modbus_port, strerror(errno));
+        return FALSE;
+    }
+    memset(udp_responses, 0, sizeof(udp_responses));
+    return TRUE;
+}
+
+// Accept a pending connection, returns the client socket or -1
+static int accept_client(void)
+{
+    int s = listen_fd;
+    int fd = modbus_tcp_accept(srv_ctx, &s);
+    if (-1 == fd)
+    {
+        // The listening socket is non-blocking, and a connection reset before
+        // it is accepted leaves nothing to accept
+        if (EAGAIN != errno && EWOULDBLOCK != errno && ECONNABORTED != errno && EINTR != errno)
+        {
+            LOG_E("%s/%s: modbus_tcp_accept failed (%s)", __FILE__, __FUNCTION__, modbus_strerror(errno));
+        }
+        return -1;
+    }
+    if (MAX_CLIENTS <= nclients)
+    {
+        LOG_E("%s/%s: Too many clients (%u), rejecting connection", __FILE__, __FUNCTION__, nclients);
+        close(fd);
+        return -1;
+    }
+    if (-1 == fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK))
+    {
+        LOG_E("%s/%s: Failed to make socket %d non-blocking (%s)", __FILE__, __FUNCTION__, fd, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void add_client(const int fd, const guint source)
+{
+    assert(MAX_CLIENTS > nclients);
+    clients[nclients].fd = fd;
+    clients[nclients].source = source;
+    clients[nclients].len = 0;
+    nclients++;
+    LOG_I("%s/%s: Accepted client on socket %d (%u connected)", __FILE__, __FUNCTION__, fd, nclients);
+}
+
+static struct client *find_client(const int fd)
+{
+    for (guint i = 0; i < nclients; i++)
+    {
+        if (fd == clients[i].fd)
+        {
+            return &clients[i];
+        }
+    }
+    return NULL;
+}
+
+// Close a client socket; its GSource must be removed by the caller, or by
+// returning G_SOURCE_REMOVE from its callback
+static void remove_client(const int fd)
+{
+    close(fd);
+    for (guint i = 0; i < nclients; i++)
+    {
+        if (fd == clients[i].fd)
+        {
+            clients[i] = clients[--nclients];
+            break;
+        }
+    }
+}
 
+static gboolean server_open(void)
+{
     assert(1024 <= modbus_port && 65535 >= modbus_port);
     LOG_I("Trying to create Modbus TCP context for all IP addresss and port %u ...", modbus_port);
     srv_ctx = modbus_new_tcp(NULL, modbus_port);
     if (NULL == srv_ctx)
     {
         LOG_E("%s/%s: Unable to create the libmodbus context (%s)", __FILE__, __FUNCTION__, modbus_strerror(errno));
-        goto server_exit;
-    }
-    if (0 != modbus_set_response_timeout(srv_ctx, 1, 0))
-    {
-        LOG_E("%s/%s: Failed to set modbus response timeout (%s)", __FILE__, __FUNCTION__, modbus_strerror(errno));
-        goto server_exit;
+        return FALSE;
     }
 
-    LOG_I("Listen for Modbus TCP connection ...");
-    s = modbus_tcp_listen(srv_ctx, 1);
-    if (-1 == s)
+    // The mapping of each unit is allocated on its first request
+    units = register_map_new_units();
+
+    LOG_I("Listen for Modbus TCP connections ...");
+    listen_fd = modbus_tcp_listen(srv_ctx, MAX_CLIENTS);
+    if (-1 == listen_fd)
     {
         LOG_E("%s/%s: modbus_tcp_listen failed (%s)", __FILE__, __FUNCTION__, modbus_strerror(errno));
-        goto server_exit;
+        return FALSE;
     }
-
-    flags = fcntl(s, F_GETFL, 0);
-    if (-1 == fcntl(s, F_SETFL, flags | O_NONBLOCK))
+    // Neither the server thread nor the main loop may block in accept()
+    if (-1 == fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL) | O_NONBLOCK))
     {
-        LOG_E("%s/%s: fcntl failed for socket (%s)", __FILE__, __FUNCTION__, strerror(errno));
-        goto server_exit;
+        LOG_E("%s/%s: Failed to make listening socket non-blocking (%s)", __FILE__, __FUNCTION__, strerror(errno));
+        return FALSE;
     }
+    return !modbus_udp || udp_open();
+}
 
-    LOG_I("Accept Modbus TCP connection ...");
-    while (*((gboolean *)run))
+static void server_close(void)
+{
+    while (0 < nclients)
     {
-        // Attempt to accept a client connection (non-blocking)
-        if (0 < modbus_tcp_accept(srv_ctx, &s))
+        if (0 != clients[0].source)
         {
-            break;
+            g_source_remove(clients[0].source);
         }
+        remove_client(clients[0].fd);
+    }
+    if (0 != listen_source)
+    {
+        g_source_remove(listen_source);
+        listen_source = 0;
+    }
+    if (-1 != listen_fd)
+    {
+        close(listen_fd);
+        listen_fd = -1;
+    }
+    if (0 != udp_source)
+    {
+        g_source_remove(udp_source);
+        udp_source = 0;
+    }
+    if (-1 != udp_fd)
+    {
+        close(udp_fd);
+        udp_fd = -1;
+    }
+    register_map_free_units(units);
+    units = NULL;
+    modbus_free(srv_ctx);
+    srv_ctx = NULL;
+}
+
+static gboolean client_source_callback(gint fd, GIOCondition condition, gpointer data)
+{
+    (void)data;
+    struct client *client = find_client(fd);
+    if (NULL == client || 0 == (condition & G_IO_IN) || !handle_client(client))
+    {
+        remove_client(fd);
+        return G_SOURCE_REMOVE;
+    }
+    return G_SOURCE_CONTINUE;
+}
+
+static gboolean listen_source_callback(gint fd, GIOCondition condition, gpointer data)
+{
+    (void)fd;
+    (void)condition;
+    (void)data;
+    const int client_fd = accept_client();
+    if (-1 != client_fd)
+    {
+        add_client(
+            client_fd,
+            g_unix_fd_add(client_fd, G_IO_IN | G_IO_HUP | G_IO_ERR, client_source_callback, NULL));
+    }
+    return G_SOURCE_CONTINUE;
+}
+
+static gboolean udp_source_callback(gint fd, GIOCondition condition, gpointer data)
+{
+    (void)fd;
+    (void)condition;
+    (void)data;
+    handle_datagram();
+    return G_SOURCE_CONTINUE;
+}
+
+static void *run_modbus_server(void *run)
+{
+    assert(NULL != run);
+    struct epoll_event events[MAX_CLIENTS + 3];
+    struct epoll_event ev = {.events = EPOLLIN};
+    int epfd = -1;
 
-        // Sleep briefly to avoid busy-waiting
-        usleep(200000); // Sleep for 200 ms
+    if (!server_open())
+    {
+        goto server_exit;
     }
 
-    LOG_I("Allocate mapping ...");
-    mb_mapping = modbus_mapping_new(1, 0, 0, 0);
-    if (NULL == mb_mapping)
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (-1 == epfd)
+    {
+        LOG_E("%s/%s: epoll_create1 failed (%s)", __FILE__, __FUNCTION__, strerror(errno));
+        goto server_exit;
+    }
+    ev.data.fd = listen_fd;
+    if (-1 == epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fd, &ev))
+    {
+        LOG_E("%s/%s: epoll_ctl failed for listening socket (%s)", __FILE__, __FUNCTION__, strerror(errno));
+        goto server_exit;
+    }
+    ev.data.fd = wake_fd;
+    if (-1 == epoll_ctl(epfd, EPOLL_CTL_ADD, wake_fd, &ev))
     {
-        LOG_E("%s/%s: Failed to allocate the mapping: %s", __FILE__, __FUNCTION__, modbus_strerror(errno));
+        LOG_E("%s/%s: epoll_ctl failed for wakeup descriptor (%s)", __FILE__, __FUNCTION__, strerror(errno));
+        goto server_exit;
+    }
+    ev.data.fd = udp_fd;
+    if (-1 != udp_fd && -1 == epoll_ctl(epfd, EPOLL_CTL_ADD, udp_fd, &ev))
+    {
+        LOG_E("%s/%s: epoll_ctl failed for UDP socket (%s)", __FILE__, __FUNCTION__, strerror(errno));
         goto server_exit;
     }
 
-    LOG_I("%s/%s: Start receiving ...", __FILE__, __FUNCTION__);
-    uint8_t req[MODBUS_TCP_MAX_ADU_LENGTH];
-    while (*((gboolean *)run))
+    LOG_I("%s/%s: Start serving ...", __FILE__, __FUNCTION__);
+    while (*((volatile gboolean *)run))
     {
-        int rlen = modbus_receive(srv_ctx, req);
-        if (-1 == rlen)
+        int n = epoll_wait(epfd, events, G_N_ELEMENTS(events), -1);
+        if (-1 == n)
         {
-            if (ETIMEDOUT == errno)
+            if (EINTR == errno)
             {
-                // Timeout is expected, continue to wait for requests
                 continue;
             }
-
-            // Other errors than timeout are fatal
-            LOG_E("%s/%s: modbus_receive failed (%s)", __FILE__, __FUNCTION__, modbus_strerror(errno));
-            break;
-        }
-#if 0
-    LOG_I(
-      "%s/%s: We received (length %d): [ %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X ]",
-      __FILE__,
-      __FUNCTION__,
-      rlen,
-      req[0],
-      req[1],
-      req[2],
-      req[3],
-      req[4],
-      req[5],
-      req[6],
-      req[7],
-      req[8],
-      req[9],
-      req[10],
-      req[11]);
-#endif
-        if (12 > rlen)
-        {
-            LOG_I(
-                "%s/%s: The requests we handle should be longer than the %d bytes we now got",
-                __FILE__,
-                __FUNCTION__,
-                rlen);
+            LOG_E("%s/%s: epoll_wait failed (%s)", __FILE__, __FUNCTION__, strerror(errno));
             break;
         }
-        guint16 address = (req[8] << 8) | req[9];
-        LOG_I("%s/%s: Received request on address %d", __FILE__, __FUNCTION__, address);
-        if (MODBUS_FC_WRITE_SINGLE_COIL == req[7])
+        for (int i = 0; i < n; i++)
         {
-            LOG_I(
-                "%s/%s: The event trigger on the remote device is now %s",
-                __FILE__,
-                __FUNCTION__,
-                0xFF == req[10] ? "ACTIVE" : "INACTIVE");
-            if (-1 == modbus_reply(srv_ctx, req, rlen, mb_mapping))
+            const int fd = events[i].data.fd;
+            if (wake_fd == fd)
+            {
+                // Stop requested, checked by the loop condition
+                continue;
+            }
+            if (udp_fd == fd)
+            {
+                handle_datagram();
+                continue;
+            }
+            if (listen_fd == fd)
             {
-                LOG_E("%s/%s: modbus_reply failed (%s)", __FILE__, __FUNCTION__, modbus_strerror(errno));
-                break;
+                const int client_fd = accept_client();
+                ev.data.fd = client_fd;
+                if (-1 != client_fd && -1 == epoll_ctl(epfd, EPOLL_CTL_ADD, client_fd, &ev))
+                {
+                    LOG_E("%s/%s: epoll_ctl failed for client socket (%s)", __FILE__, __FUNCTION__, strerror(errno));
+                    close(client_fd);
+                }
+                else if (-1 != client_fd)
+                {
+                    add_client(client_fd, 0);
+                }
+                continue;
+            }
+            struct client *client = find_client(fd);
+            if (NULL != client && !handle_client(client))
+            {
+                // Closing the socket also removes it from the epoll set
+                remove_client(fd);
             }
-            LOG_I("%s/%s: Send reply to client for acknowledgement", __FILE__, __FUNCTION__);
         }
     }
 
 server_exit:
-    if (0 < s)
+    if (-1 != epfd)
     {
-        close(s);
+        close(epfd);
     }
-    modbus_mapping_free(mb_mapping);
-    modbus_free(srv_ctx);
+    server_close();
 
     pthread_exit(NULL);
 }
 
-gboolean modbus_server_start(const guint32 port)
+static gboolean start_main_loop_server(void)
+{
+    if (!server_open())
+    {
+        server_close();
+        return FALSE;
+    }
+    listen_source = g_unix_fd_add(listen_fd, G_IO_IN, listen_source_callback, NULL);
+    if (-1 != udp_fd)
+    {
+        udp_source = g_unix_fd_add(udp_fd, G_IO_IN, udp_source_callback, NULL);
+    }
+    LOG_I("%s/%s: Serving from the main loop ...", __FILE__, __FUNCTION__);
+    return TRUE;
+}
+
+gboolean modbus_server_start(const guint32 port, const gboolean main_loop, const gboolean udp)
 {
     modbus_server_stop();
-    run_server = TRUE;
     modbus_port = port;
+    modbus_udp = udp;
+    if (main_loop)
+    {
+        return start_main_loop_server();
+    }
+
+    wake_fd = eventfd(0, EFD_CLOEXEC);
+    if (-1 == wake_fd)
+    {
+        LOG_E("%s/%s: Failed to create eventfd (%s)", __FILE__, __FUNCTION__, strerror(errno));
+        return FALSE;
+    }
+    run_server = TRUE;
     int result = pthread_create(&modbus_server_thread_id, NULL, run_modbus_server, &run_server);
     if (0 != result)
     {
@@ -180,8 +642,22 @@ void modbus_server_stop()
     if (0 < (int)modbus_server_thread_id)
     {
         LOG_I("%s/%s: Joining running server thread ...", __FILE__, __FUNCTION__);
+        // Wake up the server thread blocked in epoll_wait()
+        if (-1 == eventfd_write(wake_fd, 1))
+        {
+            LOG_E("%s/%s: Failed to wake up server thread (%s)", __FILE__, __FUNCTION__, strerror(errno));
+        }
         pthread_join(modbus_server_thread_id, NULL);
     }
+    else if (0 != listen_source)
+    {
+        LOG_I("%s/%s: Removing main loop server sources ...", __FILE__, __FUNCTION__);
+        server_close();
+    }
+    if (-1 != wake_fd)
+    {
+        close(wake_fd);
+        wake_fd = -1;
+    }
     modbus_server_thread_id = -1;
-    srv_ctx = NULL;
 }
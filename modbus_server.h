@@ -19,7 +19,8 @@
 
 #include <glib.h>
 
-gboolean modbus_server_start(const guint32 port);
+// Serve Modbus/TCP on port, and Modbus/UDP on the same port number if udp is set
+gboolean modbus_server_start(const guint32 port, const gboolean main_loop, const gboolean udp);
 void modbus_server_stop(void);
 
 #endif /* _MODBUS_SERVER_H_ */
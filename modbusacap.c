@@ -17,11 +17,35 @@
 #include <assert.h>
 #include <axevent.h>
 #include <axparameter.h>
+#include <errno.h>
+#include <glib-unix.h>
 #include <libgen.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
 
+#include "event_record.h"
+#include "ingest.h"
+#include "latency.h"
 #include "modbus_client.h"
+#include "modbus_diag.h"
+#include "modbus_poll.h"
 #include "modbus_server.h"
 #include "modbusacap_common.h"
+#include "register_map.h"
+#include "scenario_map.h"
+
+// Latency statistics, relative to the application's package directory
+#define LATENCY_FILE "localdata/latency.txt"
+#define LATENCY_FILE_INTERVAL 60
+
+// Polling interval and longest wait for a new client configuration to connect
+#define CLIENT_SWAP_POLL 50
+#define CLIENT_SWAP_TIMEOUT (5 * G_USEC_PER_SEC)
+
+// Topic of the events declared for polled coils and registers
+#define POLL_EVENT_TOPIC1 "ModbusAcap"
+#define POLL_EVENT_TOPIC2 "Poll"
 
 enum Mode
 {
@@ -29,6 +53,36 @@ enum Mode
     CLIENT = 1
 };
 
+// The Modbus parameters, applied together as one snapshot
+struct modbus_config
+{
+    gboolean started;
+    guint8 mode;
+    guint32 port;
+    gboolean server_main_loop;
+    gboolean udp;
+    gchar *server;
+    gchar *poll;
+    guint connections;
+};
+
+// A polled coil or holding register, with the event declared for it
+struct poll_event
+{
+    guint declaration;
+    guint16 value;
+};
+
+// A polled change on its way from a client sender thread to the main loop,
+// the slot is free for position seq and holds data for position seq - 1
+struct poll_change
+{
+    volatile gint seq;
+    gboolean holding_register;
+    guint16 address;
+    guint16 value;
+};
+
 static GMainLoop *main_loop = NULL;
 static AXEventHandler *ehandler;
 static AXParameter *axparameter = NULL;
@@ -36,46 +90,358 @@ static gboolean initialized = FALSE;
 static guint16 address = 0;
 static guint8 mode = 0;
 static guint32 port = 0;
-static guint subscription_base;
-static guint subscription_threshold;
-static pthread_mutex_t lock;
+static gboolean server_main_loop = FALSE;
+static gboolean udp = FALSE;
+static gchar *server = NULL;
+static struct modbus_config running;
+static struct modbus_config next;
+static guint apply_source = 0;
+static guint swap_source = 0;
+static gint64 apply_requested = 0;
+static guint scenario = 1;
+static gchar *scenario_map_spec = NULL;
+static gboolean wildcard = FALSE;
+static gboolean gateway = FALSE;
+static guint subscription_wildcard = 0;
+static guint replay_speed = 1;
+static gboolean replay_file_clearing = FALSE;
+static enum modbus_client_heartbeat heartbeat_mode = MODBUS_CLIENT_HEARTBEAT_OFF;
+static guint16 heartbeat_address = 0;
+static guint heartbeat_interval = 1000;
+static gchar *poll_addresses = NULL;
+static guint connections = 1;
+static guint poll_interval = 100;
+static guint poll_max_interval = 2000;
+
+// Declared poll events by table << 16 | address
+static GHashTable *poll_events = NULL;
+
+// Power of two, one full read of coils fits
+#define POLL_RING_SIZE 4096
+static struct poll_change poll_ring[POLL_RING_SIZE];
+static volatile gint poll_enqueue_pos = 0;
+static gint poll_dequeue_pos = 0;
+static volatile gint poll_dropped = 0;
+static int poll_wake_fd = -1;
+static guint poll_wake_source = 0;
 
 static void open_syslog(const char *app_name)
 {
     openlog(app_name, LOG_PID, LOG_LOCAL4);
+    log_init();
 }
 
 static void close_syslog(void)
 {
+    log_cleanup();
     LOG_I("%s/%s: Exiting!", __FILE__, __FUNCTION__);
     closelog();
 }
 
+// Forward a scenario state change, from the event system or from a replay
+static void dispatch_event(const struct scenario_route *route, const gboolean active, const gint64 received)
+{
+    // Debug level only, so that nothing is formatted per event in normal operation
+    LOG_D(
+        "aoa-event %s %s active (%s)",
+        route->topic2,
+        active ? "is" : "NOT",
+        CLIENT == running.mode ? "running in client mode, passing on via Modbus"
+                               : "running in server mode, published in the register map");
+    // Send event over Modbus
+    if (CLIENT == running.mode)
+    {
+        if (!modbus_client_send_event(route->address, active, received))
+        {
+            LOG_E("%s/%s: Failed to queue event data for Modbus", __FILE__, __FUNCTION__);
+        }
+    }
+    else
+    {
+        register_map_publish(route->slot, active);
+    }
+}
+
+static void replay_callback(const gchar *topic2, const gboolean active)
+{
+    const struct scenario_route *route = scenario_map_lookup(topic2);
+    if (NULL != route)
+    {
+        dispatch_event(route, active, g_get_monotonic_time());
+    }
+}
+
+static AXEventKeyValueSet *poll_key_value_set(const struct poll_change *change)
+{
+    AXEventKeyValueSet *key_value_set = ax_event_key_value_set_new();
+    const gchar *table = change->holding_register ? "HoldingRegister" : "Coil";
+    const gint address = change->address;
+    const gint value = change->value;
+    const gboolean active = 0 != change->value;
+
+    ax_event_key_value_set_add_key_values(
+        key_value_set,
+        NULL,
+        "topic0",
+        "tnsaxis",
+        "CameraApplicationPlatform",
+        AX_VALUE_TYPE_STRING,
+        "topic1",
+        "tnsaxis",
+        POLL_EVENT_TOPIC1,
+        AX_VALUE_TYPE_STRING,
+        "topic2",
+        "tnsaxis",
+        POLL_EVENT_TOPIC2,
+        AX_VALUE_TYPE_STRING,
+        "Table",
+        NULL,
+        table,
+        AX_VALUE_TYPE_STRING,
+        "Address",
+        NULL,
+        &address,
+        AX_VALUE_TYPE_INT,
+        "Value",
+        NULL,
+        &value,
+        AX_VALUE_TYPE_INT,
+        "active",
+        NULL,
+        &active,
+        AX_VALUE_TYPE_BOOL,
+        NULL);
+    ax_event_key_value_set_mark_as_source(key_value_set, "Table", NULL, NULL);
+    ax_event_key_value_set_mark_as_source(key_value_set, "Address", NULL, NULL);
+    ax_event_key_value_set_mark_as_data(key_value_set, "Value", NULL, NULL);
+    ax_event_key_value_set_mark_as_data(key_value_set, "active", NULL, NULL);
+    return key_value_set;
+}
+
+// Raise an event for a polled value from the main loop; a stateful event is
+// declared for each coil and register the first time it is seen, with the
+// value as its initial state
+static void emit_poll_event(const struct poll_change *change)
+{
+    const gpointer key = GUINT_TO_POINTER(change->holding_register << 16 | change->address);
+    struct poll_event *event = g_hash_table_lookup(poll_events, key);
+    AXEventKeyValueSet *key_value_set = poll_key_value_set(change);
+    GError *error = NULL;
+
+    if (NULL == event)
+    {
+        event = g_new0(struct poll_event, 1);
+        event->value = change->value;
+        if (!ax_event_handler_declare(ehandler, key_value_set, FALSE, &event->declaration, NULL, NULL, &error))
+        {
+            LOG_E(
+                "%s/%s: Failed to declare event for address %u (%s)",
+                __FILE__,
+                __FUNCTION__,
+                change->address,
+                NULL != error ? error->message : "");
+            g_clear_error(&error);
+            g_free(event);
+        }
+        else
+        {
+            g_hash_table_insert(poll_events, key, event);
+        }
+    }
+    else if (change->value != event->value)
+    {
+        // The same value may be reported again by a replacing client
+        event->value = change->value;
+        AXEvent *ax_event = ax_event_new2(key_value_set, NULL);
+        if (!ax_event_handler_send_event(ehandler, event->declaration, ax_event, &error))
+        {
+            LOG_E(
+                "%s/%s: Failed to send event for address %u (%s)",
+                __FILE__,
+                __FUNCTION__,
+                change->address,
+                NULL != error ? error->message : "");
+            g_clear_error(&error);
+        }
+        ax_event_free(ax_event);
+    }
+    LOG_D(
+        "%s/%s: Polled %s %u is now %u",
+        __FILE__,
+        __FUNCTION__,
+        change->holding_register ? "holding register" : "coil",
+        change->address,
+        change->value);
+    ax_event_key_value_set_free(key_value_set);
+}
+
+// Raise the events for the changes queued by poll_callback()
+static gboolean drain_poll_changes(gint fd, GIOCondition condition, gpointer user_data)
+{
+    (void)condition;
+    (void)user_data;
+    eventfd_t count;
+    if (-1 == eventfd_read(fd, &count) && EAGAIN != errno)
+    {
+        LOG_E("%s/%s: Failed to read wakeup (%s)", __FILE__, __FUNCTION__, strerror(errno));
+    }
+
+    for (;;)
+    {
+        struct poll_change *change = &poll_ring[poll_dequeue_pos & (POLL_RING_SIZE - 1)];
+        if (poll_dequeue_pos + 1 != g_atomic_int_get(&change->seq))
+        {
+            break;
+        }
+        emit_poll_event(change);
+        g_atomic_int_set(&change->seq, poll_dequeue_pos + POLL_RING_SIZE);
+        poll_dequeue_pos++;
+    }
+
+    const gint lost = g_atomic_int_exchange(&poll_dropped, 0);
+    if (0 < lost)
+    {
+        LOG_E("%s/%s: Poll event queue full, %d changes dropped", __FILE__, __FUNCTION__, lost);
+    }
+    return G_SOURCE_CONTINUE;
+}
+
+// Called from a client sender thread, the event is raised from the main loop.
+// Both the active and a pending client may poll during a swap.
+static void poll_callback(const gboolean holding_register, const guint16 address, const guint16 value)
+{
+    struct poll_change *change;
+    gint pos = g_atomic_int_get(&poll_enqueue_pos);
+    for (;;)
+    {
+        change = &poll_ring[pos & (POLL_RING_SIZE - 1)];
+        const gint diff = g_atomic_int_get(&change->seq) - pos;
+        if (0 == diff)
+        {
+            if (g_atomic_int_compare_and_exchange(&poll_enqueue_pos, pos, pos + 1))
+            {
+                break;
+            }
+            pos = g_atomic_int_get(&poll_enqueue_pos);
+        }
+        else if (0 > diff)
+        {
+            // Full, the main loop is behind
+            g_atomic_int_inc(&poll_dropped);
+            return;
+        }
+        else
+        {
+            pos = g_atomic_int_get(&poll_enqueue_pos);
+        }
+    }
+
+    change->holding_register = holding_register;
+    change->address = address;
+    change->value = value;
+    g_atomic_int_set(&change->seq, pos + 1);
+    if (-1 == eventfd_write(poll_wake_fd, 1))
+    {
+        LOG_E("%s/%s: Failed to wake main loop (%s)", __FILE__, __FUNCTION__, strerror(errno));
+    }
+}
+
+static gboolean poll_ring_init(void)
+{
+    for (guint i = 0; i < POLL_RING_SIZE; i++)
+    {
+        poll_ring[i].seq = i;
+    }
+    poll_enqueue_pos = 0;
+    poll_dequeue_pos = 0;
+    poll_wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (-1 == poll_wake_fd)
+    {
+        LOG_E("%s/%s: Failed to create eventfd (%s)", __FILE__, __FUNCTION__, strerror(errno));
+        return FALSE;
+    }
+    poll_wake_source = g_unix_fd_add(poll_wake_fd, G_IO_IN, drain_poll_changes, NULL);
+    return TRUE;
+}
+
+static void poll_ring_cleanup(void)
+{
+    if (0 != poll_wake_source)
+    {
+        g_source_remove(poll_wake_source);
+        poll_wake_source = 0;
+    }
+    if (-1 != poll_wake_fd)
+    {
+        close(poll_wake_fd);
+        poll_wake_fd = -1;
+    }
+}
+
+static void undeclare_poll_event(gpointer data)
+{
+    struct poll_event *event = data;
+    (void)ax_event_handler_undeclare(ehandler, event->declaration, NULL);
+    g_free(event);
+}
+
+// Writes submitted by other applications take the same path as events
+static void ingest_callback(const guint8 table, const guint16 address, const guint16 value, const gint64 received)
+{
+    gboolean queued;
+
+    if (CLIENT != running.mode)
+    {
+        LOG_D("%s/%s: Ignoring submitted write in server mode", __FILE__, __FUNCTION__);
+        return;
+    }
+    switch (table)
+    {
+    case INGEST_TABLE_COIL:
+        queued = modbus_client_send_event(address, 0 != value, received);
+        break;
+    case INGEST_TABLE_HOLDING_REGISTER:
+        queued = modbus_client_send_register(address, value, received);
+        break;
+    default:
+        LOG_E("%s/%s: Unknown table %u in submitted write", __FILE__, __FUNCTION__, table);
+        return;
+    }
+    if (!queued)
+    {
+        LOG_E("%s/%s: Failed to queue submitted write for Modbus", __FILE__, __FUNCTION__);
+    }
+}
+
 static void event_callback(guint subscription, AXEvent *event, void *data)
 {
+    const gint64 received = g_get_monotonic_time();
     const AXEventKeyValueSet *key_value_set;
+    const struct scenario_route *route = data;
+    gchar *topic2 = NULL;
     gboolean active;
 
     (void)subscription;
-    (void)data;
 
     // Handle event
     key_value_set = ax_event_get_key_value_set(event);
 
+    if (NULL == route &&
+        ax_event_key_value_set_get_string(key_value_set, "topic2", "tnsaxis", &topic2, NULL))
+    {
+        // Wildcard subscription, route on topic2
+        route = scenario_map_lookup(topic2);
+    }
+
     if (ax_event_key_value_set_get_boolean(key_value_set, "active", NULL, &active, NULL))
     {
-        LOG_I(
-            "aoa-event %s active (%s)",
-            active ? "is" : "NOT",
-            CLIENT == mode ? "running in client mode, passing on via Modbus"
-                           : "running in server mode, not forwarded anywhere");
-        // Send event over Modbus
-        if (CLIENT == mode)
+        if (NULL != route || NULL != topic2)
         {
-            if (!modbus_client_send_event(address, active))
-            {
-                LOG_E("%s/%s: Failed to send event data over Modbus", __FILE__, __FUNCTION__);
-            }
+            event_record_write(NULL != route ? route->topic2 : topic2, active, received);
+        }
+        if (NULL != route)
+        {
+            dispatch_event(route, active, received);
         }
     }
     else
@@ -88,10 +454,12 @@ static void event_callback(guint subscription, AXEvent *event, void *data)
 
     // Free the received event, n.b. AXEventKeyValueSet should not be freed
     // since it's owned by the event system until unsubscribing
+    g_free(topic2);
     ax_event_free(event);
 }
 
-static guint aoatrigger_subscription(const guint newscenario, const gchar *subtype)
+// Subscribe to the AOA events with the given topic2, or to all AOA events if topic2 is NULL
+static guint aoatrigger_subscription(const gchar *topic2, struct scenario_route *route)
 {
     assert(NULL != ehandler);
 
@@ -100,9 +468,8 @@ static guint aoatrigger_subscription(const guint newscenario, const gchar *subty
 
     key_value_set = ax_event_key_value_set_new();
 
-    // Setup subscription string and key/value set for subscription
-    gchar *subscriptionstr = g_strdup_printf("Device1Scenario%u%s", newscenario, NULL == subtype ? "" : subtype);
-    LOG_I("%s/%s: Create subscription for '%s'", __FILE__, __FUNCTION__, subscriptionstr);
+    // Setup key/value set for subscription
+    LOG_I("%s/%s: Create subscription for '%s'", __FILE__, __FUNCTION__, NULL == topic2 ? "*" : topic2);
     ax_event_key_value_set_add_key_values(
         key_value_set,
         NULL,
@@ -114,11 +481,8 @@ static guint aoatrigger_subscription(const guint newscenario, const gchar *subty
         "tnsaxis",
         "ObjectAnalytics",
         AX_VALUE_TYPE_STRING,
-        "topic2",
-        "tnsaxis",
-        subscriptionstr,
-        AX_VALUE_TYPE_STRING,
         NULL);
+    ax_event_key_value_set_add_key_value(key_value_set, "topic2", "tnsaxis", topic2, AX_VALUE_TYPE_STRING, NULL);
 
     // Setup subscription and connect to callback function
     ax_event_handler_subscribe(
@@ -126,11 +490,10 @@ static guint aoatrigger_subscription(const guint newscenario, const gchar *subty
         key_value_set,                          // key value set
         &subscription,                          // subscription id
         (AXSubscriptionCallback)event_callback, // callback function
-        NULL,                                   // user data
+        route,                                  // user data
         NULL);                                  // GError
 
     // Cleanup
-    g_free(subscriptionstr);
     ax_event_key_value_set_free(key_value_set);
 
     // Return subscription id
@@ -142,39 +505,52 @@ static void teardown_event_subscriptions(void)
 {
     assert(NULL != ehandler);
 
-    (void)ax_event_handler_unsubscribe(ehandler, subscription_base, NULL);
-    (void)ax_event_handler_unsubscribe(ehandler, subscription_threshold, NULL);
+    for (guint i = 0; i < scenario_map_size(); i++)
+    {
+        struct scenario_route *route = scenario_map_get(i);
+        if (0 != route->subscription)
+        {
+            (void)ax_event_handler_unsubscribe(ehandler, route->subscription, NULL);
+            route->subscription = 0;
+        }
+    }
+    if (0 != subscription_wildcard)
+    {
+        (void)ax_event_handler_unsubscribe(ehandler, subscription_wildcard, NULL);
+        subscription_wildcard = 0;
+    }
 }
 
-static void setup_event_subscriptions(const guint newscenario)
+static void setup_event_subscriptions(void)
 {
     assert(NULL != ehandler);
+    guint16 addresses[REGMAP_MAX_SLOTS];
+    guint8 units[REGMAP_MAX_SLOTS];
 
     // Unsubscribe from eventual existing subscriptions
     teardown_event_subscriptions();
 
-    // New subscriptions; we currently subscribe to and handle the stateful (active/inactive)
-    // events with topic2 set to (and X = 1, 2 ... N):
+    // We subscribe to and handle the stateful (active/inactive) events with
+    // topic2 set to (and X = 1, 2 ... N):
     // - "Device1ScenarioX"
     // - "Device1ScenarioXThreshold"
-    subscription_base = aoatrigger_subscription(newscenario, NULL);
-    subscription_threshold = aoatrigger_subscription(newscenario, "Threshold");
-}
-
-static gboolean setup_modbus(const guint8 mode, const guint32 port, const gchar *server)
-{
-    switch (mode)
+    // either as one subscription per mapped topic, where the route is passed
+    // as user data, or as one wildcard subscription routed on topic2
+    if (!scenario_map_build(scenario_map_spec, scenario, address, gateway))
     {
-    case SERVER:
-        return modbus_server_start(port);
-    case CLIENT:
-        assert(NULL != server);
-        return modbus_client_init(server, port);
-    default:
-        LOG_E("%s/%s: %u is not a known mode", __FILE__, __FUNCTION__, mode);
-        break;
+        LOG_E("%s/%s: Scenario map is not complete", __FILE__, __FUNCTION__);
+    }
+    register_map_set_slots(addresses, units, scenario_map_slots(addresses, units), gateway);
+    if (wildcard)
+    {
+        subscription_wildcard = aoatrigger_subscription(NULL, NULL);
+        return;
+    }
+    for (guint i = 0; i < scenario_map_size(); i++)
+    {
+        struct scenario_route *route = scenario_map_get(i);
+        route->subscription = aoatrigger_subscription(route->topic2, route);
     }
-    return FALSE;
 }
 
 static gchar *get_param(AXParameter *axparameter, const gchar *name)
@@ -196,20 +572,122 @@ static gchar *get_param(AXParameter *axparameter, const gchar *name)
     return value;
 }
 
-static void close_current_modbus(const guint8 m)
+static void set_config(struct modbus_config *config, const struct modbus_config *from)
 {
-    switch (m)
+    g_free(config->server);
+    g_free(config->poll);
+    *config = *from;
+    config->server = g_strdup(from->server);
+    config->poll = g_strdup(from->poll);
+}
+
+// Swap in the prepared client when all its servers are connected, or when
+// waiting any longer would only delay the events
+static gboolean swap_client(gpointer data)
+{
+    (void)data;
+    if (running.started && !modbus_client_ready() && CLIENT_SWAP_TIMEOUT > g_get_monotonic_time() - apply_requested)
+    {
+        return G_SOURCE_CONTINUE;
+    }
+
+    swap_source = 0;
+    // The replaced servers are closed and their journals deleted
+    modbus_client_commit();
+    if (running.started && SERVER == running.mode)
     {
-    case SERVER:
         modbus_server_stop();
+    }
+    set_config(&running, &next);
+    LOG_I(
+        "%s/%s: Client configuration applied in %lld ms",
+        __FILE__,
+        __FUNCTION__,
+        (long long)((g_get_monotonic_time() - apply_requested) / 1000));
+    return G_SOURCE_REMOVE;
+}
+
+// Apply the Modbus parameters make-before-break: the running client or server
+// keeps going until its replacement is ready
+static gboolean apply_modbus_config(gpointer data)
+{
+    (void)data;
+    apply_source = 0;
+    if (0 != swap_source)
+    {
+        g_source_remove(swap_source);
+        swap_source = 0;
+    }
+    modbus_client_abort();
+
+    const struct modbus_config config = {
+        .started = TRUE,
+        .mode = mode,
+        .port = port,
+        .server_main_loop = server_main_loop,
+        .udp = udp,
+        .server = server,
+        .poll = poll_addresses,
+        .connections = connections,
+    };
+    if (running.started && config.mode == running.mode && config.port == running.port && config.udp == running.udp &&
+        (CLIENT == config.mode
+             ? 0 == g_strcmp0(config.server, running.server) && 0 == g_strcmp0(config.poll, running.poll) &&
+                   config.connections == running.connections
+             : config.server_main_loop == running.server_main_loop))
+    {
+        // Nothing that the running client or server depends on has changed
+        return G_SOURCE_REMOVE;
+    }
+    set_config(&next, &config);
+
+    switch (config.mode)
+    {
+    case SERVER:
+        // The port cannot be listened on twice, so a running server is stopped
+        // first; its thread is woken up, so this is immediate
+        if (running.started && SERVER == running.mode)
+        {
+            modbus_server_stop();
+        }
+        if (!modbus_server_start(config.port, config.server_main_loop, config.udp))
+        {
+            LOG_E("%s/%s: Failed to setup Modbus server", __FILE__, __FUNCTION__);
+        }
+        modbus_client_stop();
+        set_config(&running, &next);
+        LOG_I(
+            "%s/%s: Server configuration applied in %lld ms",
+            __FILE__,
+            __FUNCTION__,
+            (long long)((g_get_monotonic_time() - apply_requested) / 1000));
         break;
     case CLIENT:
-        modbus_client_cleanup();
+        if (NULL == config.server ||
+            !modbus_client_prepare(config.server, config.port, config.udp, config.poll, config.connections))
+        {
+            LOG_E("%s/%s: Failed to setup Modbus client", __FILE__, __FUNCTION__);
+        }
+        if (swap_client(NULL))
+        {
+            swap_source = g_timeout_add(CLIENT_SWAP_POLL, swap_client, NULL);
+        }
         break;
     default:
-        LOG_E("%s/%s: %u is not a known mode", __FILE__, __FUNCTION__, mode);
+        LOG_E("%s/%s: %u is not a known mode", __FILE__, __FUNCTION__, config.mode);
         break;
     }
+    return G_SOURCE_REMOVE;
+}
+
+// Parameters changed together are applied as one configuration from the main loop
+static void schedule_modbus_config(void)
+{
+    if (initialized && 0 == apply_source)
+    {
+        apply_requested = g_get_monotonic_time();
+        apply_source = g_idle_add(apply_modbus_config, NULL);
+    }
 }
 
 static void address_callback(const gchar *name, const gchar *value, void *data)
@@ -225,6 +703,225 @@ static void address_callback(const gchar *name, const gchar *value, void *data)
     assert(0 <= newaddress || G_MAXUINT16 >= newaddress);
     address = newaddress;
     LOG_I("%s/%s: Got new %s (%u)", __FILE__, __FUNCTION__, name, address);
+
+    // Update routes and subscriptions
+    if (initialized)
+    {
+        setup_event_subscriptions();
+    }
+}
+
+static void batch_window_callback(const gchar *name, const gchar *value, void *data)
+{
+    (void)data;
+    if (NULL == value)
+    {
+        LOG_E("%s/%s: Unexpected NULL value for %s", __FILE__, __FUNCTION__, name);
+        return;
+    }
+
+    const int window = atoi(value);
+    assert(0 <= window);
+    LOG_I("%s/%s: Got new %s (%d ms)", __FILE__, __FUNCTION__, name, window);
+    modbus_client_set_batch_window(window);
+}
+
+static void pipeline_depth_callback(const gchar *name, const gchar *value, void *data)
+{
+    (void)data;
+    if (NULL == value)
+    {
+        LOG_E("%s/%s: Unexpected NULL value for %s", __FILE__, __FUNCTION__, name);
+        return;
+    }
+
+    const int depth = atoi(value);
+    assert(1 <= depth && MODBUS_CLIENT_MAX_PIPELINE >= depth);
+    LOG_I("%s/%s: Got new %s (%d)", __FILE__, __FUNCTION__, name, depth);
+    modbus_client_set_pipeline_depth(depth);
+}
+
+static void transport_callback(const gchar *name, const gchar *value, void *data)
+{
+    (void)data;
+    if (NULL == value)
+    {
+        LOG_E("%s/%s: Unexpected NULL value for %s", __FILE__, __FUNCTION__, name);
+        return;
+    }
+
+    udp = 1 == atoi(value);
+    LOG_I("%s/%s: Got new %s (%s)", __FILE__, __FUNCTION__, name, udp ? "UDP" : "TCP");
+    schedule_modbus_config();
+}
+
+static void verify_interval_callback(const gchar *name, const gchar *value, void *data)
+{
+    (void)data;
+    if (NULL == value)
+    {
+        LOG_E("%s/%s: Unexpected NULL value for %s", __FILE__, __FUNCTION__, name);
+        return;
+    }
+
+    const int interval = atoi(value);
+    assert(0 <= interval);
+    LOG_I("%s/%s: Got new %s (%d s)", __FILE__, __FUNCTION__, name, interval);
+    modbus_client_set_verify_interval(interval);
+}
+
+static void heartbeat_callback(const gchar *name, const gchar *value, void *data)
+{
+    (void)data;
+    if (NULL == value)
+    {
+        LOG_E("%s/%s: Unexpected NULL value for %s", __FILE__, __FUNCTION__, name);
+        return;
+    }
+
+    heartbeat_mode = atoi(value);
+    LOG_I("%s/%s: Got new %s (%d)", __FILE__, __FUNCTION__, name, heartbeat_mode);
+    modbus_client_set_heartbeat(heartbeat_mode, heartbeat_address, heartbeat_interval);
+}
+
+static void heartbeat_address_callback(const gchar *name, const gchar *value, void *data)
+{
+    (void)data;
+    if (NULL == value)
+    {
+        LOG_E("%s/%s: Unexpected NULL value for %s", __FILE__, __FUNCTION__, name);
+        return;
+    }
+
+    const int newaddress = atoi(value);
+    assert(0 <= newaddress && G_MAXUINT16 >= newaddress);
+    heartbeat_address = newaddress;
+    LOG_I("%s/%s: Got new %s (%u)", __FILE__, __FUNCTION__, name, heartbeat_address);
+    modbus_client_set_heartbeat(heartbeat_mode, heartbeat_address, heartbeat_interval);
+}
+
+static void heartbeat_interval_callback(const gchar *name, const gchar *value, void *data)
+{
+    (void)data;
+    if (NULL == value)
+    {
+        LOG_E("%s/%s: Unexpected NULL value for %s", __FILE__, __FUNCTION__, name);
+        return;
+    }
+
+    const int interval = atoi(value);
+    assert(0 < interval);
+    heartbeat_interval = interval;
+    LOG_I("%s/%s: Got new %s (%u ms)", __FILE__, __FUNCTION__, name, heartbeat_interval);
+    modbus_client_set_heartbeat(heartbeat_mode, heartbeat_address, heartbeat_interval);
+}
+
+static void poll_addresses_callback(const gchar *name, const gchar *value, void *data)
+{
+    (void)data;
+    if (NULL == value)
+    {
+        LOG_E("%s/%s: Unexpected NULL value for %s", __FILE__, __FUNCTION__, name);
+        return;
+    }
+
+    g_free(poll_addresses);
+    poll_addresses = g_strdup(value);
+    LOG_I("%s/%s: Got new %s (%s)", __FILE__, __FUNCTION__, name, poll_addresses);
+    schedule_modbus_config();
+}
+
+static void poll_interval_callback(const gchar *name, const gchar *value, void *data)
+{
+    (void)data;
+    if (NULL == value)
+    {
+        LOG_E("%s/%s: Unexpected NULL value for %s", __FILE__, __FUNCTION__, name);
+        return;
+    }
+
+    const int interval = atoi(value);
+    assert(0 < interval);
+    poll_interval = interval;
+    LOG_I("%s/%s: Got new %s (%u ms)", __FILE__, __FUNCTION__, name, poll_interval);
+    modbus_poll_set_intervals(poll_interval, poll_max_interval);
+}
+
+static void poll_max_interval_callback(const gchar *name, const gchar *value, void *data)
+{
+    (void)data;
+    if (NULL == value)
+    {
+        LOG_E("%s/%s: Unexpected NULL value for %s", __FILE__, __FUNCTION__, name);
+        return;
+    }
+
+    const int interval = atoi(value);
+    assert(0 < interval);
+    poll_max_interval = interval;
+    LOG_I("%s/%s: Got new %s (%u ms)", __FILE__, __FUNCTION__, name, poll_max_interval);
+    modbus_poll_set_intervals(poll_interval, poll_max_interval);
+}
+
+static void journal_size_callback(const gchar *name, const gchar *value, void *data)
+{
+    (void)data;
+    if (NULL == value)
+    {
+        LOG_E("%s/%s: Unexpected NULL value for %s", __FILE__, __FUNCTION__, name);
+        return;
+    }
+
+    // Applies to servers configured from now on
+    const int records = atoi(value);
+    LOG_I("%s/%s: Got new %s (%d)", __FILE__, __FUNCTION__, name, records);
+    modbus_client_set_journal_size(records);
+}
+
+static void journal_max_age_callback(const gchar *name, const gchar *value, void *data)
+{
+    (void)data;
+    if (NULL == value)
+    {
+        LOG_E("%s/%s: Unexpected NULL value for %s", __FILE__, __FUNCTION__, name);
+        return;
+    }
+
+    const int seconds = atoi(value);
+    LOG_I("%s/%s: Got new %s (%d s)", __FILE__, __FUNCTION__, name, seconds);
+    modbus_client_set_journal_max_age(seconds);
+}
+
+static void ingest_socket_callback(const gchar *name, const gchar *value, void *data)
+{
+    (void)data;
+    if (NULL == value)
+    {
+        LOG_E("%s/%s: Unexpected NULL value for %s", __FILE__, __FUNCTION__, name);
+        return;
+    }
+
+    LOG_I("%s/%s: Got new %s (%s)", __FILE__, __FUNCTION__, name, value);
+    ingest_close();
+    if ('\0' != *value)
+    {
+        ingest_open(value, ingest_callback);
+    }
+}
+
+static void log_level_callback(const gchar *name, const gchar *value, void *data)
+{
+    (void)data;
+    if (NULL == value)
+    {
+        LOG_E("%s/%s: Unexpected NULL value for %s", __FILE__, __FUNCTION__, name);
+        return;
+    }
+
+    const int level = atoi(value);
+    assert(LOG_EMERG <= level && LOG_DEBUG >= level);
+    LOG_I("%s/%s: Got new %s (%d)", __FILE__, __FUNCTION__, name, level);
+    log_level = level;
 }
 
 static void mode_callback(const gchar *name, const gchar *value, void *data)
@@ -236,19 +933,10 @@ static void mode_callback(const gchar *name, const gchar *value, void *data)
         return;
     }
 
-    pthread_mutex_lock(&lock);
-    close_current_modbus(mode);
     mode = atoi(value);
     assert(0 == mode || 1 == mode);
     LOG_I("%s/%s: Got new %s (%s)", __FILE__, __FUNCTION__, name, mode == SERVER ? "server" : "client");
-
-    // Setup Modbus for this mode
-    if (initialized && !setup_modbus(mode, port, get_param(axparameter, "Server")))
-    {
-        LOG_I("%s/%s: Failed to setup Modbus", __FILE__, __FUNCTION__);
-        assert(FALSE);
-    }
-    pthread_mutex_unlock(&lock);
+    schedule_modbus_config();
 }
 
 static void port_callback(const gchar *name, const gchar *value, void *data)
@@ -260,19 +948,93 @@ static void port_callback(const gchar *name, const gchar *value, void *data)
         return;
     }
 
-    pthread_mutex_lock(&lock);
-    close_current_modbus(mode);
     port = atoi(value);
     assert(1024 <= port || 65535 >= port);
     LOG_I("%s/%s: Got new %s (%u)", __FILE__, __FUNCTION__, name, port);
+    schedule_modbus_config();
+}
 
-    // Setup Modbus for this port
-    if (initialized && !setup_modbus(mode, port, get_param(axparameter, "Server")))
+static void server_loop_callback(const gchar *name, const gchar *value, void *data)
+{
+    (void)data;
+    if (NULL == value)
     {
-        LOG_I("%s/%s: Failed to setup Modbus", __FILE__, __FUNCTION__);
-        assert(FALSE);
+        LOG_E("%s/%s: Unexpected NULL value for %s", __FILE__, __FUNCTION__, name);
+        return;
+    }
+
+    server_main_loop = 1 == atoi(value);
+    LOG_I("%s/%s: Got new %s (%s)", __FILE__, __FUNCTION__, name, server_main_loop ? "main loop" : "thread");
+    schedule_modbus_config();
+}
+
+static void record_file_callback(const gchar *name, const gchar *value, void *data)
+{
+    (void)data;
+    if (NULL == value)
+    {
+        LOG_E("%s/%s: Unexpected NULL value for %s", __FILE__, __FUNCTION__, name);
+        return;
+    }
+
+    LOG_I("%s/%s: Got new %s (%s)", __FILE__, __FUNCTION__, name, value);
+    event_record_close();
+    if ('\0' != *value)
+    {
+        event_record_open(value);
+    }
+}
+
+static void replay_file_callback(const gchar *name, const gchar *value, void *data)
+{
+    (void)data;
+    if (NULL == value)
+    {
+        LOG_E("%s/%s: Unexpected NULL value for %s", __FILE__, __FUNCTION__, name);
+        return;
+    }
+
+    if ('\0' == *value && replay_file_clearing)
+    {
+        // Cleared below, let the replay run to its end
+        replay_file_clearing = FALSE;
+        return;
+    }
+
+    LOG_I("%s/%s: Got new %s (%s)", __FILE__, __FUNCTION__, name, value);
+    event_replay_stop();
+    if ('\0' == *value || !event_replay_start(value, replay_speed, replay_callback))
+    {
+        return;
+    }
+
+    // Replay once, not again when the application is restarted
+    GError *error = NULL;
+    replay_file_clearing = TRUE;
+    if (!ax_parameter_set(axparameter, name, "", TRUE, &error))
+    {
+        replay_file_clearing = FALSE;
+        LOG_E(
+            "%s/%s: Failed to clear %s (%s)",
+            __FILE__,
+            __FUNCTION__,
+            name,
+            NULL != error ? error->message : "");
+        g_clear_error(&error);
     }
-    pthread_mutex_unlock(&lock);
+}
+
+static void replay_speed_callback(const gchar *name, const gchar *value, void *data)
+{
+    (void)data;
+    if (NULL == value)
+    {
+        LOG_E("%s/%s: Unexpected NULL value for %s", __FILE__, __FUNCTION__, name);
+        return;
+    }
+
+    replay_speed = atoi(value);
+    LOG_I("%s/%s: Got new %s (%u)", __FILE__, __FUNCTION__, name, replay_speed);
 }
 
 static void scenario_callback(const gchar *name, const gchar *value, void *data)
@@ -284,15 +1046,18 @@ static void scenario_callback(const gchar *name, const gchar *value, void *data)
         return;
     }
 
-    const guint scenario = atoi(value);
+    scenario = atoi(value);
     assert(0 < scenario);
     LOG_I("%s/%s: Got new %s (%u)", __FILE__, __FUNCTION__, name, scenario);
 
-    // Update subscription
-    setup_event_subscriptions(scenario);
+    // Update routes and subscriptions
+    if (initialized)
+    {
+        setup_event_subscriptions();
+    }
 }
 
-static void server_callback(const gchar *name, const gchar *value, void *data)
+static void scenario_map_callback(const gchar *name, const gchar *value, void *data)
 {
     (void)data;
     if (NULL == value)
@@ -301,16 +1066,84 @@ static void server_callback(const gchar *name, const gchar *value, void *data)
         return;
     }
 
-    pthread_mutex_lock(&lock);
-    close_current_modbus(mode);
+    g_free(scenario_map_spec);
+    scenario_map_spec = g_strdup(value);
     LOG_I("%s/%s: Got new %s (%s)", __FILE__, __FUNCTION__, name, value);
 
-    // Setup Modbus for this mode
-    if (initialized && !setup_modbus(mode, port, value))
+    // Update routes and subscriptions
+    if (initialized)
+    {
+        setup_event_subscriptions();
+    }
+}
+
+static void connections_callback(const gchar *name, const gchar *value, void *data)
+{
+    (void)data;
+    if (NULL == value)
+    {
+        LOG_E("%s/%s: Unexpected NULL value for %s", __FILE__, __FUNCTION__, name);
+        return;
+    }
+
+    const int n = atoi(value);
+    assert(1 <= n && MODBUS_CLIENT_MAX_CONNECTIONS >= n);
+    connections = n;
+    LOG_I("%s/%s: Got new %s (%u)", __FILE__, __FUNCTION__, name, connections);
+    schedule_modbus_config();
+}
+
+static void gateway_callback(const gchar *name, const gchar *value, void *data)
+{
+    (void)data;
+    if (NULL == value)
+    {
+        LOG_E("%s/%s: Unexpected NULL value for %s", __FILE__, __FUNCTION__, name);
+        return;
+    }
+
+    gateway = 1 == atoi(value);
+    LOG_I("%s/%s: Got new %s (%s)", __FILE__, __FUNCTION__, name, gateway ? "yes" : "no");
+
+    // Update the slots, which are per unit in gateway mode
+    if (initialized)
+    {
+        setup_event_subscriptions();
+    }
+}
+
+static void wildcard_callback(const gchar *name, const gchar *value, void *data)
+{
+    (void)data;
+    if (NULL == value)
+    {
+        LOG_E("%s/%s: Unexpected NULL value for %s", __FILE__, __FUNCTION__, name);
+        return;
+    }
+
+    wildcard = 1 == atoi(value);
+    LOG_I("%s/%s: Got new %s (%s)", __FILE__, __FUNCTION__, name, wildcard ? "yes" : "no");
+
+    // Update routes and subscriptions
+    if (initialized)
     {
-        LOG_I("%s/%s: Failed to setup Modbus", __FILE__, __FUNCTION__);
+        setup_event_subscriptions();
     }
-    pthread_mutex_unlock(&lock);
+}
+
+static void server_callback(const gchar *name, const gchar *value, void *data)
+{
+    (void)data;
+    if (NULL == value)
+    {
+        LOG_E("%s/%s: Unexpected NULL value for %s", __FILE__, __FUNCTION__, name);
+        return;
+    }
+
+    g_free(server);
+    server = g_strdup(value);
+    LOG_I("%s/%s: Got new %s (%s)", __FILE__, __FUNCTION__, name, server);
+    schedule_modbus_config();
 }
 
 static gboolean setup_param(const gchar *name, AXParameterCallback callbackfn)
@@ -360,6 +1193,31 @@ static void signal_handler(gint signal_num)
     }
 }
 
+static gboolean write_latency_file(gpointer data)
+{
+    (void)data;
+    latency_write_file(LATENCY_FILE);
+    return G_SOURCE_CONTINUE;
+}
+
+static gboolean dump_latency(gpointer data)
+{
+    (void)data;
+    latency_log();
+    latency_write_file(LATENCY_FILE);
+    modbus_diag_log();
+    return G_SOURCE_CONTINUE;
+}
+
+static gboolean reset_latency(gpointer data)
+{
+    (void)data;
+    LOG_I("%s/%s: Resetting latency statistics", __FILE__, __FUNCTION__);
+    latency_reset();
+    latency_write_file(LATENCY_FILE);
+    return G_SOURCE_CONTINUE;
+}
+
 static gboolean signal_handler_init(void)
 {
     struct sigaction sa = {0};
@@ -378,6 +1236,10 @@ static gboolean signal_handler_init(void)
         return FALSE;
     }
 
+    // Dump latency statistics on SIGUSR1 and reset them on SIGUSR2, dispatched from the main loop
+    g_unix_signal_add(SIGUSR1, dump_latency, NULL);
+    g_unix_signal_add(SIGUSR2, reset_latency, NULL);
+
     return TRUE;
 }
 
@@ -396,6 +1258,11 @@ int main(int argc, char **argv)
 
     // Create event handler
     ehandler = ax_event_handler_new();
+    poll_events = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, undeclare_poll_event);
+    if (poll_ring_init())
+    {
+        modbus_client_set_poll_callback(poll_callback);
+    }
 
     // ACAP parameter setup
     axparameter = ax_parameter_new(app_name, &error);
@@ -407,24 +1274,50 @@ int main(int argc, char **argv)
         goto exit_ehandler;
     }
     // clang-format off
-    if (!setup_param("ModbusAddress", address_callback) ||
+    if (!setup_param("BatchWindow", batch_window_callback) ||
+        !setup_param("Connections", connections_callback) ||
+        !setup_param("Gateway", gateway_callback) ||
+        !setup_param("Heartbeat", heartbeat_callback) ||
+        !setup_param("HeartbeatAddress", heartbeat_address_callback) ||
+        !setup_param("HeartbeatInterval", heartbeat_interval_callback) ||
+        !setup_param("IngestSocket", ingest_socket_callback) ||
+        !setup_param("JournalMaxAge", journal_max_age_callback) ||
+        !setup_param("JournalSize", journal_size_callback) ||
+        !setup_param("LogLevel", log_level_callback) ||
+        !setup_param("ModbusAddress", address_callback) ||
         !setup_param("Mode", mode_callback) ||
+        !setup_param("PipelineDepth", pipeline_depth_callback) ||
+        !setup_param("PollAddresses", poll_addresses_callback) ||
+        !setup_param("PollInterval", poll_interval_callback) ||
+        !setup_param("PollMaxInterval", poll_max_interval_callback) ||
         !setup_param("Port", port_callback) ||
+        !setup_param("RecordFile", record_file_callback) ||
+        !setup_param("ReplaySpeed", replay_speed_callback) ||
+        !setup_param("ReplayFile", replay_file_callback) ||
         !setup_param("Scenario", scenario_callback) ||
-        !setup_param("Server", server_callback))
+        !setup_param("ScenarioMap", scenario_map_callback) ||
+        !setup_param("Server", server_callback) ||
+        !setup_param("ServerLoop", server_loop_callback) ||
+        !setup_param("Transport", transport_callback) ||
+        !setup_param("VerifyInterval", verify_interval_callback) ||
+        !setup_param("WildcardSubscription", wildcard_callback))
     // clang-format on
     {
         ret = EXIT_FAILURE;
         goto exit_param;
     }
 
-    // We are initialized, trigger start of Modbus handling via parameter callback
+    // We are initialized, subscribe to events and start Modbus with all
+    // parameters read, i.e. connect exactly once
     initialized = TRUE;
-    mode_callback("Mode", get_param(axparameter, "Mode"), NULL);
+    setup_event_subscriptions();
+    apply_requested = g_get_monotonic_time();
+    apply_modbus_config(NULL);
 
     // Main loop
     LOG_I("%s/%s: Ready", __FILE__, __FUNCTION__);
     main_loop = g_main_loop_new(NULL, FALSE);
+    g_timeout_add_seconds(LATENCY_FILE_INTERVAL, write_latency_file, NULL);
     g_main_loop_run(main_loop);
 
     // Cleanup and controlled shutdown
@@ -435,11 +1328,26 @@ exit_param:
     ax_parameter_free(axparameter);
 exit_ehandler:
     LOG_I("%s/%s: Free event handler ...", __FILE__, __FUNCTION__);
+    // The sender threads are joined before the poll ring they write to is closed
+    modbus_client_set_poll_callback(NULL);
+    modbus_client_cleanup();
+    poll_ring_cleanup();
+    g_hash_table_destroy(poll_events);
     ax_event_handler_free(ehandler);
+    event_replay_stop();
+    event_record_close();
+    ingest_close();
+    scenario_map_clear();
+    g_free(scenario_map_spec);
 
     // Cleanup Modbus
-    modbus_client_cleanup();
     modbus_server_stop();
+    g_free(server);
+    g_free(running.server);
+    g_free(next.server);
+    g_free(poll_addresses);
+    g_free(running.poll);
+    g_free(next.poll);
 exit_syslog:
     LOG_I("%s/%s: Closing syslog ...", __FILE__, __FUNCTION__);
     close_syslog();
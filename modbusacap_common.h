@@ -20,8 +20,35 @@
 #include <stdio.h>
 #include <syslog.h>
 
+// Messages per second and call site in the long run, and in a burst, before
+// further messages are suppressed; a call site that logs rarely, such as one
+// per parameter at startup, stays within the burst
+#define LOG_RATE_LIMIT 10
+#define LOG_RATE_BURST 100
+
+struct log_site
+{
+    const char *file;
+    int line;
+    long long refilled; // Monotonic time the tokens were last added, in microseconds
+    int tokens;
+    volatile int suppressed;
+    volatile int listed; // In the list of sites whose suppressed messages the logger thread reports
+    struct log_site *next;
+};
+
+// Highest syslog priority that is logged, e.g. LOG_INFO
+extern volatile int log_level;
+
+int log_site_allow(struct log_site *site);
+void log_write(struct log_site *site, int priority, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+void log_init(void);
+void log_cleanup(void);
+
+// Nothing is formatted unless the priority is enabled and the call site is within its rate limit
 // clang-format off
-#define LOG(type, fmt, args...) { syslog(type, fmt, ##args); printf(fmt, ##args); printf("\n"); }
+#define LOG(type, fmt, args...) { static struct log_site log_site_ = {.file = __FILE__, .line = __LINE__}; if ((type) <= log_level && log_site_allow(&log_site_)) { log_write(&log_site_, type, fmt, ##args); } }
+#define LOG_D(fmt, args...) { LOG(LOG_DEBUG, fmt, ##args) }
 #define LOG_I(fmt, args...) { LOG(LOG_INFO, fmt, ##args) }
 #define LOG_E(fmt, args...) { LOG(LOG_ERR, fmt, ##args) }
 // clang-format on
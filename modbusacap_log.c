@@ -0,0 +1,255 @@
+/**
+ * Copyright (C) 2023, Axis Communications AB, Lund, Sweden
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE // sem_clockwait()
+
+#include <glib.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdarg.h>
+
+#include "modbusacap_common.h"
+
+// Number of ring buffer slots, must be a power of two
+#define LOG_RING_SIZE 256
+#define LOG_MSG_SIZE 256
+// How often the logger thread reports messages suppressed since the last report
+#define LOG_SUPPRESSED_INTERVAL G_USEC_PER_SEC
+
+// Bounded multi-producer single-consumer ring buffer: a slot is free for
+// the producer claiming position pos when its sequence equals pos, and
+// holds a message for the consumer when its sequence equals pos + 1
+struct log_entry
+{
+    volatile gint seq;
+    int priority;
+    char msg[LOG_MSG_SIZE];
+};
+
+volatile int log_level = LOG_INFO;
+
+static struct log_entry ring[LOG_RING_SIZE];
+static volatile gint enqueue_pos = 0;
+static guint dequeue_pos = 0;
+static volatile gint dropped = 0;
+static sem_t log_sem;
+static volatile gint run_logger = FALSE;
+static pthread_t logger_thread_id;
+// Call sites that have suppressed messages, pushed once and never removed
+static struct log_site *suppressing = NULL;
+
+static void output(const int priority, const char *msg)
+{
+    syslog(priority, "%s", msg);
+    printf("%s\n", msg);
+}
+
+static void list_site(struct log_site *site)
+{
+    if (!g_atomic_int_compare_and_exchange(&site->listed, FALSE, TRUE))
+    {
+        return;
+    }
+    do
+    {
+        site->next = g_atomic_pointer_get(&suppressing);
+    } while (!g_atomic_pointer_compare_and_exchange(&suppressing, site->next, site));
+}
+
+// A token bucket per call site. Races between threads logging from the same
+// site can at worst let a message more or less through, but every suppressed
+// message is counted.
+int log_site_allow(struct log_site *site)
+{
+    const gint64 now = g_get_monotonic_time();
+    const gint64 added = (now - site->refilled) * LOG_RATE_LIMIT / G_USEC_PER_SEC;
+    if (0 < added)
+    {
+        site->tokens = MIN(site->tokens + added, LOG_RATE_BURST);
+        // The remainder counts towards the next token, unless the bucket is full
+        site->refilled =
+            LOG_RATE_BURST == site->tokens ? now : site->refilled + added * G_USEC_PER_SEC / LOG_RATE_LIMIT;
+    }
+    if (0 >= site->tokens)
+    {
+        if (0 == g_atomic_int_add(&site->suppressed, 1))
+        {
+            list_site(site);
+        }
+        return FALSE;
+    }
+    site->tokens--;
+    return TRUE;
+}
+
+static int format_message(struct log_site *site, char *buf, const char *fmt, va_list ap)
+{
+    int len = g_vsnprintf(buf, LOG_MSG_SIZE, fmt, ap);
+    if (0 < g_atomic_int_get(&site->suppressed) && 0 <= len && LOG_MSG_SIZE > len)
+    {
+        const gint suppressed = g_atomic_int_exchange(&site->suppressed, 0);
+        if (0 < suppressed)
+        {
+            len += g_snprintf(buf + len, LOG_MSG_SIZE - len, " (%d similar suppressed)", suppressed);
+        }
+    }
+    return len;
+}
+
+// Report the messages suppressed since they were last reported
+static void flush_suppressed(void)
+{
+    for (struct log_site *site = g_atomic_pointer_get(&suppressing); NULL != site; site = site->next)
+    {
+        const gint suppressed = g_atomic_int_exchange(&site->suppressed, 0);
+        if (0 < suppressed)
+        {
+            char buf[LOG_MSG_SIZE];
+            g_snprintf(buf, sizeof(buf), "%s:%d: %d similar messages suppressed", site->file, site->line, suppressed);
+            output(LOG_WARNING, buf);
+        }
+    }
+}
+
+void log_write(struct log_site *site, int priority, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    if (!g_atomic_int_get(&run_logger))
+    {
+        // Before log_init() and after log_cleanup(), log synchronously
+        char buf[LOG_MSG_SIZE];
+        format_message(site, buf, fmt, ap);
+        output(priority, buf);
+        va_end(ap);
+        return;
+    }
+
+    struct log_entry *entry;
+    gint pos = g_atomic_int_get(&enqueue_pos);
+    for (;;)
+    {
+        entry = &ring[pos & (LOG_RING_SIZE - 1)];
+        const gint diff = g_atomic_int_get(&entry->seq) - pos;
+        if (0 == diff)
+        {
+            if (g_atomic_int_compare_and_exchange(&enqueue_pos, pos, pos + 1))
+            {
+                break;
+            }
+            pos = g_atomic_int_get(&enqueue_pos);
+        }
+        else if (0 > diff)
+        {
+            // Full, the logger thread is behind
+            g_atomic_int_inc(&dropped);
+            va_end(ap);
+            return;
+        }
+        else
+        {
+            pos = g_atomic_int_get(&enqueue_pos);
+        }
+    }
+
+    entry->priority = priority;
+    format_message(site, entry->msg, fmt, ap);
+    va_end(ap);
+    g_atomic_int_set(&entry->seq, pos + 1);
+    sem_post(&log_sem);
+}
+
+static gboolean drain(void)
+{
+    struct log_entry *entry = &ring[dequeue_pos & (LOG_RING_SIZE - 1)];
+    if ((gint)(dequeue_pos + 1) != g_atomic_int_get(&entry->seq))
+    {
+        return FALSE;
+    }
+    output(entry->priority, entry->msg);
+    g_atomic_int_set(&entry->seq, dequeue_pos + LOG_RING_SIZE);
+    dequeue_pos++;
+
+    const gint lost = g_atomic_int_exchange(&dropped, 0);
+    if (0 < lost)
+    {
+        char buf[64];
+        g_snprintf(buf, sizeof(buf), "Log buffer full, %d messages dropped", lost);
+        output(LOG_WARNING, buf);
+    }
+    return TRUE;
+}
+
+static void *run_logger_thread(void *arg)
+{
+    gint64 next_flush = g_get_monotonic_time() + LOG_SUPPRESSED_INTERVAL;
+
+    (void)arg;
+    while (g_atomic_int_get(&run_logger))
+    {
+        const struct timespec ts = {
+            .tv_sec = next_flush / G_USEC_PER_SEC,
+            .tv_nsec = (next_flush % G_USEC_PER_SEC) * 1000,
+        };
+        sem_clockwait(&log_sem, CLOCK_MONOTONIC, &ts);
+        while (drain())
+        {
+        }
+        if (g_get_monotonic_time() >= next_flush)
+        {
+            flush_suppressed();
+            next_flush = g_get_monotonic_time() + LOG_SUPPRESSED_INTERVAL;
+        }
+    }
+    pthread_exit(NULL);
+}
+
+void log_init(void)
+{
+    for (guint i = 0; i < LOG_RING_SIZE; i++)
+    {
+        ring[i].seq = i;
+    }
+    enqueue_pos = 0;
+    dequeue_pos = 0;
+    sem_init(&log_sem, 0, 0);
+    g_atomic_int_set(&run_logger, TRUE);
+    if (0 != pthread_create(&logger_thread_id, NULL, run_logger_thread, NULL))
+    {
+        g_atomic_int_set(&run_logger, FALSE);
+        sem_destroy(&log_sem);
+        LOG_E("%s/%s: Failed to create logger thread, logging synchronously", __FILE__, __FUNCTION__);
+    }
+}
+
+void log_cleanup(void)
+{
+    if (!g_atomic_int_get(&run_logger))
+    {
+        return;
+    }
+    g_atomic_int_set(&run_logger, FALSE);
+    sem_post(&log_sem);
+    pthread_join(logger_thread_id, NULL);
+
+    // Flush what was logged while the thread was stopping
+    while (drain())
+    {
+    }
+    flush_suppressed();
+    sem_destroy(&log_sem);
+}
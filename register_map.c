@@ -0,0 +1,308 @@
+/**
+ * Copyright (C) 2023, Axis Communications AB, Lund, Sweden
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <assert.h>
+#include <errno.h>
+
+#include "modbusacap_common.h"
+#include "register_map.h"
+
+// The image is written by the GMainLoop thread only and read by the server
+// through a sequence lock: the sequence number is odd while an update is in
+// progress, so readers retry instead of taking a lock
+struct register_image
+{
+    gboolean gateway;
+    guint nslots;
+    guint16 coil_addresses[REGMAP_MAX_SLOTS];
+    guint8 slot_units[REGMAP_MAX_SLOTS];
+    guint8 coils[REGMAP_MAX_SLOTS];
+    guint16 input_registers[REGMAP_MAX_SLOTS * REGMAP_IR_PER_SLOT];
+    guint8 unit_present[(G_MAXUINT8 + 1) / 8];
+};
+
+// The mapping of one unit and the coils last copied into it
+struct register_view
+{
+    modbus_mapping_t *mapping;
+    gint synced_seq;
+    guint synced_nslots;
+    guint16 synced_coil_addresses[REGMAP_MAX_SLOTS];
+};
+
+// Only used by the server; views are indexed by unit identifier, so requests
+// are routed at the same cost however many units there are, and allocated on
+// the first request for their unit. Without gateway mode, view 0 serves all.
+struct register_units
+{
+    gint seq;
+    struct register_image image;
+    struct register_view *views[G_MAXUINT8 + 1];
+};
+
+static struct register_image image;
+static volatile gint seq = 0;
+
+// The image is copied with plain loads and stores, so the fences keep them
+// from being reordered with the sequence number on weakly ordered CPUs
+static void write_begin(void)
+{
+    g_atomic_int_inc(&seq);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void write_end(void)
+{
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    g_atomic_int_inc(&seq);
+}
+
+static gboolean unit_present(const struct register_image *img, const guint8 unit)
+{
+    return 0 != (img->unit_present[unit >> 3] & (1 << (unit & 7)));
+}
+
+void register_map_set_slots(const guint16 *addresses, const guint8 *units, const guint nslots, const gboolean gateway)
+{
+    assert(REGMAP_MAX_SLOTS >= nslots);
+    write_begin();
+    image.gateway = gateway;
+    image.nslots = nslots;
+    memcpy(image.coil_addresses, addresses, nslots * sizeof(*addresses));
+    memcpy(image.slot_units, units, nslots * sizeof(*units));
+    memset(image.coils, 0, sizeof(image.coils));
+    memset(image.input_registers, 0, sizeof(image.input_registers));
+    memset(image.unit_present, 0, sizeof(image.unit_present));
+    for (guint slot = 0; slot < nslots; slot++)
+    {
+        image.unit_present[units[slot] >> 3] |= 1 << (units[slot] & 7);
+    }
+    write_end();
+}
+
+void register_map_publish(const guint slot, const gboolean active)
+{
+    assert(image.nslots > slot);
+    const guint32 now = g_get_real_time() / G_USEC_PER_SEC;
+    guint16 *regs = &image.input_registers[slot * REGMAP_IR_PER_SLOT];
+
+    write_begin();
+    image.coils[slot] = active;
+    if (active)
+    {
+        regs[REGMAP_IR_COUNTER]++;
+    }
+    regs[REGMAP_IR_TIME_HI] = now >> 16;
+    regs[REGMAP_IR_TIME_LO] = now & 0xFFFF;
+    write_end();
+}
+
+// Reset the counters of the slots of the unit in data, or of all slots if 0
+static gboolean reset_counters(gpointer data)
+{
+    const guint8 unit = GPOINTER_TO_UINT(data);
+    LOG_I("%s/%s: Resetting event counters", __FILE__, __FUNCTION__);
+    write_begin();
+    for (guint slot = 0; slot < image.nslots; slot++)
+    {
+        if (0 == unit || unit == image.slot_units[slot])
+        {
+            image.input_registers[slot * REGMAP_IR_PER_SLOT + REGMAP_IR_COUNTER] = 0;
+        }
+    }
+    write_end();
+    return G_SOURCE_REMOVE;
+}
+
+struct register_units *register_map_new_units(void)
+{
+    struct register_units *units = g_new0(struct register_units, 1);
+    units->seq = -1;
+    return units;
+}
+
+void register_map_free_units(struct register_units *units)
+{
+    if (NULL == units)
+    {
+        return;
+    }
+    for (guint i = 0; i < G_N_ELEMENTS(units->views); i++)
+    {
+        if (NULL != units->views[i])
+        {
+            modbus_mapping_free(units->views[i]->mapping);
+            g_free(units->views[i]);
+        }
+    }
+    g_free(units);
+}
+
+static struct register_view *new_view(const guint8 unit)
+{
+    struct register_view *view = g_new0(struct register_view, 1);
+    view->synced_seq = -1;
+    if (REGMAP_DIAG_UNIT == unit)
+    {
+        view->mapping = modbus_mapping_new(0, 0, 0, REGMAP_DIAG_REGISTERS);
+    }
+    else
+    {
+        // All coil addresses are mapped so that the slot coils can be moved
+        // without reallocating the mapping
+        view->mapping = modbus_mapping_new(
+            G_MAXUINT16 + 1,
+            0,
+            REGMAP_HOLDING_REGISTERS,
+            REGMAP_MAX_SLOTS * REGMAP_IR_PER_SLOT);
+    }
+    if (NULL == view->mapping)
+    {
+        LOG_E(
+            "%s/%s: Failed to allocate the mapping for unit %u (%s)",
+            __FILE__,
+            __FUNCTION__,
+            unit,
+            modbus_strerror(errno));
+        g_free(view);
+        return NULL;
+    }
+    return view;
+}
+
+// Copy the published image, if it has changed since the last request
+static void sync_image(struct register_units *units)
+{
+    for (;;)
+    {
+        const gint s1 = g_atomic_int_get(&seq);
+        if (s1 == units->seq)
+        {
+            return;
+        }
+        if (s1 & 1)
+        {
+            // Update in progress
+            continue;
+        }
+        units->image = image;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (s1 == g_atomic_int_get(&seq))
+        {
+            units->image.nslots = MIN(units->image.nslots, REGMAP_MAX_SLOTS);
+            units->seq = s1;
+            return;
+        }
+    }
+}
+
+// Copy the slots of unit, or all slots if 0, to the view; their input
+// registers are numbered in slot order
+static void sync_view(struct register_units *units, struct register_view *view, const guint8 unit)
+{
+    const struct register_image *img = &units->image;
+    modbus_mapping_t *mapping = view->mapping;
+    guint nslots = 0;
+
+    // Clear the coils of the previous slot configuration, then set the current state
+    for (guint slot = 0; slot < view->synced_nslots; slot++)
+    {
+        mapping->tab_bits[view->synced_coil_addresses[slot]] = 0;
+    }
+    memset(mapping->tab_input_registers, 0, mapping->nb_input_registers * sizeof(guint16));
+    for (guint slot = 0; slot < img->nslots; slot++)
+    {
+        if (0 != unit && unit != img->slot_units[slot])
+        {
+            continue;
+        }
+        mapping->tab_bits[img->coil_addresses[slot]] = img->coils[slot];
+        memcpy(
+            &mapping->tab_input_registers[nslots * REGMAP_IR_PER_SLOT],
+            &img->input_registers[slot * REGMAP_IR_PER_SLOT],
+            REGMAP_IR_PER_SLOT * sizeof(guint16));
+        view->synced_coil_addresses[nslots++] = img->coil_addresses[slot];
+    }
+    view->synced_nslots = nslots;
+    view->synced_seq = units->seq;
+}
+
+static void sync_diag(modbus_mapping_t *mapping, struct modbus_diag *diag, const guint offset)
+{
+    for (guint counter = 0; counter < MODBUS_DIAG_COUNTERS; counter++)
+    {
+        mapping->tab_input_registers[offset + counter] = modbus_diag_get(diag, counter);
+    }
+    mapping->tab_input_registers[offset + REGMAP_DIAG_EVENT_COUNT] = g_atomic_int_get(&diag->event_count);
+}
+
+// Index of the view serving unit, or -1 if there is no such unit
+static gint view_index(const struct register_units *units, const guint8 unit)
+{
+    if (!units->image.gateway)
+    {
+        return 0;
+    }
+    return REGMAP_DIAG_UNIT == unit || (0 != unit && unit_present(&units->image, unit)) ? unit : -1;
+}
+
+modbus_mapping_t *register_map_sync(struct register_units *units, const guint8 unit)
+{
+    assert(NULL != units);
+    sync_image(units);
+    const gint index = view_index(units, unit);
+    if (0 > index)
+    {
+        return NULL;
+    }
+    if (NULL == units->views[index])
+    {
+        units->views[index] = new_view(index);
+        if (NULL == units->views[index])
+        {
+            return NULL;
+        }
+    }
+
+    struct register_view *view = units->views[index];
+    if (REGMAP_DIAG_UNIT == index && units->image.gateway)
+    {
+        sync_diag(view->mapping, &modbus_diag_server, 0);
+        sync_diag(view->mapping, &modbus_diag_client, REGMAP_DIAG_CLIENT);
+    }
+    else if (view->synced_seq != units->seq)
+    {
+        sync_view(units, view, index);
+    }
+    return view->mapping;
+}
+
+void register_map_handle_control(struct register_units *units, const guint8 unit)
+{
+    assert(NULL != units);
+    const gint index = view_index(units, unit);
+    if (0 > index || NULL == units->views[index] || REGMAP_HR_CONTROL >= units->views[index]->mapping->nb_registers)
+    {
+        return;
+    }
+    modbus_mapping_t *mapping = units->views[index]->mapping;
+    if (mapping->tab_registers[REGMAP_HR_CONTROL] & REGMAP_CONTROL_RESET_COUNTERS)
+    {
+        mapping->tab_registers[REGMAP_HR_CONTROL] &= ~REGMAP_CONTROL_RESET_COUNTERS;
+        // The image is only written from the main loop
+        g_idle_add(reset_counters, GUINT_TO_POINTER(index));
+    }
+}
@@ -0,0 +1,63 @@
+/**
+ * Copyright (C) 2023, Axis Communications AB, Lund, Sweden
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _REGISTER_MAP_H_
+#define _REGISTER_MAP_H_
+
+#include <glib.h>
+#include <modbus.h>
+
+#include "modbus_diag.h"
+
+// Number of scenario slots in the register map
+#define REGMAP_MAX_SLOTS 32
+
+// Input registers per slot: event counter, last change time (Unix time, high and low word)
+#define REGMAP_IR_PER_SLOT 3
+#define REGMAP_IR_COUNTER 0
+#define REGMAP_IR_TIME_HI 1
+#define REGMAP_IR_TIME_LO 2
+
+// Holding registers; bit 0 in the control register resets all counters
+#define REGMAP_HOLDING_REGISTERS 8
+#define REGMAP_HR_CONTROL 0
+#define REGMAP_CONTROL_RESET_COUNTERS 0x0001
+
+// Gateway mode: units 1 to REGMAP_MAX_UNIT serve the slots of their scenario
+// and the diagnostics unit serves the communication counters
+#define REGMAP_MAX_UNIT 246
+#define REGMAP_DIAG_UNIT 247
+
+// Input registers of the diagnostics unit: the server counters in the order of
+// the FC08 sub-functions 0x0B-0x12 followed by the event count (FC11), and the
+// same for the client from REGMAP_DIAG_CLIENT
+#define REGMAP_DIAG_EVENT_COUNT MODBUS_DIAG_COUNTERS
+#define REGMAP_DIAG_CLIENT 16
+#define REGMAP_DIAG_REGISTERS (2 * REGMAP_DIAG_CLIENT)
+
+// The mappings of one server, one per unit
+struct register_units;
+
+void register_map_set_slots(const guint16 *addresses, const guint8 *units, const guint nslots, const gboolean gateway);
+void register_map_publish(const guint slot, const gboolean active);
+struct register_units *register_map_new_units(void);
+void register_map_free_units(struct register_units *units);
+// Returns the mapping serving unit, brought up to date with the published
+// image, or NULL if there is no such unit
+modbus_mapping_t *register_map_sync(struct register_units *units, const guint8 unit);
+void register_map_handle_control(struct register_units *units, const guint8 unit);
+
+#endif /* _REGISTER_MAP_H_ */
@@ -0,0 +1,218 @@
+/**
+ * Copyright (C) 2023, Axis Communications AB, Lund, Sweden
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <assert.h>
+
+#include "modbusacap_common.h"
+#include "scenario_map.h"
+
+static struct scenario_route routes[SCENARIO_MAP_MAX_ROUTES];
+static guint nroutes = 0;
+static guint16 slot_addresses[REGMAP_MAX_SLOTS];
+static guint8 slot_units[REGMAP_MAX_SLOTS];
+static guint nslots = 0;
+static gboolean gateway_mode = FALSE;
+
+// topic2 -> route, for routing events from the wildcard subscription
+static GHashTable *topics = NULL;
+
+static guint get_slot(const guint8 unit, const guint16 address)
+{
+    for (guint slot = 0; slot < nslots; slot++)
+    {
+        if (unit == slot_units[slot] && address == slot_addresses[slot])
+        {
+            return slot;
+        }
+    }
+    if (REGMAP_MAX_SLOTS <= nslots)
+    {
+        return REGMAP_MAX_SLOTS;
+    }
+    slot_addresses[nslots] = address;
+    slot_units[nslots] = unit;
+    return nslots++;
+}
+
+static gboolean add_route(const guint scenario, const gchar *subtype, const guint16 address)
+{
+    if (gateway_mode && REGMAP_MAX_UNIT < scenario)
+    {
+        LOG_E("%s/%s: Scenario %u has no unit identifier, ignoring it", __FILE__, __FUNCTION__, scenario);
+        return FALSE;
+    }
+    gchar *topic2 = g_strdup_printf("Device1Scenario%u%s", scenario, NULL == subtype ? "" : subtype);
+    struct scenario_route *route = g_hash_table_lookup(topics, topic2);
+
+    if (NULL != route)
+    {
+        // A later entry overrides an earlier one, e.g. "1:0,1Threshold:1"
+        g_free(topic2);
+    }
+    else if (SCENARIO_MAP_MAX_ROUTES <= nroutes)
+    {
+        LOG_E("%s/%s: Too many scenario routes, ignoring %s", __FILE__, __FUNCTION__, topic2);
+        g_free(topic2);
+        return FALSE;
+    }
+    else
+    {
+        route = &routes[nroutes++];
+        route->topic2 = topic2;
+        route->subscription = 0;
+        g_hash_table_insert(topics, route->topic2, route);
+    }
+
+    // The slot is allocated once all entries are parsed
+    route->address = address;
+    route->unit = gateway_mode ? scenario : 0;
+    LOG_I("%s/%s: Route %s to address %u", __FILE__, __FUNCTION__, route->topic2, address);
+    return TRUE;
+}
+
+// Parse one "<scenario>[Threshold]:<address>" entry; a scenario without
+// subtype routes both its base and Threshold events
+static gboolean parse_entry(const gchar *entry)
+{
+    gchar *end = NULL;
+    const guint64 scenario = g_ascii_strtoull(entry, &end, 10);
+    const gchar *subtype = NULL;
+
+    if (end == entry || 0 == scenario)
+    {
+        return FALSE;
+    }
+    if (g_str_has_prefix(end, "Threshold"))
+    {
+        subtype = "Threshold";
+        end += strlen(subtype);
+    }
+    if (':' != *end)
+    {
+        return FALSE;
+    }
+
+    const gchar *addr = end + 1;
+    const guint64 address = g_ascii_strtoull(addr, &end, 10);
+    if (end == addr || '\0' != *end || G_MAXUINT16 < address)
+    {
+        return FALSE;
+    }
+
+    if (NULL != subtype)
+    {
+        return add_route(scenario, subtype, address);
+    }
+    return add_route(scenario, NULL, address) && add_route(scenario, "Threshold", address);
+}
+
+// Allocate a slot per distinct unit and address of the final routes, so that
+// an overridden route leaves no slot behind; routes beyond the slots are dropped
+static gboolean allocate_slots(void)
+{
+    gboolean result = TRUE;
+    guint n = 0;
+
+    g_hash_table_remove_all(topics);
+    for (guint i = 0; i < nroutes; i++)
+    {
+        const guint slot = get_slot(routes[i].unit, routes[i].address);
+        if (REGMAP_MAX_SLOTS <= slot)
+        {
+            LOG_E("%s/%s: Too many distinct addresses, ignoring %s", __FILE__, __FUNCTION__, routes[i].topic2);
+            g_free(routes[i].topic2);
+            result = FALSE;
+            continue;
+        }
+        routes[n] = routes[i];
+        routes[n].slot = slot;
+        g_hash_table_insert(topics, routes[n].topic2, &routes[n]);
+        n++;
+    }
+    nroutes = n;
+    return result;
+}
+
+void scenario_map_clear(void)
+{
+    if (NULL != topics)
+    {
+        g_hash_table_destroy(topics);
+        topics = NULL;
+    }
+    for (guint i = 0; i < nroutes; i++)
+    {
+        g_free(routes[i].topic2);
+    }
+    nroutes = 0;
+    nslots = 0;
+}
+
+// Build the routes from a comma separated list of entries, or from the
+// single scenario and address if the list is empty
+gboolean scenario_map_build(const gchar *spec, const guint scenario, const guint16 address, const gboolean gateway)
+{
+    gboolean result = TRUE;
+
+    scenario_map_clear();
+    gateway_mode = gateway;
+    topics = g_hash_table_new(g_str_hash, g_str_equal);
+
+    gchar *list = g_strstrip(g_strdup(NULL == spec ? "" : spec));
+    if ('\0' == *list)
+    {
+        g_free(list);
+        result = add_route(scenario, NULL, address) && add_route(scenario, "Threshold", address);
+        return allocate_slots() && result;
+    }
+
+    gchar **entries = g_strsplit(list, ",", -1);
+    g_free(list);
+    for (gchar **entry = entries; NULL != *entry; entry++)
+    {
+        if (!parse_entry(g_strstrip(*entry)))
+        {
+            LOG_E("%s/%s: Invalid scenario map entry '%s'", __FILE__, __FUNCTION__, *entry);
+            result = FALSE;
+        }
+    }
+    g_strfreev(entries);
+    return allocate_slots() && result;
+}
+
+guint scenario_map_size(void)
+{
+    return nroutes;
+}
+
+struct scenario_route *scenario_map_get(const guint i)
+{
+    assert(nroutes > i);
+    return &routes[i];
+}
+
+const struct scenario_route *scenario_map_lookup(const gchar *topic2)
+{
+    return NULL == topics || NULL == topic2 ? NULL : g_hash_table_lookup(topics, topic2);
+}
+
+// Copy the coil address and unit of every slot, returns the number of slots
+guint scenario_map_slots(guint16 *addresses, guint8 *units)
+{
+    memcpy(addresses, slot_addresses, nslots * sizeof(*addresses));
+    memcpy(units, slot_units, nslots * sizeof(*units));
+    return nslots;
+}
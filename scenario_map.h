@@ -0,0 +1,44 @@
+/**
+ * Copyright (C) 2023, Axis Communications AB, Lund, Sweden
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _SCENARIO_MAP_H_
+#define _SCENARIO_MAP_H_
+
+#include <glib.h>
+
+#include "register_map.h"
+
+// Base and Threshold routes for every slot
+#define SCENARIO_MAP_MAX_ROUTES (2 * REGMAP_MAX_SLOTS)
+
+struct scenario_route
+{
+    gchar *topic2;      // e.g. "Device1Scenario1" or "Device1Scenario1Threshold"
+    guint slot;         // Register map slot, one per distinct unit and address
+    guint8 unit;        // Unit identifier in gateway mode, 0 otherwise
+    guint16 address;    // Coil address
+    guint subscription; // Event subscription id, 0 if not subscribed
+};
+
+// In gateway mode every scenario is served as its own unit, numbered as the scenario
+gboolean scenario_map_build(const gchar *spec, const guint scenario, const guint16 address, const gboolean gateway);
+guint scenario_map_size(void);
+struct scenario_route *scenario_map_get(const guint i);
+const struct scenario_route *scenario_map_lookup(const gchar *topic2);
+guint scenario_map_slots(guint16 *addresses, guint8 *units);
+void scenario_map_clear(void);
+
+#endif /* _SCENARIO_MAP_H_ */